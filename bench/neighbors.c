@@ -0,0 +1,142 @@
+/*
+ * Microbenchmark do kernel de pontuação da 8-vizinhança.
+ *
+ * Mede ns por decisão de grid_score_neighbors_scalar(), de
+ * grid_score_neighbors() (AVX2/SSE2, conforme a compilação) e de
+ * person_next_pos() completo (campo de distâncias + máscara de vizinhos
+ * livres + kernel) em um grid com obstáculos e pessoas aleatórios, com cada
+ * layout de células (GRID_LAYOUT_*).
+ *
+ * Uso: build/bench-neighbors [decisões]
+ */
+#include "grid.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct input_s {
+    pos_t pos, goal;
+    unsigned free_mask;
+    int dist[GRID_NEIGHBOR_COUNT];
+    int cur_dist;
+    int64_t cur_eucl;
+} input_t;
+
+#define N_INPUTS 4096
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static void mk_inputs(input_t* in, int n) {
+    for (int i = 0; i < n; ++i) {
+        in[i].pos = mk_pos(rand() % 1000, rand() % 1000);
+        in[i].goal = mk_pos(rand() % 1000, rand() % 1000);
+        in[i].free_mask = rand() & 0xff;
+        in[i].cur_dist = 1 + rand() % 1000;
+        int64_t dx = in[i].goal.x - in[i].pos.x, dy = in[i].goal.y - in[i].pos.y;
+        in[i].cur_eucl = dx*dx + dy*dy;
+        for (int j = 0; j < GRID_NEIGHBOR_COUNT; ++j)
+            in[i].dist[j] = in[i].cur_dist - 1 + rand() % 3 - (rand() % 8 == 0);
+    }
+}
+
+int main(int argc, char** argv) {
+    long n = argc > 1 ? atol(argv[1]) : 20000000;
+    srand(42);
+    input_t* in = malloc(N_INPUTS*sizeof(input_t));
+    mk_inputs(in, N_INPUTS);
+
+    for (int i = 0; i < N_INPUTS; ++i) {
+        for (int k = 0; k < 2; ++k) {
+            const int* dist = k ? in[i].dist : NULL;
+            int a = grid_score_neighbors_scalar(dist, in[i].pos, in[i].goal,
+                        in[i].free_mask, in[i].cur_dist, in[i].cur_eucl);
+            int b = grid_score_neighbors(dist, in[i].pos, in[i].goal,
+                        in[i].free_mask, in[i].cur_dist, in[i].cur_eucl);
+            if (a != b) {
+                printf("Kernels divergem na entrada %d (dist=%s): %d != %d\n",
+                       i, dist ? "campo" : "NULL", a, b);
+                return 1;
+            }
+        }
+    }
+
+    volatile int sink = 0;
+    double t0 = now_ns();
+    for (long i = 0; i < n; ++i) {
+        input_t* x = in + (i % N_INPUTS);
+        sink += grid_score_neighbors_scalar(x->dist, x->pos, x->goal,
+                    x->free_mask, x->cur_dist, x->cur_eucl);
+    }
+    double t1 = now_ns();
+    for (long i = 0; i < n; ++i) {
+        input_t* x = in + (i % N_INPUTS);
+        sink += grid_score_neighbors(x->dist, x->pos, x->goal,
+                    x->free_mask, x->cur_dist, x->cur_eucl);
+    }
+    double t2 = now_ns();
+    printf("kernel,scalar,%.2f ns/decision\n", (t1-t0)/n);
+#if defined(__AVX2__)
+    printf("kernel,avx2,%.2f ns/decision\n", (t2-t1)/n);
+#elif defined(__SSE2__)
+    printf("kernel,sse2,%.2f ns/decision\n", (t2-t1)/n);
+#else
+    printf("kernel,scalar (fallback),%.2f ns/decision\n", (t2-t1)/n);
+#endif
+
+    // Decisão completa: 1000x1000, 10% de obstáculos, 20% de pessoas
+    grid_t grid;
+    grid_init(&grid, 1000, 1000);
+    int n_persons = 200000;
+    person_t* persons = malloc(n_persons*sizeof(person_t));
+    for (int y = 0; y < 1000; ++y) {
+        for (int x = 0; x < 1000; ++x) {
+            if (rand() % 10 == 0)
+                grid_set(&grid, mk_pos(x, y), GRID_OBJ_OBSTACLE);
+        }
+    }
+    for (int i = 0; i < n_persons; ++i) {
+        person_init(persons+i, i);
+        persons[i].goal_pos = mk_pos(999, 500);
+        pos_t p;
+        do {
+            p = mk_pos(rand() % 1000, rand() % 1000);
+        } while (grid_get(&grid, p, NULL) != GRID_OBJ_EMPTY);
+        grid_set_person(&grid, p, persons+i);
+    }
+    person_next_pos(persons, &grid); // calcula o campo fora da medição
+    pos_t* expected = malloc(n_persons*sizeof(pos_t));
+    for (int i = 0; i < n_persons; ++i)
+        expected[i] = person_next_pos(persons+i, &grid);
+    static const char* layout_names[] = {"rows", "morton"};
+    long n_full = n / 4;
+    for (int layout = GRID_LAYOUT_ROWS; layout <= GRID_LAYOUT_MORTON; ++layout) {
+        grid_set_layout(&grid, layout);
+        for (int i = 0; i < n_persons; ++i) {
+            if (!pos_equals(person_next_pos(persons+i, &grid), expected[i])) {
+                printf("Layout %s diverge na pessoa %d\n",
+                       layout_names[layout], i);
+                return 1;
+            }
+        }
+        double t3 = now_ns();
+        for (long i = 0; i < n_full; ++i) {
+            pos_t next = person_next_pos(persons + (i % n_persons), &grid);
+            sink += next.x;
+        }
+        double t4 = now_ns();
+        printf("person_next_pos,field,%s,%.2f ns/decision\n",
+               layout_names[layout], (t4-t3)/n_full);
+    }
+    free(expected);
+
+    for (int i = 0; i < n_persons; ++i)
+        person_destroy(persons+i);
+    free(persons);
+    grid_destroy(&grid);
+    free(in);
+    return 0;
+}
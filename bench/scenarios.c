@@ -0,0 +1,303 @@
+/*
+ * Benchmark da simulação completa em cenários sintéticos.
+ *
+ * Gera um grid com obstáculos aleatórios e pessoas cujos objetivos seguem
+ * uma distribuição (converge, crossflow, headon ou random), roda a
+ * simulação para n_threads = 1, 2, 4, ... até o máximo e imprime uma linha
+ * CSV por execução. Cada execução termina quando todas as pessoas chegam,
+ * ou no limite de turnos ou de segundos.
+ *
+ * Colunas: turns/s e moves/s são por segundo de parede; ns_per_decision é o
+ * tempo de parede por pessoa processada; speedup é a razão entre as decisões
+ * por segundo da execução e as da execução com 1 thread do mesmo cenário e
+ * modo.
+ *
+ * Uso: build/bench-scenarios [-W largura] [-H altura] [-n pessoas]
+ *          [-d densidade de obstáculos] [-g converge|crossflow|headon|random]
+ *          [-m locked|det|bands|event|coop|all] [-t threads máx.]
+ *          [-T turnos máx.] [-S segundos máx.] [-s semente] [-r repetições]
+ *          [-o cenario.scn] [-c checkpoint.scn] [-l rows|morton]
+ *          [-G período]
+ *
+ * -l escolhe a ordem das células do grid (veja GRID_LAYOUT_*) e -G o período
+ * da busca por gridlocks (0 desliga; veja simulation_set_gridlock()). arrived
+ * conta também as pessoas removidas por não alcançarem o objetivo
+ * (stranded); cycles são os ciclos de espera desfeitos e reroutes os
+ * desvios dados a quem estava preso num beco. Uma execução em que as
+ * pessoas restantes ficam todas travadas (veja sim_stats_t.stalled) termina
+ * na hora.
+ *
+ * Com -o, só grava o cenário gerado (veja scenario.h) e termina; o arquivo
+ * pode ser passado ao programa principal no lugar de um .test. Com -c, cada
+ * execução que para antes de todos chegarem grava em checkpoint.scn (veja
+ * simulation_checkpoint()) de onde estava, para retomá-la da mesma forma.
+ */
+#include "simulation.h"
+#include "scenario.h"
+#include "store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GOALS_CONVERGE  0 ///< todos vão ao meio da borda direita
+#define GOALS_CROSSFLOW 1 ///< metade para a direita, metade para baixo
+#define GOALS_HEADON    2 ///< metade para cada lado, nas mesmas linhas
+#define GOALS_RANDOM    3
+
+static const char* goal_names[] = {"converge", "crossflow", "headon", "random"};
+static const char* mode_names[] = {"locked", "det", "bands", "event",
+                                    "coop"};
+static const char* layout_names[] = {"rows", "morton"};
+
+typedef struct params_s {
+    int width, height, n_persons;
+    double density;
+    int goals;
+    int mode; ///< SIM_MODE_* ou -1 (todos)
+    int max_threads;
+    size_t max_turns;
+    double max_seconds;
+    unsigned long seed;
+    int repeats;
+    const char* out;
+    const char* checkpoint;
+    int layout; ///< GRID_LAYOUT_*
+    int gridlock_period;
+} params_t;
+
+static uint64_t rng_next(uint64_t* s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/**
+ * Inteiro uniforme em [lo, hi).
+ */
+static int rng_range(uint64_t* s, int lo, int hi) {
+    return hi > lo ? lo + (int)(rng_next(s) % (uint64_t)(hi - lo)) : lo;
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static int parse_name(const char* arg, const char** names, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (!strcmp(arg, names[i]))
+            return i;
+    }
+    return -2;
+}
+
+/**
+ * Sorteia a origem e o objetivo da i-ésima pessoa conforme p->goals.
+ */
+static void pick(const params_t* p, uint64_t* rng, int i, pos_t* from,
+                 pos_t* to) {
+    int w = p->width, h = p->height;
+    switch (p->goals) {
+    case GOALS_CONVERGE:
+        *from = mk_pos(rng_range(rng, 0, w/2), rng_range(rng, 0, h));
+        *to = mk_pos(w-1, h/2);
+        break;
+    case GOALS_CROSSFLOW:
+        if (i % 2) {
+            *from = mk_pos(rng_range(rng, 0, w/4), rng_range(rng, 0, h));
+            *to = mk_pos(w-1, from->y);
+        } else {
+            *from = mk_pos(rng_range(rng, 0, w), rng_range(rng, 0, h/4));
+            *to = mk_pos(from->x, h-1);
+        }
+        break;
+    case GOALS_HEADON:
+        *from = mk_pos(rng_range(rng, 0, w/3), rng_range(rng, 0, h));
+        *to = mk_pos(w-1, from->y);
+        if (i % 2) {
+            from->x = w-1 - from->x;
+            to->x = 0;
+        }
+        break;
+    default:
+        *from = mk_pos(rng_range(rng, 0, w), rng_range(rng, 0, h));
+        *to = mk_pos(rng_range(rng, 0, w), rng_range(rng, 0, h));
+        break;
+    }
+}
+
+/**
+ * Gera o cenário em sim->grid e pluga as pessoas (acrescentadas a persons).
+ * Retorna quantas foram plugadas: origens ocupadas são sorteadas de novo
+ * algumas vezes antes de desistir.
+ */
+static int generate(const params_t* p, simulation_t* sim, store_t* persons) {
+    grid_t* g = &sim->grid;
+    uint64_t rng = p->seed*2654435761u + 1;
+    uint64_t threshold = (uint64_t)(p->density * (double)UINT32_MAX);
+    pos_t c;
+    // sem obstáculos, não percorre a área (grids enormes e esparsos)
+    for (c.y = 0; threshold && c.y < p->height; ++c.y) {
+        for (c.x = 0; c.x < p->width; ++c.x) {
+            if ((rng_next(&rng) & UINT32_MAX) < threshold)
+                grid_set(g, c, GRID_OBJ_OBSTACLE);
+        }
+    }
+    int n = 0;
+    for (int i = 0; i < p->n_persons; ++i) {
+        pos_t from, to;
+        int ok = 0;
+        for (int attempt = 0; !ok && attempt < 64; ++attempt) {
+            pick(p, &rng, i, &from, &to);
+            ok = !pos_equals(from, to)
+                 && grid_get(g, from, NULL) == GRID_OBJ_EMPTY;
+        }
+        if (!ok)
+            continue;
+        // o objetivo nunca é um obstáculo
+        if (grid_get(g, to, NULL) == GRID_OBJ_OBSTACLE)
+            grid_set(g, to, GRID_OBJ_EMPTY);
+        store_handle_t h = store_add(persons, ++n, from, to, 0);
+        simulation_plug_unsafe(sim, store_get(persons, h));
+    }
+    return n;
+}
+
+typedef struct result_s {
+    double seconds;
+    sim_stats_t stats;
+    int plugged, arrived;
+} result_t;
+
+static void run(const params_t* p, int mode, int n_threads, result_t* r) {
+    simulation_t sim;
+    simulation_init(&sim, n_threads, p->width, p->height);
+    simulation_set_mode(&sim, mode);
+    simulation_set_layout(&sim, p->layout);
+    simulation_set_gridlock(&sim, (unsigned)p->gridlock_period);
+    store_t persons;
+    store_init(&persons);
+    r->plugged = generate(p, &sim, &persons);
+    person_group_t group;
+    person_group_init(&group);
+    for (int i = 0; i < r->plugged; ++i)
+        person_group_add(&group, store_get(&persons, i));
+
+    double t0 = now_s();
+    simulation_start(&sim);
+    struct timespec ts = {0, 1000000};
+    while (atomic_load(&group.pending) > 0) {
+        nanosleep(&ts, NULL);
+        simulation_get_stats(&sim, &r->stats);
+        // quem sobrou está travado: nada muda sem novos pedidos
+        if (r->stats.turns >= p->max_turns || now_s() - t0 >= p->max_seconds
+            || r->stats.stalled) {
+            break;
+        }
+    }
+    r->arrived = r->plugged - atomic_load(&group.pending);
+    r->seconds = now_s() - t0;
+    if (p->checkpoint && r->arrived < r->plugged) {
+        int err = simulation_checkpoint(&sim, p->checkpoint);
+        if (err)
+            fprintf(stderr, "%s: %s\n", p->checkpoint, strerror(err));
+    }
+    simulation_get_stats(&sim, &r->stats);
+    simulation_destroy(&sim);
+    person_group_join(&group); // simulation_destroy() libera quem restou
+    store_destroy(&persons);
+}
+
+static int write_scenario(const params_t* p) {
+    simulation_t sim;
+    simulation_init(&sim, 1, p->width, p->height);
+    store_t persons;
+    store_init(&persons);
+    int n = generate(p, &sim, &persons);
+    scenario_t s;
+    scenario_create(&s, &sim.grid, 0, n, 0, 0);
+    for (int i = 0; i < n; ++i)
+        scenario_pack(s.persons+i, store_get(&persons, i));
+    int err = scenario_save(&s, p->out);
+    if (err)
+        fprintf(stderr, "%s: %s\n", p->out, strerror(err));
+    scenario_close(&s);
+    simulation_destroy(&sim);
+    store_destroy(&persons);
+    return err ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    params_t p = {1000, 1000, 10000, 0.05, GOALS_CONVERGE, SIM_MODE_LOCKED,
+                  (int)sysconf(_SC_NPROCESSORS_ONLN), 1000, 30, 42, 1, NULL,
+                  NULL, GRID_LAYOUT_ROWS, SIM_GRIDLOCK_PERIOD};
+    int opt;
+    while ((opt = getopt(argc, argv, "W:H:n:d:g:m:t:T:S:s:r:o:c:l:G:")) != -1) {
+        switch (opt) {
+        case 'W': p.width = atoi(optarg); break;
+        case 'H': p.height = atoi(optarg); break;
+        case 'n': p.n_persons = atoi(optarg); break;
+        case 'd': p.density = atof(optarg); break;
+        case 'g': p.goals = parse_name(optarg, goal_names, 4); break;
+        case 'm':
+            p.mode = strcmp(optarg, "all") ? parse_name(optarg, mode_names, 5)
+                                           : -1;
+            break;
+        case 't': p.max_threads = atoi(optarg); break;
+        case 'T': p.max_turns = strtoul(optarg, NULL, 10); break;
+        case 'S': p.max_seconds = atof(optarg); break;
+        case 's': p.seed = strtoul(optarg, NULL, 10); break;
+        case 'r': p.repeats = atoi(optarg); break;
+        case 'o': p.out = optarg; break;
+        case 'c': p.checkpoint = optarg; break;
+        case 'l': p.layout = parse_name(optarg, layout_names, 2); break;
+        case 'G': p.gridlock_period = atoi(optarg); break;
+        default: return 1;
+        }
+    }
+    if (p.width <= 0 || p.height <= 0 || p.n_persons < 0 || p.goals < 0
+        || p.mode < -1 || p.max_threads <= 0 || p.repeats <= 0
+        || p.layout < 0 || p.gridlock_period < 0) {
+        fprintf(stderr, "Parâmetros inválidos (veja o início de "
+                        "bench/scenarios.c)\n");
+        return 1;
+    }
+    if (p.out)
+        return write_scenario(&p);
+
+    printf("scenario,width,height,persons,density,mode,threads,repeat,"
+           "turns,seconds,turns_per_s,moves_per_s,ns_per_decision,speedup,"
+           "arrived,layout,cycles,reroutes,stranded\n");
+    int mode_lo = p.mode < 0 ? 0 : p.mode;
+    int mode_hi = p.mode < 0 ? SIM_MODE_COOPERATIVE : p.mode;
+    for (int mode = mode_lo; mode <= mode_hi; ++mode) {
+        double base = 0; // decisões/s com 1 thread
+        for (int t = 1; ; t = t*2 < p.max_threads ? t*2 : p.max_threads) {
+            for (int rep = 0; rep < p.repeats; ++rep) {
+                result_t r;
+                run(&p, mode, t, &r);
+                double s = r.seconds > 0 ? r.seconds : 1e-9;
+                double decisions = r.stats.steps / s;
+                if (t == 1 && rep == 0)
+                    base = decisions;
+                printf("%s,%d,%d,%d,%.3f,%s,%d,%d,%zu,%.4f,%.1f,%.1f,%.2f,"
+                       "%.3f,%d/%d,%s,%zu,%zu,%zu\n", goal_names[p.goals],
+                       p.width, p.height, r.plugged, p.density, mode_names[mode], t, rep,
+                       r.stats.turns, r.seconds, r.stats.turns / s,
+                       r.stats.moves / s,
+                       r.stats.steps ? s*1e9 / r.stats.steps : 0.0,
+                       base > 0 ? decisions / base : 0.0, r.arrived, r.plugged,
+                       layout_names[p.layout], r.stats.gridlock.cycles,
+                       r.stats.gridlock.reroutes, r.stats.gridlock.stranded);
+                fflush(stdout);
+            }
+            if (t == p.max_threads)
+                break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "deque.h"
+#include <stdlib.h>
+#include <assert.h>
+
+static deque_array_t* deque_array_new(int64_t capacity) {
+    deque_array_t* a = malloc(sizeof(deque_array_t)
+                              + capacity*sizeof(_Atomic(void*)));
+    a->capacity = capacity;
+    a->retired = NULL;
+    return a;
+}
+
+void deque_init(deque_t* d, size_t capacity) {
+    assert(capacity > 0);
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, deque_array_new(capacity));
+}
+
+void deque_destroy(deque_t* d) {
+    deque_array_t* a = atomic_load(&d->array);
+    while (a) {
+        deque_array_t* next = a->retired;
+        free(a);
+        a = next;
+    }
+}
+
+static deque_array_t* deque_grow(deque_t* d, deque_array_t* a,
+                                 int64_t top, int64_t bottom) {
+    deque_array_t* bigger = deque_array_new(2*a->capacity);
+    for (int64_t i = top; i < bottom; ++i) {
+        void* val = atomic_load_explicit(a->buf + i % a->capacity,
+                                         memory_order_relaxed);
+        atomic_store_explicit(bigger->buf + i % bigger->capacity, val,
+                              memory_order_relaxed);
+    }
+    bigger->retired = a;
+    atomic_store_explicit(&d->array, bigger, memory_order_release);
+    return bigger;
+}
+
+void deque_push(deque_t* d, void* val) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    deque_array_t* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    if (b - t > a->capacity - 1)
+        a = deque_grow(d, a, t, b);
+    atomic_store_explicit(a->buf + b % a->capacity, val, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+}
+
+int deque_pop(deque_t* d, void** out) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    deque_array_t* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) { // vazio
+        atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+        return 0;
+    }
+    *out = atomic_load_explicit(a->buf + b % a->capacity, memory_order_relaxed);
+    if (t == b) {
+        // último elemento: disputa com os ladrões pelo topo
+        int won = atomic_compare_exchange_strong_explicit(&d->top, &t, t+1,
+                      memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+        return won;
+    }
+    return 1;
+}
+
+int deque_steal(deque_t* d, void** out) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return DEQUE_EMPTY;
+    deque_array_t* a = atomic_load_explicit(&d->array, memory_order_acquire);
+    void* val = atomic_load_explicit(a->buf + t % a->capacity,
+                                     memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t+1,
+                memory_order_seq_cst, memory_order_relaxed)) {
+        return DEQUE_ABORT;
+    }
+    *out = val;
+    return DEQUE_OK;
+}
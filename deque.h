@@ -0,0 +1,55 @@
+#ifndef __DEQUE_H__
+#define __DEQUE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "queue.h"
+
+/**
+ * Vetor circular de um deque_t. Quando enche, o dono aloca um vetor com o
+ * dobro da capacidade; o antigo vai para a lista retired, pois ladrões ainda
+ * podem estar lendo dele, e só é liberado em deque_destroy().
+ */
+typedef struct deque_array_s {
+    int64_t capacity;
+    struct deque_array_s* retired;
+    _Atomic(void*) buf[];
+} deque_array_t;
+
+/**
+ * Deque de work-stealing de Chase-Lev (na versão para modelos de memória
+ * fracos de Lê et al., PPoPP 2013). Só a thread dona chama deque_push() e
+ * deque_pop(), que operam no fundo (bottom); qualquer outra thread pode
+ * chamar deque_steal(), que retira do topo (top).
+ */
+typedef struct {
+    _Atomic(int64_t) top;
+    char pad0[QUEUE_CACHE_LINE - sizeof(int64_t)];
+    _Atomic(int64_t) bottom;
+    _Atomic(deque_array_t*) array;
+    char pad1[QUEUE_CACHE_LINE];
+} deque_t;
+
+#define DEQUE_EMPTY 0 ///< não havia elementos
+#define DEQUE_OK    1 ///< um elemento foi retirado
+#define DEQUE_ABORT 2 ///< perdeu a disputa com outra thread; tente de novo
+
+extern void deque_init(deque_t* d, size_t capacity);
+extern void deque_destroy(deque_t* d);
+/**
+ * Empilha val no fundo. Só pode ser chamada pela thread dona.
+ */
+extern void deque_push(deque_t* d, void* val);
+/**
+ * Retira do fundo (LIFO). Só pode ser chamada pela thread dona. Retorna 1 e
+ * coloca o valor em *out, ou retorna 0 se o deque está vazio.
+ */
+extern  int deque_pop(deque_t* d, void** out);
+/**
+ * Retira do topo (FIFO). Pode ser chamada por qualquer thread. Retorna
+ * DEQUE_OK, DEQUE_EMPTY ou DEQUE_ABORT.
+ */
+extern  int deque_steal(deque_t* d, void** out);
+
+#endif /*__DEQUE_H__*/
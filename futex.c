@@ -0,0 +1,68 @@
+#ifdef __linux__
+#define _GNU_SOURCE // syscall()
+#endif
+#include "futex.h"
+#include <limits.h>
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+void futex_wait(atomic_int* addr, int expected) {
+    syscall(SYS_futex, (int*)addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void futex_wake_all(atomic_int* addr) {
+    syscall(SYS_futex, (int*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#else /*__linux__*/
+
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define FUTEX_BUCKETS 64
+
+/**
+ * Emulação: quem espera testa *addr com o mutex do bucket travado, e quem
+ * acorda trava o mesmo mutex depois de alterar *addr, então o broadcast não
+ * se perde.
+ */
+static struct futex_bucket_s {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+} futex_buckets[FUTEX_BUCKETS];
+static pthread_once_t futex_once = PTHREAD_ONCE_INIT;
+
+static void futex_init_buckets() {
+    for (int i = 0; i < FUTEX_BUCKETS; ++i) {
+        int err;
+        err = pthread_mutex_init(&futex_buckets[i].mtx, NULL); assert(!err);
+        err = pthread_cond_init(&futex_buckets[i].cond, NULL);  assert(!err);
+    }
+}
+
+static struct futex_bucket_s* futex_bucket(atomic_int* addr) {
+    pthread_once(&futex_once, futex_init_buckets);
+    return futex_buckets + ((uintptr_t)addr >> 4) % FUTEX_BUCKETS;
+}
+
+void futex_wait(atomic_int* addr, int expected) {
+    struct futex_bucket_s* b = futex_bucket(addr);
+    pthread_mutex_lock(&b->mtx);
+    if (atomic_load(addr) == expected)
+        pthread_cond_wait(&b->cond, &b->mtx);
+    pthread_mutex_unlock(&b->mtx);
+}
+
+void futex_wake_all(atomic_int* addr) {
+    struct futex_bucket_s* b = futex_bucket(addr);
+    pthread_mutex_lock(&b->mtx);
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->mtx);
+}
+
+#endif /*__linux__*/
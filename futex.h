@@ -0,0 +1,20 @@
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#include <stdatomic.h>
+
+/**
+ * Espera enquanto *addr == expected. Pode retornar sem que *addr tenha
+ * mudado (acordar espúrio): quem chama deve testar a condição de novo.
+ *
+ * No Linux usa FUTEX_WAIT_PRIVATE diretamente; nos demais sistemas (Mac OS)
+ * usa um mutex e uma variável de condição escolhidos por um hash de addr.
+ */
+extern void futex_wait(atomic_int* addr, int expected);
+/**
+ * Acorda todas as threads em futex_wait(addr, ...). Deve ser chamada depois
+ * de alterar *addr.
+ */
+extern void futex_wake_all(atomic_int* addr);
+
+#endif /*__FUTEX_H__*/
@@ -1,10 +1,22 @@
 #include "grid.h"
+#include "futex.h"
+#include "lockprof.h"
 #include <string.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <limits.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Um único site para todos os tiles: o relatório mostra a contenção do grid
+ * como um todo, não a de cada tile.
+ */
+LOCKPROF_SITE(grid_tiles_site, "grid tiles");
 
 /* --- --- --- --- pos_t  --- --- --- --- */
 
@@ -27,13 +39,109 @@ int pos_equals(pos_t a, pos_t b) {
 /* --- --- --- --- grid_t  --- --- --- --- */
 
 void grid_init(grid_t* grid, int width, int height) {
-    grid->data = calloc(width*height, sizeof(person_t*));
+    grid_init_tiled(grid, width, height, GRID_DEFAULT_TILE_SIZE);
+}
+
+/**
+ * 32 células GRID_OBJ_OBSTACLE.
+ */
+#define GRID_WORD_OBSTACLES 0xaaaaaaaaaaaaaaaaull
+#define GRID_CHUNK_MASK     (GRID_CHUNK_SIZE-1)
+
+static grid_chunk_t* grid_chunk_new(uint64_t word, int obstacles) {
+    grid_chunk_t* c = malloc(sizeof(grid_chunk_t));
+    for (int i = 0; i < GRID_CHUNK_WORDS; ++i)
+        atomic_init(c->words+i, word);
+    atomic_init(&c->slots, NULL);
+    atomic_init(&c->obstacles, obstacles);
+    atomic_init(&c->persons, 0);
+    return c;
+}
+
+static void grid_chunk_free(grid_chunk_t* c) {
+    free(atomic_load(&c->slots));
+    free(c);
+}
+
+void grid_init_tiled(grid_t* grid, int width, int height, int tile_size) {
+    grid_init_layout(grid, width, height, tile_size, GRID_LAYOUT_ROWS);
+}
+
+void grid_init_layout(grid_t* grid, int width, int height, int tile_size,
+                      int layout) {
+    assert(tile_size > 0);
+    if (layout != GRID_LAYOUT_ROWS && layout != GRID_LAYOUT_MORTON)
+        abort();
+    grid->layout = layout;
     grid->width = width;
     grid->height = height;
+    grid->chunks_x = (width  + GRID_CHUNK_MASK) >> GRID_CHUNK_BITS;
+    grid->chunks_y = (height + GRID_CHUNK_MASK) >> GRID_CHUNK_BITS;
+    size_t n_chunks = (size_t)grid->chunks_x * grid->chunks_y;
+    grid->empty_chunk = grid_chunk_new(0, 0);
+    grid->obstacle_chunk = grid_chunk_new(GRID_WORD_OBSTACLES, 0);
+    grid->chunks = malloc(n_chunks * sizeof(grid_chunk_t*));
+    for (size_t i = 0; i < n_chunks; ++i)
+        atomic_init(grid->chunks+i, grid->empty_chunk);
+    grid->drained = malloc(n_chunks * sizeof(uint32_t));
+    atomic_init(&grid->n_drained, 0);
+    grid->drained_mark = calloc(n_chunks, sizeof(atomic_uchar));
+    grid->tile_size = tile_size;
+    grid->tiles_x = (width  + tile_size - 1) / tile_size;
+    grid->tiles_y = (height + tile_size - 1) / tile_size;
+    long long n_tiles = (long long)grid->tiles_x * grid->tiles_y;
+    grid->n_tile_locks = n_tiles < GRID_MAX_TILE_LOCKS ? (int)n_tiles
+                                                       : GRID_MAX_TILE_LOCKS;
+    grid->slots = calloc(GRID_SLOT_CHUNKS, sizeof(person_t**));
+    atomic_init(&grid->n_slots, 1);
+    grid->tile_locks = malloc(grid->n_tile_locks * sizeof(pthread_mutex_t));
+    for (int i = 0; i < grid->n_tile_locks; ++i) {
+        int err = pthread_mutex_init(grid->tile_locks+i, NULL);
+        assert(!err);
+    }
+    int err = pthread_mutex_init(&grid->fields_mtx, NULL);
+    assert(!err);
+    grid->fields = calloc(GRID_FIELD_BUCKETS, sizeof(grid_field_t*));
+    grid->retired_fields = NULL;
+    grid->fields_cells = 0;
+    grid->fields_max = GRID_FIELD_MAX_CELLS;
+    grid->obstacles_version = 0;
+    grid->on_free = NULL;
+    grid->on_free_ctx = NULL;
+}
+
+static void grid_field_free_list(grid_field_t* f) {
+    while (f) {
+        grid_field_t* next = f->next;
+        free(f->dist);
+        free(f);
+        f = next;
+    }
 }
 
 void grid_destroy(grid_t* grid) {
-    free(grid->data);
+    for (int i = 0; i < GRID_FIELD_BUCKETS; ++i)
+        grid_field_free_list(grid->fields[i]);
+    grid_field_free_list(grid->retired_fields);
+    free(grid->fields);
+    pthread_mutex_destroy(&grid->fields_mtx);
+    for (int i = 0; i < grid->n_tile_locks; ++i)
+        pthread_mutex_destroy(grid->tile_locks+i);
+    size_t n_chunks = (size_t)grid->chunks_x * grid->chunks_y;
+    for (size_t i = 0; i < n_chunks; ++i) {
+        grid_chunk_t* c = atomic_load(grid->chunks+i);
+        if (c != grid->empty_chunk && c != grid->obstacle_chunk)
+            grid_chunk_free(c);
+    }
+    grid_chunk_free(grid->empty_chunk);
+    grid_chunk_free(grid->obstacle_chunk);
+    for (int i = 0; i < GRID_SLOT_CHUNKS && grid->slots[i]; ++i)
+        free(grid->slots[i]);
+    free(grid->slots);
+    free(grid->tile_locks);
+    free(grid->chunks);
+    free(grid->drained);
+    free(grid->drained_mark);
 }
 
 int grid_isvalid(grid_t* grid, pos_t pos) {
@@ -43,36 +151,795 @@ int grid_isvalid(grid_t* grid, pos_t pos) {
     return ok;
 }
 
-int grid_get(grid_t* grid, pos_t pos, person_t** out_person) {
-    assert(grid_isvalid(grid, pos));
-    ptrdiff_t* ptr = (ptrdiff_t*)grid->data + (pos.y * grid->width + pos.x);
-    ptrdiff_t type = *ptr;
-    if (type < GRID_OBJ__MIN || type > GRID_OBJ__MAX) {
-        type = GRID_OBJ_PERSON;
-        if (out_person)
-            *out_person = *(person_t**)ptr;
+static inline _Atomic(grid_chunk_t*)* grid_chunk_link(grid_t* grid, pos_t pos) {
+    return grid->chunks + (size_t)(pos.y >> GRID_CHUNK_BITS)*grid->chunks_x
+                        + (pos.x >> GRID_CHUNK_BITS);
+}
+
+static inline grid_chunk_t* grid_chunk_at(grid_t* grid, pos_t pos) {
+    return atomic_load_explicit(grid_chunk_link(grid, pos),
+                                memory_order_acquire);
+}
+
+/**
+ * Bits 0..5 de v nas posições pares 0..10.
+ */
+static inline unsigned grid_spread6(unsigned v) {
+    v = (v | v << 4) & 0x0f0f;
+    v = (v | v << 2) & 0x3333;
+    return (v | v << 1) & 0x5555;
+}
+
+/**
+ * Índice da célula pos dentro do seu bloco, na ordem layout.
+ */
+static inline int grid_cell_index(int layout, pos_t pos) {
+    unsigned x = pos.x & GRID_CHUNK_MASK, y = pos.y & GRID_CHUNK_MASK;
+    if (layout == GRID_LAYOUT_MORTON)
+        return grid_spread6(x) | grid_spread6(y) << 1;
+    return y << GRID_CHUNK_BITS | x;
+}
+
+/**
+ * Índice da célula pos na tabela de slots do seu bloco (linha a linha em
+ * qualquer layout).
+ */
+static inline int grid_slot_index(pos_t pos) {
+    return (pos.y & GRID_CHUNK_MASK) << GRID_CHUNK_BITS
+         | (pos.x & GRID_CHUNK_MASK);
+}
+
+static inline int grid_cell_type(grid_t* grid, pos_t pos) {
+    int i = grid_cell_index(grid->layout, pos);
+    uint64_t word = atomic_load_explicit(grid_chunk_at(grid, pos)->words
+                                         + (i >> 5), memory_order_relaxed);
+    return (word >> 2*(i & 31)) & GRID_OBJ__MASK;
+}
+
+/**
+ * Número de células do bloco de pos que estão dentro do grid.
+ */
+static int grid_chunk_cells(grid_t* grid, pos_t pos) {
+    int w = grid->width  - (pos.x & ~GRID_CHUNK_MASK);
+    int h = grid->height - (pos.y & ~GRID_CHUNK_MASK);
+    return (w < GRID_CHUNK_SIZE ? w : GRID_CHUNK_SIZE)
+         * (h < GRID_CHUNK_SIZE ? h : GRID_CHUNK_SIZE);
+}
+
+/**
+ * Bloco de pos para escrita: se ainda é uma sentinela, troca-a por uma cópia
+ * própria.
+ */
+static grid_chunk_t* grid_chunk_for_write(grid_t* grid, pos_t pos) {
+    _Atomic(grid_chunk_t*)* link = grid_chunk_link(grid, pos);
+    grid_chunk_t* c = atomic_load_explicit(link, memory_order_acquire);
+    while (c == grid->empty_chunk || c == grid->obstacle_chunk) {
+        grid_chunk_t* mine = c == grid->empty_chunk
+            ? grid_chunk_new(0, 0)
+            : grid_chunk_new(GRID_WORD_OBSTACLES, grid_chunk_cells(grid, pos));
+        if (atomic_compare_exchange_strong_explicit(link, &c, mine,
+                memory_order_acq_rel, memory_order_acquire)) {
+            return mine;
+        }
+        grid_chunk_free(mine); // outra thread publicou antes; c é o dela
     }
+    return c;
+}
+
+/**
+ * Anota em grid->drained o bloco de pos, que ficou sem pessoas e sem
+ * obstáculos (se ainda não está lá).
+ */
+static void grid_chunk_drained(grid_t* grid, pos_t pos) {
+    size_t i = grid_chunk_link(grid, pos) - grid->chunks;
+    if (atomic_exchange(grid->drained_mark+i, 1))
+        return;
+    atomic_store_explicit(grid->drained + atomic_fetch_add(&grid->n_drained, 1),
+                          (uint32_t)i, memory_order_relaxed);
+}
+
+/**
+ * Conta delta pessoas no bloco c (de pos).
+ */
+static void grid_chunk_add_persons(grid_t* grid, grid_chunk_t* c, pos_t pos,
+                                   int delta) {
+    if (!(atomic_fetch_add(&c->persons, delta) + delta)
+        && !atomic_load(&c->obstacles)) {
+        grid_chunk_drained(grid, pos);
+    }
+}
+
+/**
+ * Conta delta obstáculos no bloco c (de pos). Um bloco que fica só com
+ * obstáculos volta a ser a sentinela obstacle_chunk.
+ */
+static void grid_chunk_add_obstacles(grid_t* grid, grid_chunk_t* c, pos_t pos,
+                                     int delta) {
+    int n = atomic_fetch_add(&c->obstacles, delta) + delta;
+    if (!n && !atomic_load(&c->persons))
+        grid_chunk_drained(grid, pos);
+    if (n < grid_chunk_cells(grid, pos))
+        return;
+    grid_chunk_t* expected = c;
+    // Mudanças de obstáculos não são concorrentes com outros acessos ao grid
+    // (veja grid_set()): ninguém mais usa c
+    if (atomic_compare_exchange_strong(grid_chunk_link(grid, pos), &expected,
+                                       grid->obstacle_chunk)) {
+        grid_chunk_free(c);
+    }
+}
+
+/**
+ * Troca o tipo da célula atomicamente e retorna o tipo anterior.
+ */
+static int grid_cell_exchange(grid_t* grid, pos_t pos, int type) {
+    grid_chunk_t* c = grid_chunk_at(grid, pos);
+    // escrever numa sentinela o valor que ela já tem não muda nada
+    if ((c == grid->empty_chunk && type == GRID_OBJ_EMPTY)
+        || (c == grid->obstacle_chunk && type == GRID_OBJ_OBSTACLE)) {
+        return type;
+    }
+    c = grid_chunk_for_write(grid, pos);
+    int i = grid_cell_index(grid->layout, pos);
+    _Atomic(uint64_t)* ptr = c->words + (i >> 5);
+    int shift = 2*(i & 31);
+    uint64_t old = atomic_load_explicit(ptr, memory_order_relaxed), word;
+    do {
+        word = (old & ~((uint64_t)GRID_OBJ__MASK << shift))
+             | ((uint64_t)type << shift);
+    } while (!atomic_compare_exchange_weak_explicit(ptr, &old, word,
+                memory_order_relaxed, memory_order_relaxed));
+    int old_type = (old >> shift) & GRID_OBJ__MASK;
+    int persons = (type == GRID_OBJ_PERSON) - (old_type == GRID_OBJ_PERSON);
+    if (persons)
+        grid_chunk_add_persons(grid, c, pos, persons);
+    int obstacles = (type == GRID_OBJ_OBSTACLE)
+                  - (old_type == GRID_OBJ_OBSTACLE);
+    if (obstacles)
+        grid_chunk_add_obstacles(grid, c, pos, obstacles);
+    return old_type;
+}
+
+/**
+ * Endereço do slot da célula dentro da tabela de slots do seu bloco. Se
+ * alloc != 0, aloca a tabela (e o bloco) caso ainda não existam. Caso
+ * contrário, retorna NULL se o bloco nunca recebeu uma pessoa.
+ */
+static uint32_t* grid_slot_cell(grid_t* grid, pos_t pos, int alloc) {
+    grid_chunk_t* c = alloc ? grid_chunk_for_write(grid, pos)
+                            : grid_chunk_at(grid, pos);
+    uint32_t* tbl = atomic_load_explicit(&c->slots, memory_order_acquire);
+    if (!tbl && alloc) {
+        uint32_t* mine = calloc(GRID_CHUNK_SIZE*GRID_CHUNK_SIZE,
+                                sizeof(uint32_t));
+        if (atomic_compare_exchange_strong_explicit(&c->slots, &tbl, mine,
+                memory_order_acq_rel, memory_order_acquire)) {
+            tbl = mine;
+        } else {
+            free(mine); // outra thread publicou antes; tbl é a dela
+        }
+    }
+    return tbl ? tbl + grid_slot_index(pos) : NULL;
+}
+
+void grid_set_layout(grid_t* grid, int layout) {
+    if (layout != GRID_LAYOUT_ROWS && layout != GRID_LAYOUT_MORTON)
+        abort();
+    if (layout == grid->layout)
+        return;
+    // As sentinelas são uniformes: só os blocos próprios mudam
+    size_t n_chunks = (size_t)grid->chunks_x * grid->chunks_y;
+    uint64_t words[GRID_CHUNK_WORDS];
+    for (size_t n = 0; n < n_chunks; ++n) {
+        grid_chunk_t* c = atomic_load(grid->chunks+n);
+        if (c == grid->empty_chunk || c == grid->obstacle_chunk)
+            continue;
+        memset(words, 0, sizeof(words));
+        pos_t pos;
+        for (pos.y = 0; pos.y < GRID_CHUNK_SIZE; ++pos.y) {
+            for (pos.x = 0; pos.x < GRID_CHUNK_SIZE; ++pos.x) {
+                int from = grid_cell_index(grid->layout, pos);
+                int to = grid_cell_index(layout, pos);
+                uint64_t type = atomic_load_explicit(c->words + (from >> 5),
+                        memory_order_relaxed) >> 2*(from & 31) & GRID_OBJ__MASK;
+                words[to >> 5] |= type << 2*(to & 31);
+            }
+        }
+        for (int i = 0; i < GRID_CHUNK_WORDS; ++i)
+            atomic_store_explicit(c->words+i, words[i], memory_order_relaxed);
+    }
+    grid->layout = layout;
+    // Os campos de distância também seguem o layout: os já calculados
+    // ficam obsoletos
+    ++grid->obstacles_version;
+}
+
+static person_t** grid_slot_ptr(grid_t* grid, uint32_t slot) {
+    person_t** chunk = atomic_load_explicit(
+            grid->slots + slot/GRID_SLOT_CHUNK_SIZE, memory_order_acquire);
+    return chunk + slot % GRID_SLOT_CHUNK_SIZE;
+}
+
+/**
+ * Retorna o slot de person neste grid, registrando-a se necessário.
+ */
+static uint32_t grid_person_slot(grid_t* grid, person_t* person) {
+    uint32_t slot = person->grid_slot;
+    if (slot && slot < atomic_load(&grid->n_slots)
+             && *grid_slot_ptr(grid, slot) == person) {
+        return slot;
+    }
+    slot = atomic_fetch_add(&grid->n_slots, 1);
+    assert(slot / GRID_SLOT_CHUNK_SIZE < GRID_SLOT_CHUNKS);
+    _Atomic(person_t**)* link = grid->slots + slot/GRID_SLOT_CHUNK_SIZE;
+    person_t** chunk = atomic_load_explicit(link, memory_order_acquire);
+    if (!chunk) {
+        person_t** mine = calloc(GRID_SLOT_CHUNK_SIZE, sizeof(person_t*));
+        if (atomic_compare_exchange_strong_explicit(link, &chunk, mine,
+                memory_order_acq_rel, memory_order_acquire)) {
+            chunk = mine;
+        } else {
+            free(mine);
+        }
+    }
+    chunk[slot % GRID_SLOT_CHUNK_SIZE] = person;
+    person->grid_slot = slot;
+    return slot;
+}
+
+int grid_get(grid_t* grid, pos_t pos, person_t** out_person) {
+    if (!grid_isvalid(grid, pos))
+        return GRID_OBJ_INVALID;
+    int type = grid_cell_type(grid, pos);
+    if (type == GRID_OBJ_PERSON && out_person)
+        *out_person = *grid_slot_ptr(grid, *grid_slot_cell(grid, pos, 0));
     return type;
 }
 
 int grid_set(grid_t* grid, pos_t pos, int type) {
-    assert(grid_isvalid(grid, pos));
     assert(type != GRID_OBJ_PERSON);
-    ptrdiff_t* ptr = (ptrdiff_t*)grid->data + (pos.y * grid->width + pos.x);
-    ptrdiff_t old = *ptr;
-    *ptr = type;
-    return old < GRID_OBJ__MIN || old > GRID_OBJ__MAX ? GRID_OBJ_PERSON : old;
+    assert(type != GRID_OBJ_INVALID);
+    if (!grid_isvalid(grid, pos))
+        return GRID_OBJ_INVALID;
+    int old = grid_cell_exchange(grid, pos, type);
+    if ((old == GRID_OBJ_OBSTACLE) != (type == GRID_OBJ_OBSTACLE))
+        ++grid->obstacles_version;
+    if (grid->on_free && old != GRID_OBJ_EMPTY && type == GRID_OBJ_EMPTY)
+        grid->on_free(grid, pos, grid->on_free_ctx);
+    return old;
+}
+
+void grid_set_free_hook(grid_t* grid, void (*fn)(grid_t*, pos_t, void*),
+                        void* ctx) {
+    grid->on_free = fn;
+    grid->on_free_ctx = ctx;
 }
 
 int grid_set_person(grid_t* grid, pos_t pos, person_t* person) {
-    assert(grid_isvalid(grid, pos));
-    int old = grid_get(grid, pos, NULL);
-    person_t** ptr = (person_t**)grid->data + (pos.y * grid->width + pos.x);
-    *ptr = person;
+    assert(person);
+    if (!grid_isvalid(grid, pos))
+        return GRID_OBJ_INVALID;
+    *grid_slot_cell(grid, pos, 1) = grid_person_slot(grid, person);
+    int old = grid_cell_exchange(grid, pos, GRID_OBJ_PERSON);
+    if (old == GRID_OBJ_OBSTACLE)
+        ++grid->obstacles_version;
     person->current_pos = pos;
     return old;
 }
 
+void grid_release_chunks(grid_t* grid) {
+    size_t n = atomic_load(&grid->n_drained);
+    for (size_t k = 0; k < n; ++k) {
+        uint32_t i = atomic_load_explicit(grid->drained+k,
+                                          memory_order_relaxed);
+        atomic_store(grid->drained_mark+i, 0);
+        grid_chunk_t* c = atomic_load(grid->chunks+i);
+        // o bloco pode ter virado sentinela ou voltado a ser ocupado
+        if (c == grid->empty_chunk || c == grid->obstacle_chunk
+            || atomic_load(&c->persons) || atomic_load(&c->obstacles)) {
+            continue;
+        }
+        if (atomic_compare_exchange_strong(grid->chunks+i, &c,
+                                           grid->empty_chunk)) {
+            grid_chunk_free(c);
+        }
+    }
+    atomic_store(&grid->n_drained, 0);
+}
+
+/**
+ * Bit baixo de cada célula de uma palavra.
+ */
+#define GRID_WORD_LO 0x5555555555555555ull
+
+/**
+ * Inversa de grid_spread6(): bits pares 0..10 de v em 0..5.
+ */
+static inline unsigned grid_compact6(unsigned v) {
+    v &= 0x555;
+    v = (v | v >> 1) & 0x333;
+    v = (v | v >> 2) & 0x0f0f;
+    return (v | v >> 4) & 0xff;
+}
+
+/**
+ * Bit i de m no bit 2*i (o bit baixo da célula i de uma palavra).
+ */
+static inline uint64_t grid_expand32(uint32_t m) {
+    uint64_t x = m;
+    x = (x | x << 16) & 0x0000ffff0000ffffull;
+    x = (x | x << 8)  & 0x00ff00ff00ff00ffull;
+    x = (x | x << 4)  & 0x0f0f0f0f0f0f0f0full;
+    x = (x | x << 2)  & 0x3333333333333333ull;
+    return (x | x << 1) & GRID_WORD_LO;
+}
+
+/**
+ * Bit baixo ligado nas células de word que são do tipo type.
+ */
+static inline uint64_t grid_word_cells_of(uint64_t word, int type) {
+    uint64_t eq = ~(word ^ (uint64_t)type*GRID_WORD_LO);
+    return eq & eq >> 1 & GRID_WORD_LO;
+}
+
+/**
+ * Máscara (bit i = célula i) das células da palavra wi de um bloco que estão
+ * em [x0, x1) x [y0, y1), em coordenadas do bloco.
+ */
+static uint32_t grid_word_rect_mask(int layout, int wi,
+                                    int x0, int y0, int x1, int y1) {
+    if (layout == GRID_LAYOUT_ROWS) {
+        // uma palavra = 32 células de uma linha
+        int y = wi >> 1, bx = (wi & 1) << 5;
+        int lo = x0 > bx ? x0 - bx : 0, hi = x1 < bx+32 ? x1 - bx : 32;
+        if (y < y0 || y >= y1 || lo >= hi)
+            return 0;
+        return (hi - lo == 32 ? ~0u : (1u << (hi - lo)) - 1) << lo;
+    }
+    // uma palavra = bloco de 8x4 células
+    int bx = grid_compact6(wi << 5), by = grid_compact6(wi << 5 >> 1);
+    int lo = x0 > bx ? x0 - bx : 0, hi = x1 < bx+8 ? x1 - bx : 8;
+    int r0 = y0 > by ? y0 - by : 0, r1 = y1 < by+4 ? y1 - by : 4;
+    uint32_t row = 0, m = 0;
+    for (int x = lo; x < hi; ++x)
+        row |= 1u << grid_spread6(x);
+    for (int r = r0; r < r1; ++r)
+        m |= row << (grid_spread6(r) << 1);
+    return m;
+}
+
+/**
+ * Posição da célula bit da palavra wi do bloco com canto origin.
+ */
+static pos_t grid_word_cell_pos(int layout, pos_t origin, int wi, int bit) {
+    if (layout == GRID_LAYOUT_ROWS)
+        return mk_pos(origin.x + ((wi & 1) << 5) + bit, origin.y + (wi >> 1));
+    unsigned i = wi << 5 | bit;
+    return mk_pos(origin.x + grid_compact6(i), origin.y + grid_compact6(i >> 1));
+}
+
+/**
+ * Torna obstáculos as células de sel (bit baixo de cada célula) que estão em
+ * want e vazias as demais, mantendo as células com pessoas. Retorna a
+ * variação no número de obstáculos de c e soma em *changed as células
+ * alteradas.
+ */
+static int grid_word_assign(grid_t* grid, grid_chunk_t* c, pos_t origin,
+                            int wi, uint64_t sel, uint64_t want,
+                            size_t* changed) {
+    uint64_t word = atomic_load_explicit(c->words+wi, memory_order_relaxed);
+    sel &= ~grid_word_cells_of(word, GRID_OBJ_PERSON);
+    uint64_t obstacles = grid_word_cells_of(word, GRID_OBJ_OBSTACLE) & sel;
+    uint64_t to_obstacle = want & sel & ~obstacles;
+    uint64_t to_empty = obstacles & ~want;
+    if (!(to_obstacle | to_empty))
+        return 0;
+    word &= ~((to_obstacle | to_empty) * 3);
+    word |= to_obstacle << 1;
+    atomic_store_explicit(c->words+wi, word, memory_order_relaxed);
+    int added = __builtin_popcountll(to_obstacle);
+    int removed = __builtin_popcountll(to_empty);
+    *changed += added + removed;
+    for (uint64_t m = grid->on_free ? to_empty : 0; m; m &= m-1) {
+        pos_t pos = grid_word_cell_pos(grid->layout, origin, wi,
+                                       __builtin_ctzll(m) >> 1);
+        grid->on_free(grid, pos, grid->on_free_ctx);
+    }
+    return added - removed;
+}
+
+/**
+ * Troca o bloco c de origin pela sentinela s e libera c.
+ */
+static void grid_chunk_collapse(grid_t* grid, pos_t origin, grid_chunk_t* c,
+                                grid_chunk_t* s) {
+    atomic_store(grid_chunk_link(grid, origin), s);
+    if (c != grid->empty_chunk && c != grid->obstacle_chunk)
+        grid_chunk_free(c);
+}
+
+/**
+ * Recorta [*from, *to) pelos limites do grid. Retorna 0 se nada sobra.
+ */
+static int grid_clip_rect(grid_t* grid, pos_t* from, pos_t* to) {
+    if (from->x < 0) from->x = 0;
+    if (from->y < 0) from->y = 0;
+    if (to->x > grid->width)  to->x = grid->width;
+    if (to->y > grid->height) to->y = grid->height;
+    return from->x < to->x && from->y < to->y;
+}
+
+/**
+ * Parte [x0, x1) x [y0, y1) de [from, to) que cai no bloco com canto origin,
+ * em coordenadas do bloco.
+ */
+typedef struct grid_part_s {
+    int x0, y0, x1, y1;
+} grid_part_t;
+
+static grid_part_t grid_chunk_part(pos_t origin, pos_t from, pos_t to) {
+    grid_part_t r;
+    r.x0 = from.x > origin.x ? from.x - origin.x : 0;
+    r.y0 = from.y > origin.y ? from.y - origin.y : 0;
+    r.x1 = to.x - origin.x < GRID_CHUNK_SIZE ? to.x - origin.x : GRID_CHUNK_SIZE;
+    r.y1 = to.y - origin.y < GRID_CHUNK_SIZE ? to.y - origin.y : GRID_CHUNK_SIZE;
+    return r;
+}
+
+/**
+ * Fim (exclusivo) e, em *first, início das palavras de um bloco que podem ter
+ * células de r. Com GRID_LAYOUT_ROWS são só as palavras das linhas de r.
+ */
+static int grid_part_words(int layout, grid_part_t r, int* first) {
+    if (layout != GRID_LAYOUT_ROWS) {
+        *first = 0;
+        return GRID_CHUNK_WORDS;
+    }
+    *first = r.y0 << 1;
+    return r.y1 << 1;
+}
+
+/**
+ * Fim de uma escrita em região no bloco c: aplica delta ao número de
+ * obstáculos e troca c pela sentinela correspondente se ele ficou só com
+ * obstáculos, ou só com células vazias.
+ */
+static void grid_region_done(grid_t* grid, pos_t origin, grid_chunk_t* c,
+                             int delta) {
+    int n = atomic_fetch_add(&c->obstacles, delta) + delta;
+    if (n == grid_chunk_cells(grid, origin))
+        grid_chunk_collapse(grid, origin, c, grid->obstacle_chunk);
+    else if (!n && delta < 0 && !atomic_load(&c->persons))
+        grid_chunk_collapse(grid, origin, c, grid->empty_chunk);
+}
+
+/**
+ * grid_fill_rect() num bloco.
+ */
+static size_t grid_fill_chunk(grid_t* grid, pos_t origin, grid_part_t r,
+                              int type) {
+    grid_chunk_t* c = grid_chunk_at(grid, origin);
+    grid_chunk_t* same = type == GRID_OBJ_OBSTACLE ? grid->obstacle_chunk
+                                                   : grid->empty_chunk;
+    if (c == same)
+        return 0;
+    int n_cells = grid_chunk_cells(grid, origin);
+    int obstacles = c == grid->obstacle_chunk ? n_cells
+                                              : atomic_load(&c->obstacles);
+    // Bloco inteiro e sem ninguém para acordar: vira a sentinela
+    if ((r.x1-r.x0)*(r.y1-r.y0) == n_cells
+        && (type == GRID_OBJ_OBSTACLE || !grid->on_free || !obstacles)
+        && (c == grid->empty_chunk || c == grid->obstacle_chunk
+            || !atomic_load(&c->persons))) {
+        grid_chunk_collapse(grid, origin, c, same);
+        return type == GRID_OBJ_OBSTACLE ? n_cells - obstacles : obstacles;
+    }
+    c = grid_chunk_for_write(grid, origin);
+    size_t changed = 0;
+    int delta = 0;
+    int wi, end = grid_part_words(grid->layout, r, &wi);
+    for (; wi < end; ++wi) {
+        uint32_t m = grid_word_rect_mask(grid->layout, wi,
+                                         r.x0, r.y0, r.x1, r.y1);
+        if (!m)
+            continue;
+        uint64_t sel = grid_expand32(m);
+        delta += grid_word_assign(grid, c, origin, wi, sel,
+                                  type == GRID_OBJ_OBSTACLE ? sel : 0,
+                                  &changed);
+    }
+    grid_region_done(grid, origin, c, delta);
+    return changed;
+}
+
+size_t grid_fill_rect(grid_t* grid, pos_t from, pos_t to, int type) {
+    if (type != GRID_OBJ_EMPTY && type != GRID_OBJ_OBSTACLE)
+        abort();
+    if (!grid_clip_rect(grid, &from, &to))
+        return 0;
+    size_t changed = 0;
+    pos_t origin;
+    for (origin.y = from.y & ~GRID_CHUNK_MASK; origin.y < to.y;
+         origin.y += GRID_CHUNK_SIZE) {
+        for (origin.x = from.x & ~GRID_CHUNK_MASK; origin.x < to.x;
+             origin.x += GRID_CHUNK_SIZE) {
+            changed += grid_fill_chunk(grid, origin,
+                                       grid_chunk_part(origin, from, to), type);
+        }
+    }
+    if (changed)
+        ++grid->obstacles_version;
+    return changed;
+}
+
+size_t grid_count_rect(grid_t* grid, pos_t from, pos_t to, int type) {
+    if (type < GRID_OBJ_EMPTY || type > GRID_OBJ_OBSTACLE)
+        abort();
+    if (!grid_clip_rect(grid, &from, &to))
+        return 0;
+    size_t n = 0;
+    pos_t origin;
+    for (origin.y = from.y & ~GRID_CHUNK_MASK; origin.y < to.y;
+         origin.y += GRID_CHUNK_SIZE) {
+        for (origin.x = from.x & ~GRID_CHUNK_MASK; origin.x < to.x;
+             origin.x += GRID_CHUNK_SIZE) {
+            grid_part_t r = grid_chunk_part(origin, from, to);
+            grid_chunk_t* c = grid_chunk_at(grid, origin);
+            if (c == grid->empty_chunk || c == grid->obstacle_chunk) {
+                int t = c == grid->empty_chunk ? GRID_OBJ_EMPTY
+                                               : GRID_OBJ_OBSTACLE;
+                n += t == type ? (size_t)(r.x1-r.x0)*(r.y1-r.y0) : 0;
+                continue;
+            }
+            int wi, end = grid_part_words(grid->layout, r, &wi);
+            for (; wi < end; ++wi) {
+                uint32_t m = grid_word_rect_mask(grid->layout, wi,
+                                                 r.x0, r.y0, r.x1, r.y1);
+                if (!m)
+                    continue;
+                uint64_t word = atomic_load_explicit(c->words+wi,
+                                                     memory_order_relaxed);
+                n += __builtin_popcountll(grid_word_cells_of(word, type)
+                                          & grid_expand32(m));
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * Palavra de grid (GRID_LAYOUT_ROWS) com as 32 células a partir de (x, y),
+ * x múltiplo de 32; 0 (vazias) fora do grid.
+ */
+static uint64_t grid_rows_word(grid_t* grid, int x, int y) {
+    if (x < 0 || y < 0 || x >= grid->width || y >= grid->height)
+        return 0;
+    pos_t pos = {x, y};
+    return atomic_load_explicit(grid_chunk_at(grid, pos)->words
+                                + (grid_cell_index(GRID_LAYOUT_ROWS, pos) >> 5),
+                                memory_order_relaxed);
+}
+
+/**
+ * As 32 células de grid (GRID_LAYOUT_ROWS) a partir de (x, y), na
+ * codificação de uma palavra.
+ */
+static uint64_t grid_rows_cells(grid_t* grid, int x, int y) {
+    int off = x & 31, base = x - off;
+    uint64_t word = grid_rows_word(grid, base, y);
+    if (!off)
+        return word;
+    return word >> 2*off | grid_rows_word(grid, base+32, y) << (64 - 2*off);
+}
+
+/**
+ * grid_copy_region() num bloco de dst: d é o deslocamento de src para dst e
+ * rows indica se os dois grids usam GRID_LAYOUT_ROWS.
+ */
+static size_t grid_copy_chunk(grid_t* dst, pos_t origin, grid_part_t r,
+                              grid_t* src, pos_t d, int rows) {
+    // A parte de src que cai no bloco só tem obstáculos ou só não-obstáculos:
+    // é um preenchimento
+    pos_t sfrom = {origin.x + r.x0 - d.x, origin.y + r.y0 - d.y};
+    pos_t sto = {origin.x + r.x1 - d.x, origin.y + r.y1 - d.y};
+    size_t k = grid_count_rect(src, sfrom, sto, GRID_OBJ_OBSTACLE);
+    if (!k || k == (size_t)(r.x1-r.x0)*(r.y1-r.y0)) {
+        return grid_fill_chunk(dst, origin, r,
+                               k ? GRID_OBJ_OBSTACLE : GRID_OBJ_EMPTY);
+    }
+    grid_chunk_t* c = grid_chunk_for_write(dst, origin);
+    size_t changed = 0;
+    int delta = 0;
+    int wi, end = grid_part_words(dst->layout, r, &wi);
+    for (; wi < end; ++wi) {
+        uint32_t m = grid_word_rect_mask(dst->layout, wi,
+                                         r.x0, r.y0, r.x1, r.y1);
+        if (!m)
+            continue;
+        uint64_t want = 0;
+        if (rows) {
+            // 32 células seguidas de src, alinhadas com a palavra de dst
+            pos_t p = grid_word_cell_pos(GRID_LAYOUT_ROWS, origin, wi, 0);
+            want = grid_word_cells_of(grid_rows_cells(src, p.x - d.x,
+                                                      p.y - d.y),
+                                      GRID_OBJ_OBSTACLE);
+        } else {
+            for (uint32_t b = m; b; b &= b-1) {
+                int bit = __builtin_ctz(b);
+                pos_t p = grid_word_cell_pos(dst->layout, origin, wi, bit);
+                p.x -= d.x;
+                p.y -= d.y;
+                if (grid_cell_type(src, p) == GRID_OBJ_OBSTACLE)
+                    want |= 1ull << 2*bit;
+            }
+        }
+        uint64_t sel = grid_expand32(m);
+        delta += grid_word_assign(dst, c, origin, wi, sel, want & sel,
+                                  &changed);
+    }
+    grid_region_done(dst, origin, c, delta);
+    return changed;
+}
+
+size_t grid_copy_region(grid_t* dst, pos_t dst_pos, grid_t* src,
+                        pos_t from, pos_t to) {
+    if (dst == src)
+        abort();
+    // Deslocamento de src para dst (antes do recorte), e o retângulo de
+    // destino
+    pos_t d = {dst_pos.x - from.x, dst_pos.y - from.y};
+    if (!grid_clip_rect(src, &from, &to))
+        return 0;
+    pos_t dfrom = pos_add(from, d), dto = pos_add(to, d);
+    if (!grid_clip_rect(dst, &dfrom, &dto))
+        return 0;
+    int rows = src->layout == GRID_LAYOUT_ROWS
+               && dst->layout == GRID_LAYOUT_ROWS;
+    size_t changed = 0;
+    pos_t origin;
+    for (origin.y = dfrom.y & ~GRID_CHUNK_MASK; origin.y < dto.y;
+         origin.y += GRID_CHUNK_SIZE) {
+        for (origin.x = dfrom.x & ~GRID_CHUNK_MASK; origin.x < dto.x;
+             origin.x += GRID_CHUNK_SIZE) {
+            grid_part_t r = grid_chunk_part(origin, dfrom, dto);
+            changed += grid_copy_chunk(dst, origin, r, src, d, rows);
+        }
+    }
+    if (changed)
+        ++dst->obstacles_version;
+    return changed;
+}
+
+/**
+ * Tipos das células (x-1, y), (x, y) e (x+1, y), 2 bits cada, nos 6 bits
+ * menos significativos. Células fora do grid valem 3.
+ */
+static inline unsigned grid_row3(grid_t* grid, int x, int y) {
+    if (y < 0 || y >= grid->height)
+        return 0x3f;
+    int lo = x & 31;
+    if (grid->layout == GRID_LAYOUT_ROWS && lo && lo != 31
+        && x+1 < grid->width) {
+        // as três células estão na mesma palavra
+        pos_t pos = {x, y};
+        int i = grid_cell_index(GRID_LAYOUT_ROWS, pos);
+        uint64_t word = atomic_load_explicit(grid_chunk_at(grid, pos)->words
+                                             + (i >> 5), memory_order_relaxed);
+        return (word >> 2*(lo-1)) & 0x3f;
+    }
+    unsigned bits = 0;
+    for (int k = 0; k < 3; ++k) {
+        pos_t pos = {x-1+k, y};
+        unsigned type = pos.x >= 0 && pos.x < grid->width
+                        ? (unsigned)grid_cell_type(grid, pos) : 3;
+        bits |= type << 2*k;
+    }
+    return bits;
+}
+
+/**
+ * Bits de x (pares) e de y (ímpares) num índice GRID_LAYOUT_MORTON.
+ */
+#define GRID_MORTON_X 0x555u
+#define GRID_MORTON_Y 0xaaau
+
+/**
+ * Tipos das 9 células da vizinhança de pos em GRID_LAYOUT_MORTON, como em
+ * grid_neighbors_of_type(), quando ela toda está num mesmo bloco. Os índices
+ * vizinhos saem do índice de pos por soma e subtração nos bits de cada eixo,
+ * sem intercalar x e y de novo.
+ */
+static inline unsigned grid_block3_morton(grid_t* grid, pos_t pos) {
+    grid_chunk_t* c = grid_chunk_at(grid, pos);
+    unsigned ix = grid_spread6(pos.x & GRID_CHUNK_MASK);
+    unsigned iy = grid_spread6(pos.y & GRID_CHUNK_MASK) << 1;
+    unsigned xs[3] = {(ix - 1) & GRID_MORTON_X, ix,
+                      ((ix | GRID_MORTON_Y) + 1) & GRID_MORTON_X};
+    unsigned ys[3] = {(iy - 1) & GRID_MORTON_Y, iy,
+                      ((iy | GRID_MORTON_X) + 1) & GRID_MORTON_Y};
+    unsigned cells = 0;
+    for (int r = 0; r < 3; ++r) {
+        for (int k = 0; k < 3; ++k) {
+            unsigned i = xs[k] | ys[r];
+            uint64_t word = atomic_load_explicit(c->words + (i >> 5),
+                                                 memory_order_relaxed);
+            cells |= (unsigned)(word >> 2*(i & 31) & GRID_OBJ__MASK)
+                     << 2*(3*r + k);
+        }
+    }
+    return cells;
+}
+
+unsigned grid_free_neighbors(grid_t* grid, pos_t pos) {
+    return grid_neighbors_of_type(grid, pos, GRID_OBJ_EMPTY);
+}
+
+unsigned grid_neighbors_of_type(grid_t* grid, pos_t pos, int type) {
+    assert(grid_isvalid(grid, pos));
+    // 9 células de 2 bits, linha a linha, na ordem de grid_neighbor_offsets
+    // (com o centro na posição 4)
+    unsigned cells;
+    int lx = pos.x & GRID_CHUNK_MASK, ly = pos.y & GRID_CHUNK_MASK;
+    if (grid->layout == GRID_LAYOUT_MORTON
+        && lx && lx != GRID_CHUNK_MASK && pos.x+1 < grid->width
+        && ly && ly != GRID_CHUNK_MASK && pos.y+1 < grid->height) {
+        cells = grid_block3_morton(grid, pos);
+    } else {
+        cells = grid_row3(grid, pos.x, pos.y-1)
+              | grid_row3(grid, pos.x, pos.y  ) << 6
+              | grid_row3(grid, pos.x, pos.y+1) << 12;
+    }
+    cells = (cells & 0xff) | (cells >> 2 & ~0xffu); // remove o centro
+    unsigned mask = 0;
+    for (int i = 0; i < GRID_NEIGHBOR_COUNT; ++i)
+        mask |= ((int)(cells >> 2*i & GRID_OBJ__MASK) == type) << i;
+    return mask;
+}
+
+/**
+ * Insere o mutex idx em lock->tiles, mantendo a ordem crescente e sem
+ * repetir.
+ */
+static void grid_lock_insert(grid_lock_t* lock, int idx) {
+    int j = lock->n;
+    while (j > 0 && lock->tiles[j-1] > idx)
+        --j;
+    if (j > 0 && lock->tiles[j-1] == idx)
+        return;
+    memmove(lock->tiles+j+1, lock->tiles+j, (lock->n-j)*sizeof(int));
+    lock->tiles[j] = idx;
+    ++lock->n;
+}
+
+void grid_lock_neighborhood(grid_t* grid, pos_t center, grid_lock_t* lock) {
+    assert(grid_isvalid(grid, center));
+    int ts = grid->tile_size;
+    // Retângulo de tiles coberto pela vizinhança, recortado pelo grid
+    int tx0 = (center.x > 0 ? center.x-1 : 0) / ts;
+    int ty0 = (center.y > 0 ? center.y-1 : 0) / ts;
+    int tx1 = (center.x+1 < grid->width  ? center.x+1 : center.x) / ts;
+    int ty1 = (center.y+1 < grid->height ? center.y+1 : center.y) / ts;
+
+    lock->n = 0;
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            long long tile = (long long)ty*grid->tiles_x + tx;
+            grid_lock_insert(lock, (int)(tile % grid->n_tile_locks));
+        }
+    }
+    // Ordem crescente de índice: ordem global de locks
+    for (int i = 0; i < lock->n; ++i)
+        lockprof_acquire(&grid_tiles_site, grid->tile_locks+lock->tiles[i]);
+    lock->prof = lockprof_hold_begin(&grid_tiles_site);
+}
+
+void grid_unlock(grid_t* grid, grid_lock_t* lock) {
+    lockprof_hold_end(&grid_tiles_site, lock->prof);
+    for (int i = lock->n-1; i >= 0; --i)
+        pthread_mutex_unlock(grid->tile_locks+lock->tiles[i]);
+    lock->n = 0;
+}
+
 //                                 x   y    x   y    x   y
 pos_t grid_neighbor_offsets[] = {{-1, -1}, {0, -1}, {1, -1},
                                  {-1,  0}, /*___*/  {1,  0},
@@ -83,6 +950,302 @@ int static_assert__grid_neighbor_offsets
     [sizeof(grid_neighbor_offsets)/sizeof(pos_t) == GRID_NEIGHBOR_COUNT ? 1 : -1];
 
 
+/* --- --- --- --- kernel de pontuação  --- --- --- --- */
+
+int grid_score_neighbors_scalar(const int* dist, pos_t pos, pos_t goal,
+                                unsigned free_mask, int cur_dist,
+                                int64_t cur_eucl) {
+    if (!dist)
+        cur_dist = INT_MAX;
+    int best = -1, best_dist = cur_dist;
+    int64_t best_eucl = cur_eucl;
+    for (int i = 0; i < GRID_NEIGHBOR_COUNT; ++i) {
+        int d = dist ? dist[i] : 0;
+        if (!(free_mask & (1u << i)) || d < 0 || d > best_dist)
+            continue;
+        int64_t dx = goal.x - pos.x - grid_neighbor_offsets[i].x;
+        int64_t dy = goal.y - pos.y - grid_neighbor_offsets[i].y;
+        int64_t e = dx*dx + dy*dy;
+        if (d < best_dist || e < best_eucl) {
+            best = i;
+            best_dist = d;
+            best_eucl = e;
+        }
+    }
+    return best;
+}
+
+/*
+ * Nos kernels vetoriais, cada vizinho ocupa uma lane de 32 bits com
+ * (gx - ox, gy - oy) em dois int16, onde (gx, gy) = goal - pos. Assim,
+ * madd_epi16(v, v) calcula dx*dx + dy*dy em todas as lanes de uma vez.
+ * Lanes inválidas recebem INT_MAX antes das reduções de mínimo.
+ */
+#define GRID_NEG_OFFSETS_EPI16  1, 1,   0, 1,  -1, 1,   1, 0, \
+                               -1, 0,   1,-1,   0,-1,  -1,-1
+
+static inline int grid_pack_epi16(int gx, int gy) {
+    return (int)(((uint32_t)gx & 0xffff) | ((uint32_t)gy << 16));
+}
+
+#if defined(__AVX2__)
+
+static inline __m256i grid_hmin_avx2(__m256i v) {
+    v = _mm256_min_epi32(v, _mm256_permute2x128_si256(v, v, 1));
+    v = _mm256_min_epi32(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+    return _mm256_min_epi32(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+}
+
+static int grid_score_neighbors_simd(const int* dist, int gx, int gy,
+                                     unsigned free_mask, int cur_dist,
+                                     int64_t cur_eucl) {
+    const __m256i neg_off = _mm256_setr_epi16(GRID_NEG_OFFSETS_EPI16);
+    const __m256i lane_bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256i inf = _mm256_set1_epi32(INT_MAX);
+
+    __m256i dxy = _mm256_add_epi16(_mm256_set1_epi32(grid_pack_epi16(gx, gy)),
+                                   neg_off);
+    __m256i eucl = _mm256_madd_epi16(dxy, dxy);
+    __m256i d = dist ? _mm256_loadu_si256((const __m256i*)dist)
+                     : _mm256_setzero_si256();
+    __m256i valid = _mm256_cmpeq_epi32(
+            _mm256_and_si256(_mm256_set1_epi32(free_mask), lane_bit), lane_bit);
+    valid = _mm256_and_si256(valid, _mm256_cmpgt_epi32(d, _mm256_set1_epi32(-1)));
+    valid = _mm256_andnot_si256(_mm256_cmpgt_epi32(d, _mm256_set1_epi32(cur_dist)),
+                                valid);
+
+    __m256i dm = _mm256_blendv_epi8(inf, d, valid);
+    __m256i min_d = grid_hmin_avx2(dm);
+    __m256i sel = _mm256_and_si256(valid, _mm256_cmpeq_epi32(dm, min_d));
+    __m256i em = _mm256_blendv_epi8(inf, eucl, sel);
+    __m256i min_e = grid_hmin_avx2(em);
+    unsigned hits = _mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_and_si256(sel, _mm256_cmpeq_epi32(em, min_e))));
+    if (!hits)
+        return -1;
+    int best_d = _mm256_cvtsi256_si32(min_d), best_e = _mm256_cvtsi256_si32(min_e);
+    if (best_d > cur_dist || (best_d == cur_dist && best_e >= cur_eucl))
+        return -1;
+    return __builtin_ctz(hits);
+}
+
+#elif defined(__SSE2__)
+
+static inline __m128i grid_select_sse2(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i grid_min_sse2(__m128i a, __m128i b) {
+    return grid_select_sse2(_mm_cmplt_epi32(a, b), a, b);
+}
+
+static inline __m128i grid_hmin_sse2(__m128i v) {
+    v = grid_min_sse2(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+    return grid_min_sse2(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+}
+
+static int grid_score_neighbors_simd(const int* dist, int gx, int gy,
+                                     unsigned free_mask, int cur_dist,
+                                     int64_t cur_eucl) {
+    // lanes 0-3 em [0], lanes 4-7 em [1]
+    const __m128i neg_off[2] = {
+        _mm_setr_epi16(1, 1,  0, 1, -1, 1,  1, 0),
+        _mm_setr_epi16(-1, 0, 1,-1,  0,-1, -1,-1)
+    };
+    const __m128i lane_bit[2] = {_mm_setr_epi32(1, 2, 4, 8),
+                                 _mm_setr_epi32(16, 32, 64, 128)};
+    const __m128i inf = _mm_set1_epi32(INT_MAX);
+    __m128i g = _mm_set1_epi32(grid_pack_epi16(gx, gy));
+    __m128i fm = _mm_set1_epi32(free_mask);
+
+    __m128i eucl[2], valid[2], dm[2];
+    for (int h = 0; h < 2; ++h) {
+        __m128i dxy = _mm_add_epi16(g, neg_off[h]);
+        eucl[h] = _mm_madd_epi16(dxy, dxy);
+        __m128i d = dist ? _mm_loadu_si128((const __m128i*)(dist + 4*h))
+                         : _mm_setzero_si128();
+        valid[h] = _mm_cmpeq_epi32(_mm_and_si128(fm, lane_bit[h]), lane_bit[h]);
+        valid[h] = _mm_and_si128(valid[h], _mm_cmpgt_epi32(d, _mm_set1_epi32(-1)));
+        valid[h] = _mm_andnot_si128(_mm_cmpgt_epi32(d, _mm_set1_epi32(cur_dist)),
+                                    valid[h]);
+        dm[h] = grid_select_sse2(valid[h], d, inf);
+    }
+    __m128i min_d = grid_hmin_sse2(grid_min_sse2(dm[0], dm[1]));
+    __m128i sel[2], em[2];
+    for (int h = 0; h < 2; ++h) {
+        sel[h] = _mm_and_si128(valid[h], _mm_cmpeq_epi32(dm[h], min_d));
+        em[h] = grid_select_sse2(sel[h], eucl[h], inf);
+    }
+    __m128i min_e = grid_hmin_sse2(grid_min_sse2(em[0], em[1]));
+    unsigned hits = 0;
+    for (int h = 0; h < 2; ++h) {
+        __m128i hit = _mm_and_si128(sel[h], _mm_cmpeq_epi32(em[h], min_e));
+        hits |= (unsigned)_mm_movemask_ps(_mm_castsi128_ps(hit)) << 4*h;
+    }
+    if (!hits)
+        return -1;
+    int best_d = _mm_cvtsi128_si32(min_d), best_e = _mm_cvtsi128_si32(min_e);
+    if (best_d > cur_dist || (best_d == cur_dist && best_e >= cur_eucl))
+        return -1;
+    return __builtin_ctz(hits);
+}
+
+#endif
+
+int grid_score_neighbors(const int* dist, pos_t pos, pos_t goal,
+                         unsigned free_mask, int cur_dist, int64_t cur_eucl) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    int gx = goal.x - pos.x, gy = goal.y - pos.y;
+    // (gx - ox, gy - oy) precisa caber em int16
+    if (gx > -32767 && gx < 32767 && gy > -32767 && gy < 32767) {
+        return grid_score_neighbors_simd(dist, gx, gy, free_mask,
+                                         dist ? cur_dist : INT_MAX, cur_eucl);
+    }
+#endif
+    return grid_score_neighbors_scalar(dist, pos, goal, free_mask, cur_dist,
+                                       cur_eucl);
+}
+
+
+/* --- --- --- --- grid_field_t  --- --- --- --- */
+
+static unsigned grid_field_bucket(pos_t goal) {
+    unsigned h = (unsigned)goal.x * 73856093u ^ (unsigned)goal.y * 19349663u;
+    return h % GRID_FIELD_BUCKETS;
+}
+
+/**
+ * Número de elementos de grid_field_t.dist (com os tiles incompletos da
+ * borda em GRID_LAYOUT_MORTON).
+ */
+static size_t grid_field_size(grid_t* grid) {
+    if (grid->layout == GRID_LAYOUT_ROWS)
+        return (size_t)grid->width*grid->height;
+    return ((size_t)(grid->width  + GRID_FIELD_TILE-1) / GRID_FIELD_TILE)
+         * ((size_t)(grid->height + GRID_FIELD_TILE-1) / GRID_FIELD_TILE)
+         * GRID_FIELD_TILE*GRID_FIELD_TILE;
+}
+
+/**
+ * BFS a partir de goal sobre todas as células que não são obstáculos.
+ */
+static void grid_field_compute(grid_t* grid, grid_field_t* f) {
+    int w = grid->width, n = grid->width*grid->height;
+    size_t size = grid_field_size(grid);
+    for (size_t i = 0; i < size; ++i)
+        f->dist[i] = GRID_FIELD_UNREACHABLE;
+    if (grid_get(grid, f->goal, NULL) == GRID_OBJ_OBSTACLE)
+        return;
+
+    // A fila guarda y*w + x, em qualquer layout
+    int* fifo = malloc(n*sizeof(int));
+    int head = 0, tail = 0;
+    f->dist[grid_field_index(grid, f->goal)] = 0;
+    fifo[tail++] = f->goal.y*w + f->goal.x;
+    while (head < tail) {
+        int cell = fifo[head++];
+        pos_t pos = mk_pos(cell % w, cell / w);
+        int d = f->dist[grid_field_index(grid, pos)];
+        for (int i = 0; i < GRID_NEIGHBOR_COUNT; ++i) {
+            pos_t nb = pos_add(pos, grid_neighbor_offsets[i]);
+            if (!grid_isvalid(grid, nb))
+                continue;
+            int* nb_dist = f->dist + grid_field_index(grid, nb);
+            if (*nb_dist != GRID_FIELD_UNREACHABLE
+                || grid_get(grid, nb, NULL) == GRID_OBJ_OBSTACLE) {
+                continue;
+            }
+            *nb_dist = d + 1;
+            fifo[tail++] = nb.y*w + nb.x;
+        }
+    }
+    free(fifo);
+}
+
+/**
+ * Procura goal em bucket, aposentando campos obsoletos que encontrar.
+ *
+ * Precondição: grid->fields_mtx travado
+ */
+static grid_field_t* grid_field_lookup(grid_t* grid, grid_field_t** bucket,
+                                       pos_t goal) {
+    grid_field_t** link = bucket;
+    while (*link && !pos_equals((*link)->goal, goal))
+        link = &(*link)->next;
+    grid_field_t* f = *link;
+    if (f && f->obstacles_version != grid->obstacles_version) {
+        // Outras pessoas ainda podem estar lendo f: só é liberado em
+        // grid_destroy()
+        *link = f->next;
+        f->next = grid->retired_fields;
+        grid->retired_fields = f;
+        grid->fields_cells -= (size_t)grid->width*grid->height;
+        f = NULL;
+    }
+    return f;
+}
+
+grid_field_t* grid_field_get(grid_t* grid, pos_t goal) {
+    if (!grid_isvalid(grid, goal))
+        return NULL;
+    size_t n = (size_t)grid->width*grid->height;
+    grid_field_t** bucket = grid->fields + grid_field_bucket(goal);
+
+    LOCKPROF_SITE(lookup_site, "grid_t.fields_mtx (lookup)");
+    uint64_t prof = lockprof_lock(&lookup_site, &grid->fields_mtx);
+    grid_field_t* f = grid_field_lookup(grid, bucket, goal);
+    int has_room = grid->fields_cells + n <= grid->fields_max;
+    unsigned version = grid->obstacles_version;
+    lockprof_unlock(&lookup_site, &grid->fields_mtx, prof);
+    if (f || !has_room)
+        return f;
+
+    // A BFS roda fora do mutex para não serializar objetivos diferentes
+    grid_field_t* mine = malloc(sizeof(grid_field_t));
+    mine->goal = goal;
+    mine->obstacles_version = version;
+    mine->dist = malloc(grid_field_size(grid)*sizeof(int));
+    grid_field_compute(grid, mine);
+
+    LOCKPROF_SITE(insert_site, "grid_t.fields_mtx (insert)");
+    prof = lockprof_lock(&insert_site, &grid->fields_mtx);
+    f = grid_field_lookup(grid, bucket, goal);
+    if (!f && grid->fields_cells + n <= grid->fields_max) {
+        mine->next = *bucket;
+        *bucket = f = mine;
+        grid->fields_cells += n;
+        mine = NULL;
+    }
+    lockprof_unlock(&insert_site, &grid->fields_mtx, prof);
+    if (mine) { // outra thread calculou o mesmo objetivo antes
+        free(mine->dist);
+        free(mine);
+    }
+    return f;
+}
+
+void grid_set_field_limit(grid_t* grid, size_t cells) {
+    pthread_mutex_lock(&grid->fields_mtx);
+    grid->fields_max = cells;
+    pthread_mutex_unlock(&grid->fields_mtx);
+}
+
+int grid_field_fill(grid_t* grid, grid_field_t* f, pos_t goal) {
+    if ((size_t)grid->width*grid->height > GRID_FIELD_MAX_CELLS)
+        return -1;
+    if (f->dist && pos_equals(f->goal, goal)
+        && f->obstacles_version == grid->obstacles_version) {
+        return 0;
+    }
+    if (!f->dist)
+        f->dist = malloc(grid_field_size(grid)*sizeof(int));
+    f->goal = goal;
+    f->obstacles_version = grid->obstacles_version;
+    grid_field_compute(grid, f);
+    return 0;
+}
+
+
 /* --- --- --- person --- --- --- */
 
 void person_init(person_t* person, int id) {
@@ -91,23 +1254,155 @@ void person_init(person_t* person, int id) {
     person->goal_pos = mk_pos(-1, -1);
     person->id = id;
     person->last_move = person->time = 0;
+    atomic_init(&person->parked, 0);
+    atomic_init(&person->left, PERSON_LEFT);
+    atomic_init(&person->group, NULL);
 }
 
 void person_destroy(person_t* person) {
+    // a espera de person_join() não aloca recursos; só os caminhos
+    free(person->plan);
+    free(person->detour);
+    person->plan = NULL;
+    person->detour = NULL;
+    person->detour_cap = 0;
+}
+
+void person_recycle(person_t* person, int id) {
+    uint32_t slot = person->grid_slot;
+    pos_t* plan = person->plan, *detour = person->detour;
+    int detour_cap = person->detour_cap;
+    person_init(person, id);
+    person->grid_slot = slot;
+    person->plan = plan;
+    person->detour = detour;
+    person->detour_cap = detour_cap;
 }
 
 
 void person_join(person_t* person) {
-    printf("[ERRO] person_join() não implementado !!!\n");
-    abort();
+    int s = atomic_load(&person->left);
+    while (s != PERSON_LEFT) {
+        // avisa person_leave() que há quem acordar
+        if (s == PERSON_PLUGGED && !atomic_compare_exchange_weak(&person->left,
+                                                &s, PERSON_JOINING)) {
+            continue;
+        }
+        futex_wait(&person->left, PERSON_JOINING);
+        s = atomic_load(&person->left);
+    }
 }
 
-pos_t person_next_pos(person_t* p, grid_t* g) {
+void person_enter(person_t* person) {
+    atomic_store(&person->left, PERSON_PLUGGED);
+}
+
+static void person_group_done(person_group_t* group) {
+    if (atomic_fetch_sub(&group->pending, 1) == 1)
+        futex_wake_all(&group->pending);
+}
+
+void person_leave(person_t* person) {
+    if (atomic_exchange(&person->left, PERSON_LEFT) == PERSON_JOINING)
+        futex_wake_all(&person->left);
+    person_group_t* group = atomic_exchange(&person->group, NULL);
+    if (group)
+        person_group_done(group);
+}
+
+void person_group_init(person_group_t* group) {
+    atomic_init(&group->pending, 0);
+}
+
+void person_group_add(person_group_t* group, person_t* person) {
+    atomic_fetch_add(&group->pending, 1);
+    atomic_store(&person->group, group);
+    // Se a pessoa saiu antes de ver o grupo, quem conseguir tirar o grupo da
+    // pessoa (esta thread ou person_leave()) faz a baixa. Os acessos seq_cst
+    // garantem que pelo menos um dos dois vê o outro.
+    if (atomic_load(&person->left) == PERSON_LEFT) {
+        person_group_t* expected = group;
+        if (atomic_compare_exchange_strong(&person->group, &expected, NULL))
+            person_group_done(group);
+    }
+}
+
+void person_group_join(person_group_t* group) {
+    int pending;
+    while ((pending = atomic_load(&group->pending)) > 0)
+        futex_wait(&group->pending, pending);
+}
+
+/**
+ * Escolhe, entre os vizinhos de mask, o de menor distância em f,
+ * desempatando pela distância euclidiana até o objetivo. Só troca a posição
+ * atual por um vizinho estritamente melhor nesse critério, o que impede que a
+ * pessoa fique oscilando entre células equivalentes.
+ */
+static int person_choose_field(person_t* p, grid_t* g, grid_field_t* f,
+                               unsigned mask) {
+    pos_t cur = p->current_pos;
+    int dist[GRID_NEIGHBOR_COUNT];
+    for (int i = 0; i < GRID_NEIGHBOR_COUNT; ++i) {
+        pos_t cand = pos_add(cur, grid_neighbor_offsets[i]);
+        dist[i] = mask & (1u << i) ? f->dist[grid_field_index(g, cand)]
+                                   : GRID_FIELD_UNREACHABLE;
+    }
+    int64_t gx = p->goal_pos.x - cur.x, gy = p->goal_pos.y - cur.y;
+    return grid_score_neighbors(dist, cur, p->goal_pos, mask,
+                                f->dist[grid_field_index(g, cur)],
+                                gx*gx + gy*gy);
+}
+
+/**
+ * Campo de distâncias de p no grid atual (atualizando p->field), ou NULL se
+ * não há campo para o objetivo.
+ */
+static grid_field_t* person_field(person_t* p, grid_t* g) {
+    grid_field_t* f = p->field;
+    if (!f || !pos_equals(f->goal, p->goal_pos)
+           || f->obstacles_version != g->obstacles_version) {
+        f = p->field = grid_field_get(g, p->goal_pos);
+    }
+    return f;
+}
+
+/**
+ * Índice em p->detour da próxima célula do desvio (p->detour_len se não há
+ * desvio ou ele terminou). A pessoa pode já ter entrado em
+ * p->detour[p->detour_next] sem que ele tenha avançado.
+ */
+static int person_detour_step(const person_t* p) {
+    int i = p->detour_next;
+    if (i < p->detour_len && pos_equals(p->current_pos, p->detour[i]))
+        ++i;
+    return i;
+}
+
+int person_choose(person_t* p, grid_t* g, unsigned mask) {
     if (!grid_isvalid(g, p->current_pos) || !grid_isvalid(g, p->goal_pos)
         || pos_equals(p->goal_pos, p->current_pos)) {
-        return p->current_pos; // no movement
+        return -1; // no movement
     }
-    
+
+    if ((p->detour_next = person_detour_step(p)) < p->detour_len) {
+        pos_t next = p->detour[p->detour_next];
+        for (int i = 0; i < GRID_NEIGHBOR_COUNT; ++i) {
+            if (pos_equals(pos_add(p->current_pos, grid_neighbor_offsets[i]),
+                           next)) {
+                return mask & (1u << i) ? i : -1;
+            }
+        }
+        p->detour_len = 0; // saiu do caminho: abandona o desvio
+    }
+
+    grid_field_t* f = person_field(p, g);
+    if (f && f->dist[grid_field_index(g, p->current_pos)]
+             != GRID_FIELD_UNREACHABLE) {
+        return person_choose_field(p, g, f, mask);
+    }
+
+    // Sem campo de distâncias: usa o algoritmo guloso
     /*******************************************************************
      * CUIDADO: INE5410 é sobre CONCORRÊNCIA E PARALELISMO.            *
      *                                                                 *
@@ -117,21 +1412,124 @@ pos_t person_next_pos(person_t* p, grid_t* g) {
      * funcionalidade). No mundo real, deveria ser usado A*            *
      *******************************************************************/
 
-    float best_dist = INFINITY;
-    pos_t best_cand = p->current_pos;
-    for (int i = 0; i < GRID_NEIGHBOR_COUNT; ++i) {
-	pos_t cand = pos_add(p->current_pos, grid_neighbor_offsets[i]);
-        if (!grid_isvalid(g, cand))
-            continue;
-	if (grid_get(g, cand, NULL) != GRID_OBJ_EMPTY)
-	    continue;
-	float dist = pos_distance(cand, p->goal_pos);
-	if (dist < best_dist) {
-	    best_dist = dist;
-	    best_cand = cand;
-	}
+    return grid_score_neighbors(NULL, p->current_pos, p->goal_pos, mask, 0, 0);
+}
+
+pos_t person_next_pos(person_t* p, grid_t* g) {
+    int best = grid_isvalid(g, p->current_pos)
+               ? person_choose(p, g, grid_free_neighbors(g, p->current_pos))
+               : -1;
+    return best < 0 ? p->current_pos
+                    : pos_add(p->current_pos, grid_neighbor_offsets[best]);
+}
+
+int person_reachable(person_t* p, grid_t* g) {
+    if (!grid_isvalid(g, p->current_pos) || !grid_isvalid(g, p->goal_pos))
+        return 1;
+    grid_field_t* f = person_field(p, g);
+    return !f || f->dist[grid_field_index(g, p->current_pos)]
+                 != GRID_FIELD_UNREACHABLE;
+}
+
+/**
+ * Garante espaço para um desvio de len células em p->detour.
+ */
+static void person_detour_reserve(person_t* p, int len) {
+    if (p->detour_cap < len) {
+        p->detour = realloc(p->detour, len*sizeof(pos_t));
+        p->detour_cap = len;
     }
+}
 
-    return best_cand;
+int person_reroute(person_t* p, grid_t* g, int64_t below) {
+    const int r = GRID_DETOUR_RADIUS, side = 2*r + 1;
+    pos_t from = p->current_pos, goal = p->goal_pos;
+    // busca em largura na caixa de lado side em volta de from, camada a
+    // camada até r passos. parent[c] é -2 se c não foi alcançada
+    int* parent = malloc(2*side*side*sizeof(int));
+    int* queue = parent + side*side;
+    for (int c = 0; c < side*side; ++c)
+        parent[c] = -2;
+    int root = r*side + r, head = 0, tail = 0, best = -1, best_depth = 0;
+    int64_t best_d = below;
+    parent[root] = -1;
+    queue[tail++] = root;
+    for (int depth = 1; depth <= r && head < tail; ++depth) {
+        for (int end = tail; head < end; ++head) {
+            int c = queue[head];
+            pos_t pos = mk_pos(from.x + c % side - r, from.y + c / side - r);
+            for (int i = 0; i < GRID_NEIGHBOR_COUNT; ++i) {
+                pos_t n = pos_add(pos, grid_neighbor_offsets[i]);
+                int nc = (n.y - from.y + r)*side + n.x - from.x + r;
+                if (abs(n.x - from.x) > r || abs(n.y - from.y) > r
+                    || parent[nc] != -2 || !grid_isvalid(g, n)
+                    || grid_get(g, n, NULL) == GRID_OBJ_OBSTACLE) {
+                    continue;
+                }
+                parent[nc] = c;
+                queue[tail++] = nc;
+                int64_t dx = goal.x - n.x, dy = goal.y - n.y;
+                if (dx*dx + dy*dy < best_d) {
+                    best_d = dx*dx + dy*dy;
+                    best = nc;
+                    best_depth = depth;
+                }
+            }
+        }
+    }
+    if (best >= 0) {
+        person_detour_reserve(p, r);
+        int i = best_depth;
+        for (int c = best; c != root; c = parent[c])
+            p->detour[--i] = mk_pos(from.x + c % side - r, from.y + c / side - r);
+        p->detour_len = best_depth;
+        p->detour_next = 0;
+    }
+    free(parent);
+    return best >= 0;
 }
 
+int person_route(person_t* p, grid_t* g, grid_field_t* f) {
+    if (!pos_equals(f->goal, p->goal_pos))
+        abort();
+    pos_t cur = p->current_pos;
+    int len = f->dist[grid_field_index(g, cur)];
+    if (len == GRID_FIELD_UNREACHABLE)
+        return 0;
+    // cada passo vai para um vizinho um passo mais perto do objetivo
+    person_detour_reserve(p, len);
+    for (int i = 0; i < len; ++i) {
+        for (int k = 0; k < GRID_NEIGHBOR_COUNT; ++k) {
+            pos_t nb = pos_add(cur, grid_neighbor_offsets[k]);
+            if (grid_isvalid(g, nb)
+                && f->dist[grid_field_index(g, nb)] == len-1 - i) {
+                cur = nb;
+                break;
+            }
+        }
+        p->detour[i] = cur;
+    }
+    p->detour_len = len;
+    p->detour_next = 0;
+    return 1;
+}
+
+int person_improves(person_t* p, grid_t* g, pos_t cell) {
+    int step = person_detour_step(p);
+    if (step < p->detour_len)
+        return pos_equals(cell, p->detour[step]);
+    pos_t cur = p->current_pos;
+    grid_field_t* f = p->field;
+    if (!f || !pos_equals(f->goal, p->goal_pos)
+           || f->obstacles_version != g->obstacles_version
+           || f->dist[grid_field_index(g, cur)] == GRID_FIELD_UNREACHABLE) {
+        return 1; // guloso (ou campo por recalcular): qualquer vizinho serve
+    }
+    int d = f->dist[grid_field_index(g, cell)],
+        d_cur = f->dist[grid_field_index(g, cur)];
+    if (d == GRID_FIELD_UNREACHABLE || d > d_cur)
+        return 0;
+    int64_t cx = p->goal_pos.x - cell.x, cy = p->goal_pos.y - cell.y,
+            gx = p->goal_pos.x - cur.x,  gy = p->goal_pos.y - cur.y;
+    return d < d_cur || cx*cx + cy*cy < gx*gx + gy*gy;
+}
@@ -2,14 +2,19 @@
 #define INE5410_GRID_H_
 
 #include <stddef.h>
-#include <semaphore.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 /* --- --- --- --- forward declarations --- --- --- --- */
 
 struct person_s;
 struct grid_s;
+struct grid_field_s;
+struct person_group_s;
 typedef struct person_s person_t;
 typedef struct grid_s grid_t;
+typedef struct grid_field_s grid_field_t;
 
 /* --- --- --- --- pos_t  --- --- --- --- */
 
@@ -45,19 +50,186 @@ int pos_equals(pos_t a, pos_t b);
 
 /* --- --- --- --- grid_t  --- --- --- --- */
 
+/**
+ * Número de pessoas em cada bloco de grid_t.slots
+ */
+#define GRID_SLOT_CHUNK_SIZE 16384
+/**
+ * Número máximo de blocos em grid_t.slots
+ */
+#define GRID_SLOT_CHUNKS     65536
+
+/**
+ * Lado (em células) dos blocos de células de grid_t.chunks.
+ */
+#define GRID_CHUNK_BITS  6
+#define GRID_CHUNK_SIZE  (1 << GRID_CHUNK_BITS)
+#define GRID_CHUNK_WORDS (GRID_CHUNK_SIZE*GRID_CHUNK_SIZE/32)
+
+/**
+ * Ordem das células dentro de cada bloco de grid_t.chunks.
+ *
+ * GRID_LAYOUT_ROWS: linha a linha, 2 palavras por linha do bloco. As três
+ * células de uma linha da vizinhança quase sempre estão numa mesma palavra,
+ * e cada linha de cache cobre 64x4 células.
+ *
+ * GRID_LAYOUT_MORTON: ordem Z (bits de x e y intercalados). Cada palavra
+ * cobre 8x4 células e cada linha de cache 16x16, então uma vizinhança 3x3
+ * cabe numa única linha de cache com mais frequência, ao custo de montar a
+ * vizinhança célula a célula. Os campos de distância (grid_field_t) também
+ * passam a ser guardados em tiles (veja grid_field_index()).
+ *
+ * Compare os dois com make bench-layout, make microbench ou
+ * bench-scenarios -l.
+ */
+#define GRID_LAYOUT_ROWS   0
+#define GRID_LAYOUT_MORTON 1
+
+/**
+ * Bloco de GRID_CHUNK_SIZE x GRID_CHUNK_SIZE células. O tipo de cada célula
+ * (GRID_OBJ_EMPTY, GRID_OBJ_PERSON ou GRID_OBJ_OBSTACLE) ocupa 2 bits, 32
+ * células por palavra, na ordem de grid_t.layout. As palavras são
+ * alteradas com operações atômicas pois uma mesma palavra pode ter células
+ * de tiles de lock diferentes.
+ */
+typedef struct grid_chunk_s {
+    _Atomic(uint64_t) words[GRID_CHUNK_WORDS];
+    /**
+     * Índice (slot) das pessoas de cada célula (sempre linha a linha),
+     * alocado quando uma pessoa entra no bloco pela primeira vez. O valor de
+     * uma célula só tem significado se a célula é GRID_OBJ_PERSON.
+     */
+    _Atomic(uint32_t*) slots;
+    /**
+     * Obstáculos no bloco. Quando todas as células válidas viram obstáculo,
+     * o bloco é trocado pela sentinela obstacle_chunk do grid.
+     */
+    atomic_int obstacles;
+    /**
+     * Células GRID_OBJ_PERSON no bloco. Quando esta contagem e a de
+     * obstáculos chegam a 0, o bloco é anotado em grid_t.drained.
+     */
+    atomic_int persons;
+} grid_chunk_t;
+
 typedef struct grid_s {
-    void* data;
+    /**
+     * Blocos de células, em ordem row-major (chunks_x por linha). Todos
+     * começam apontando para a sentinela empty_chunk (só células vazias) e
+     * só ganham memória própria na primeira escrita que muda alguma célula.
+     * Blocos só de obstáculos voltam a apontar para a sentinela
+     * obstacle_chunk e blocos que esvaziam voltam a empty_chunk em
+     * grid_release_chunks(). Assim a memória acompanha o conteúdo, não a
+     * área.
+     *
+     * As sentinelas nunca são escritas: a primeira escrita que muda uma
+     * célula de uma sentinela troca-a (com CAS) por uma cópia própria.
+     */
+    _Atomic(grid_chunk_t*)* chunks;
+    int chunks_x, chunks_y;
+    grid_chunk_t* empty_chunk;
+    grid_chunk_t* obstacle_chunk;
+    /**
+     * Índices (em chunks) dos blocos que ficaram sem pessoas e sem
+     * obstáculos desde a última grid_release_chunks(), cada um no máximo uma
+     * vez: drained_mark[i] != 0 se i já está entre os n_drained primeiros.
+     */
+    _Atomic(uint32_t)* drained;
+    atomic_size_t n_drained;
+    atomic_uchar* drained_mark;
+    int layout; ///< GRID_LAYOUT_ROWS ou GRID_LAYOUT_MORTON
+    /**
+     * Tabela slot -> person_t*, em blocos de GRID_SLOT_CHUNK_SIZE que nunca
+     * mudam de lugar. O slot 0 não é usado.
+     */
+    _Atomic(person_t**)* slots;
+    atomic_uint n_slots;
+
     int width, height;
+    /**
+     * O grid é dividido em tiles quadrados de tile_size x tile_size células,
+     * cada um protegido por um dos n_tile_locks mutexes de tile_locks (o
+     * tile t usa o mutex t % n_tile_locks). Assim, movimentos em regiões
+     * distantes do grid raramente disputam o mesmo lock, e o número de
+     * mutexes não cresce com a área além de GRID_MAX_TILE_LOCKS.
+     */
+    int tile_size;
+    int tiles_x, tiles_y; ///< número de tiles em cada eixo
+    int n_tile_locks;
+    pthread_mutex_t* tile_locks;
+
+    /**
+     * Cache de campos de distância (veja grid_field_get()), indexada por um
+     * hash do objetivo. fields_mtx protege a tabela, fields_cells (total de
+     * células alocadas em campos), o limite fields_max (veja
+     * grid_set_field_limit()) e a lista de campos obsoletos (retired).
+     */
+    pthread_mutex_t fields_mtx;
+    grid_field_t** fields;
+    grid_field_t* retired_fields;
+    size_t fields_cells, fields_max;
+    /**
+     * Incrementado sempre que grid_set() coloca ou remove um obstáculo (e
+     * por grid_set_layout()). Campos calculados com outra versão são
+     * recalculados.
+     */
+    unsigned obstacles_version;
+    /**
+     * Chamada por grid_set() sempre que uma célula ocupada fica vazia (veja
+     * grid_set_free_hook()). NULL se não há hook.
+     */
+    void (*on_free)(grid_t* grid, pos_t pos, void* ctx);
+    void* on_free_ctx;
 } grid_t;
 
+/**
+ * Lado (em células) dos tiles usados por grid_init().
+ */
+#define GRID_DEFAULT_TILE_SIZE 16
+/**
+ * Número máximo de mutexes de tiles.
+ */
+#define GRID_MAX_TILE_LOCKS 16384
+
 /**
  * Inicializa um grid com largura width e altura height.
 
  * Posições com x ou y negativos, assim como posições com x > width ou y >
  * height são consideradas inválidas.
+ *
+ * Equivale a grid_init_tiled(grid, width, height, GRID_DEFAULT_TILE_SIZE).
  */
 void grid_init(grid_t* grid, int width, int height);
 
+/**
+ * Versão de grid_init() que permite escolher o lado dos tiles de lock.
+ *
+ * Precondições:
+ * - tile_size > 0 [abort() se violada]
+ */
+void grid_init_tiled(grid_t* grid, int width, int height, int tile_size);
+
+/**
+ * Versão de grid_init_tiled() que permite escolher a ordem das células nos
+ * blocos (GRID_LAYOUT_ROWS, usada pelas demais, ou GRID_LAYOUT_MORTON).
+ *
+ * Precondições:
+ * - as de grid_init_tiled()
+ * - layout é um GRID_LAYOUT_* [abort() se violada]
+ */
+void grid_init_layout(grid_t* grid, int width, int height, int tile_size,
+                      int layout);
+
+/**
+ * Troca a ordem das células de grid para layout, reorganizando os blocos já
+ * escritos. O conteúdo do grid não muda.
+ *
+ * Precondições:
+ * - layout é um GRID_LAYOUT_* [abort() se violada]
+ * - nenhuma outra thread usa o grid durante a chamada
+ */
+void grid_set_layout(grid_t* grid, int layout);
+
 /**
  * Libera quaisquer recursos alocados por grid_init(grid)
  */
@@ -83,8 +255,10 @@ int grid_isvalid(grid_t* grid, pos_t pos);
 #define GRID_OBJ_OBSTACLE  2 ///< há um obstáculo na célula
 #define GRID_OBJ_INVALID  -1 ///< posição está fora dos limites do grid
 
-#define GRID_OBJ__MIN -1
-#define GRID_OBJ__MAX  3
+/**
+ * Máscara dos 2 bits de uma célula em grid_chunk_t.words.
+ */
+#define GRID_OBJ__MASK     3
 
 /**
  * Obtem o objeto na posição indicada do grid. Se o objeto é um person_t*,
@@ -121,12 +295,23 @@ int grid_get(grid_t* grid, pos_t pos, person_t** out_person);
  * - type != GRID_OBJ_PERSON  [abort() se violada]
  * - type != GRID_OBJ_INVALID [abort() se violada]
  * - grid_isvalid(pos)        [retorna GRID_OBJ_INVALID se violada]
+ * - colocar ou remover um obstáculo não é concorrente com nenhum outro uso
+ *   do grid (um bloco que fica só com obstáculos é liberado na hora)
  *
  * Efeito (se precondições forem respeitadas):
  * - grid_get(pos, &person_ptr) == type
  */
 int grid_set(grid_t* grid, pos_t pos, int type);
 
+/**
+ * Registra fn para ser chamada por grid_set() sempre que uma célula ocupada
+ * (pessoa ou obstáculo) passa a GRID_OBJ_EMPTY, com a posição liberada e
+ * ctx. fn roda na thread que chamou grid_set(), com os locks que ela tiver.
+ * fn == NULL remove o hook.
+ */
+void grid_set_free_hook(grid_t* grid, void (*fn)(grid_t*, pos_t, void*),
+                        void* ctx);
+
 /**
  * Define que a pessoa fornecida está na célula identificada pela posição. Retorna o tipo
  * de objeto que até então estava na célula ou GRID_OBJ_INVALID se a posição
@@ -142,6 +327,227 @@ int grid_set(grid_t* grid, pos_t pos, int type);
  */
 int grid_set_person(grid_t* grid, pos_t pos, person_t* person);
 
+/**
+ * Devolve à sentinela empty_chunk (com CAS) os blocos que continuam sem
+ * pessoas e sem obstáculos desde que esvaziaram, e os libera. Outras
+ * threads podem ter lido o endereço de um bloco antes da troca, então isso
+ * só é feito quando ninguém usa o grid (a simulação chama na passagem de
+ * turno); até lá, os blocos vazios continuam valendo.
+ *
+ * Precondições:
+ * - nenhuma outra thread usa o grid durante a chamada
+ */
+void grid_release_chunks(grid_t* grid);
+
+/**
+ * Operações em regiões: [from, to) é o retângulo de from.x a to.x-1 e de
+ * from.y a to.y-1, recortado pelos limites do grid. Trabalham palavra a
+ * palavra (32 células de cada vez) e um bloco de grid_t.chunks inteiramente
+ * coberto vira uma sentinela sem tocar nas células.
+ */
+
+/**
+ * Faz de todas as células do retângulo GRID_OBJ_OBSTACLE ou GRID_OBJ_EMPTY,
+ * como grid_set() célula a célula, exceto que células com pessoas ficam como
+ * estão. Retorna o número de células alteradas.
+ *
+ * Precondições:
+ * - type é GRID_OBJ_EMPTY ou GRID_OBJ_OBSTACLE [abort() se violada]
+ * - as de grid_set() para colocar ou remover obstáculos
+ */
+size_t grid_fill_rect(grid_t* grid, pos_t from, pos_t to, int type);
+
+/**
+ * Número de células do retângulo com o tipo type (GRID_OBJ_EMPTY,
+ * GRID_OBJ_PERSON ou GRID_OBJ_OBSTACLE). Pode ser chamada enquanto a
+ * simulação roda: as células são lidas uma palavra de cada vez, sem locks,
+ * então o resultado não é uma foto instantânea da região inteira.
+ *
+ * Precondições:
+ * - type é um dos tipos acima [abort() se violada]
+ */
+size_t grid_count_rect(grid_t* grid, pos_t from, pos_t to, int type);
+
+/**
+ * Copia a camada de obstáculos do retângulo [from, to) de src para dst, com
+ * from em dst_pos: cada célula de dst vira GRID_OBJ_OBSTACLE se a célula
+ * correspondente de src é um obstáculo e GRID_OBJ_EMPTY caso contrário
+ * (pessoas não são copiadas, e células de dst com pessoas ficam como estão).
+ * O que cair fora de dst é ignorado. Retorna o número de células de dst
+ * alteradas. É mais rápida quando os dois grids usam GRID_LAYOUT_ROWS.
+ *
+ * Precondições:
+ * - dst != src [abort() se violada]
+ * - as de grid_fill_rect() em dst
+ * - nenhuma outra thread coloca ou remove obstáculos em src
+ */
+size_t grid_copy_region(grid_t* dst, pos_t dst_pos, grid_t* src,
+                        pos_t from, pos_t to);
+
+/**
+ * Retorna uma máscara com o bit i ligado se a célula
+ * pos_add(pos, grid_neighbor_offsets[i]) é válida e está vazia
+ * (GRID_OBJ_EMPTY). Lê no máximo duas palavras de grid_chunk_t.words por
+ * linha da vizinhança.
+ *
+ * Precondições:
+ * - grid_isvalid(grid, pos) [abort() se violada]
+ */
+unsigned grid_free_neighbors(grid_t* grid, pos_t pos);
+
+/**
+ * Generalização de grid_free_neighbors(): bit i ligado se o vizinho i é
+ * válido e contém um objeto do tipo type (GRID_OBJ_EMPTY, GRID_OBJ_PERSON ou
+ * GRID_OBJ_OBSTACLE).
+ */
+unsigned grid_neighbors_of_type(grid_t* grid, pos_t pos, int type);
+
+/**
+ * Kernel de pontuação da 8-vizinhança usado por person_next_pos().
+ *
+ * Para cada vizinho i (pos_add(pos, grid_neighbor_offsets[i])) com o bit i
+ * ligado em free_mask e dist[i] >= 0, a pontuação é o par
+ * (dist[i], distância euclidiana ao quadrado até goal). Retorna o índice do
+ * vizinho com a menor pontuação (em ordem lexicográfica; empates ficam com o
+ * menor índice), ou -1 se nenhum vizinho tem pontuação estritamente menor
+ * que (cur_dist, cur_eucl).
+ *
+ * Se dist == NULL, todos os vizinhos livres têm dist 0 e cur_dist/cur_eucl
+ * são ignorados (escolhe o vizinho livre mais próximo de goal, se houver).
+ *
+ * Usa AVX2 ou SSE2 quando disponíveis em tempo de compilação (veja SIMD no
+ * Makefile) e código escalar caso contrário ou quando goal está a mais de
+ * 32766 células de distância em algum eixo.
+ */
+int grid_score_neighbors(const int* dist, pos_t pos, pos_t goal,
+                         unsigned free_mask, int cur_dist, int64_t cur_eucl);
+
+/**
+ * Versão escalar (de referência) de grid_score_neighbors().
+ */
+int grid_score_neighbors_scalar(const int* dist, pos_t pos, pos_t goal,
+                                unsigned free_mask, int cur_dist,
+                                int64_t cur_eucl);
+
+/**
+ * Mutexes de tiles travados por grid_lock_neighborhood(), em grid_t.tile_locks.
+ * Uma vizinhança 3x3 toca no máximo 9 tiles (quando tile_size == 1).
+ */
+typedef struct grid_lock_s {
+    int n;
+    int tiles[9];
+    uint64_t prof; ///< token de lockprof_hold_begin()
+} grid_lock_t;
+
+/**
+ * Trava todos os tiles que contêm alguma célula da vizinhança 3x3 centrada em
+ * center (posições inválidas são ignoradas). Enquanto os locks estiverem
+ * tomados, a thread pode usar grid_get(), grid_set() e grid_set_person()
+ * nessa vizinhança sem interferência de outras threads que também usem
+ * grid_lock_neighborhood().
+ *
+ * Os mutexes são sempre travados em ordem crescente de índice (e cada um uma
+ * única vez, mesmo que cubra vários tiles da vizinhança), o que evita
+ * deadlocks quando duas vizinhanças compartilham mutexes.
+ *
+ * Precondições:
+ * - grid_isvalid(grid, center) [abort() se violada]
+ *
+ * Efeito:
+ * - *lock descreve os tiles travados e deve ser passado a grid_unlock()
+ */
+void grid_lock_neighborhood(grid_t* grid, pos_t center, grid_lock_t* lock);
+
+/**
+ * Libera os tiles travados por grid_lock_neighborhood().
+ */
+void grid_unlock(grid_t* grid, grid_lock_t* lock);
+
+/* --- --- --- --- grid_field_t  --- --- --- --- */
+
+#define GRID_FIELD_UNREACHABLE -1
+
+/**
+ * Número de buckets da tabela hash de campos
+ */
+#define GRID_FIELD_BUCKETS 256
+
+/**
+ * Limite de células (somando todos os campos) mantidas na cache. Objetivos
+ * que excederiam esse limite não ganham campo e person_next_pos() usa o
+ * algoritmo guloso.
+ */
+#define GRID_FIELD_MAX_CELLS (32*1024*1024)
+/**
+ * Lado dos tiles de grid_field_t.dist em GRID_LAYOUT_MORTON.
+ */
+#define GRID_FIELD_TILE 8
+
+/**
+ * Campo de distâncias até goal: dist[grid_field_index(grid, (x, y))] é o
+ * número mínimo de passos (8-vizinhança) de (x, y) até goal desviando de
+ * obstáculos, ou GRID_FIELD_UNREACHABLE. Pessoas são ignoradas: o campo
+ * depende só da camada de obstáculos e, uma vez publicado, nunca é alterado.
+ * Pode ser lido por várias threads sem sincronização.
+ */
+typedef struct grid_field_s {
+    pos_t goal;
+    unsigned obstacles_version;
+    int* dist;
+    struct grid_field_s* next;
+} grid_field_t;
+
+/**
+ * Índice de pos em grid_field_t.dist: y*width + x em GRID_LAYOUT_ROWS; em
+ * GRID_LAYOUT_MORTON, tiles de GRID_FIELD_TILE x GRID_FIELD_TILE (em ordem
+ * row-major, assim como as células de cada tile), para que a vizinhança 3x3
+ * de uma célula não fique espalhada por três linhas distantes do campo.
+ */
+static inline size_t grid_field_index(grid_t* grid, pos_t pos) {
+    if (grid->layout == GRID_LAYOUT_ROWS)
+        return (size_t)pos.y*grid->width + pos.x;
+    size_t tiles_x = (grid->width + GRID_FIELD_TILE-1) / GRID_FIELD_TILE;
+    size_t tile = (size_t)(pos.y / GRID_FIELD_TILE)*tiles_x
+                + pos.x / GRID_FIELD_TILE;
+    return tile*GRID_FIELD_TILE*GRID_FIELD_TILE
+         + (pos.y % GRID_FIELD_TILE)*GRID_FIELD_TILE + pos.x % GRID_FIELD_TILE;
+}
+
+/**
+ * Retorna o campo de distâncias até goal, calculando-o (BFS sobre os
+ * obstáculos) se ele ainda não está na cache ou se os obstáculos mudaram
+ * desde o cálculo. Todas as pessoas com o mesmo objetivo compartilham o mesmo
+ * campo, que permanece válido até grid_destroy().
+ *
+ * Retorna NULL se goal é inválida ou se a cache atingiu o limite de
+ * células (GRID_FIELD_MAX_CELLS, veja grid_set_field_limit()).
+ *
+ * Thread-safe.
+ */
+grid_field_t* grid_field_get(grid_t* grid, pos_t goal);
+
+/**
+ * Troca o limite de células da cache de campos (GRID_FIELD_MAX_CELLS por
+ * padrão). Campos já calculados continuam valendo; com 0, nenhum objetivo
+ * novo ganha campo e todas as suas pessoas usam o algoritmo guloso.
+ *
+ * Thread-safe.
+ */
+void grid_set_field_limit(grid_t* grid, size_t cells);
+
+/**
+ * Calcula em f, fora da cache, o campo de distâncias até goal, para quem não
+ * ganhou campo de grid_field_get() (veja person_route()). f->dist é alocado
+ * na primeira chamada e reaproveitado nas seguintes, e nada é refeito se f já
+ * é o campo de goal na versão atual dos obstáculos. Retorna 0, ou -1 se o
+ * grid tem mais de GRID_FIELD_MAX_CELLS células (f não muda).
+ *
+ * Precondições:
+ * - f->dist é NULL ou foi alocado por grid_field_fill() neste grid, com o
+ *   mesmo layout [UNDEFINED BEHAVIOR se violada]
+ */
+int grid_field_fill(grid_t* grid, grid_field_t* f, pos_t goal);
+
 /**
  * Lista de 8 offsets que permitem computar os 8 vizinhos de um
  * ponto. Veja um exemplo de uso em person_next_pos(), definida no
@@ -157,7 +563,82 @@ typedef struct person_s {
     pos_t  current_pos;
     pos_t  goal_pos;
     size_t time, last_move;
-    // Talvez falte algo aqui...
+    /**
+     * 1 enquanto a pessoa está plugada na simulação e ainda não chegou ao
+     * objetivo. Só é alterado na passagem de turno.
+     */
+    int    plugged;
+    /**
+     * 1 se a pessoa chegou ao objetivo (ou foi removida) durante o turno
+     * atual. A simulação a retira da lista na passagem de turno.
+     */
+    int    done;
+    /**
+     * PERSON_LEFT enquanto a pessoa não está plugada (person_join() retorna
+     * direto), PERSON_PLUGGED enquanto está e PERSON_JOINING se além disso
+     * há alguém esperando em person_join() (só então person_leave() faz uma
+     * chamada de sistema para acordar).
+     */
+    atomic_int left;
+    /**
+     * Grupo de person_group_add() a ser avisado quando a pessoa sair, ou
+     * NULL.
+     */
+    _Atomic(struct person_group_s*) group;
+    /**
+     * Último campo de distâncias usado por person_next_pos(). Evita consultar
+     * a cache (e seu mutex) a cada passo.
+     */
+    grid_field_t* field;
+    /**
+     * Slot da pessoa em grid_t.slots (0 se ainda não tem um). Atribuído no
+     * primeiro grid_set_person() e mantido enquanto o grid existir.
+     */
+    uint32_t grid_slot;
+    /**
+     * Posição proposta para o turno corrente nos modos
+     * SIM_MODE_DETERMINISTIC e SIM_MODE_COOPERATIVE (veja simulation.h).
+     */
+    pos_t next_pos;
+    /**
+     * SIM_MODE_COOPERATIVE: caminho reservado no planner_t da simulação.
+     * plan[i] é a posição da pessoa ao fim do turno plan_time + i (plan[0] é
+     * a posição antes do turno em que o caminho foi traçado). Alocado no
+     * primeiro planejamento e mantido por person_recycle().
+     */
+    pos_t* plan;
+    size_t plan_time;
+    int plan_len;
+    /**
+     * Desvio para sair de um mínimo local do algoritmo guloso (veja
+     * person_reroute() e person_route()): enquanto detour_next < detour_len,
+     * a pessoa segue as células detour[detour_next..detour_len) em vez de ir
+     * direto ao objetivo. Alocado (com detour_cap posições) no primeiro
+     * desvio e mantido por person_recycle().
+     */
+    pos_t* detour;
+    int detour_len, detour_next, detour_cap;
+    /**
+     * 1 se a pessoa não pode sair do lugar até que alguma célula vizinha seja
+     * liberada. A simulação não a move enquanto estiver estacionada.
+     */
+    atomic_int parked;
+    /**
+     * Uso interno da simulação: posição em simulation_t.persons e próximo
+     * elemento da pilha de pessoas acordadas (SIM_MODE_EVENT).
+     */
+    int sim_index;
+    struct person_s* wake_next;
+    /**
+     * Uso interno da simulação durante a busca por gridlocks: 1 + índice da
+     * pessoa na lista de bloqueadas, ou 0 se ela não está bloqueada.
+     * gridlock_best é a menor distância (euclidiana, ao quadrado) até o
+     * objetivo vista nas buscas e gridlock_stall quantas buscas seguidas
+     * não a melhoraram.
+     */
+    int gridlock;
+    int64_t gridlock_best;
+    int gridlock_stall;
 } person_t;
 
 /**
@@ -168,18 +649,128 @@ void person_init(person_t* person, int id);
  * Destrói quaisquer recursos que person_init(person) tenha alocado
  */
 void person_destroy(person_t* person);
+/**
+ * Reinicializa uma pessoa que já saiu da simulação para reaproveitá-la com
+ * outro id. Equivale a person_destroy() seguido de person_init(), mas mantém
+ * o slot do grid, que assim não cresce a cada pessoa nova, e o buffer de
+ * person->plan.
+ *
+ * Precondições:
+ * - a pessoa não está plugada e ninguém espera por ela em person_join() ou
+ *   num person_group_t [UNDEFINED BEHAVIOR se violada]
+ */
+void person_recycle(person_t* person, int id);
+
+#define PERSON_LEFT    1
+#define PERSON_PLUGGED 0
+#define PERSON_JOINING 2
 
 /**
- * Bloqueia até que essa pessoa chegue na sua posição objetivo
+ * Bloqueia até que essa pessoa chegue na sua posição objetivo (ou seja
+ * removida da simulação). Retorna imediatamente se a pessoa não está plugada.
  */
 void person_join(person_t* person);
 
+/**
+ * Usadas pela simulação: person_enter() marca a pessoa como plugada e
+ * person_leave() a marca como fora da simulação, liberando person_join() e o
+ * grupo da pessoa, se houver.
+ */
+void person_enter(person_t* person);
+void person_leave(person_t* person);
+
+/**
+ * Conjunto de pessoas aguardadas de uma só vez: um contador das que ainda
+ * não saíram da simulação e uma única espera (e um único despertar) quando
+ * ele chega a 0.
+ */
+typedef struct person_group_s {
+    atomic_int pending;
+} person_group_t;
+
+void person_group_init(person_group_t* group);
+/**
+ * Inclui person em group. Se person já saiu (ou nunca foi plugada), não
+ * conta. Uma pessoa pertence a no máximo um grupo por vez, e só até sair.
+ */
+void person_group_add(person_group_t* group, person_t* person);
+/**
+ * Bloqueia até que todas as pessoas incluídas em group tenham saído da
+ * simulação.
+ */
+void person_group_join(person_group_t* group);
+
 /**
  * Calcula a próxima posição da pessoa para que ela atinja seu objetivo dentro
  * do grid fornecido.
+ *
+ * Usa o campo de distâncias de grid_field_get(): a pessoa vai para a célula
+ * vizinha vazia mais próxima do objetivo (desempate pela distância
+ * euclidiana), desde que essa célula não esteja mais longe que a atual. Se
+ * não há campo para o objetivo, usa o algoritmo guloso euclidiano. Durante
+ * um desvio (veja person_reroute()), vai para a próxima célula do desvio, ou
+ * espera que ela seja liberada.
  */
 pos_t person_next_pos(person_t* person, grid_t* grid);
 
+/**
+ * Retorna o índice em grid_neighbor_offsets do vizinho que person_next_pos()
+ * escolheria se as células livres em volta da pessoa fossem as de mask (bit i
+ * para grid_neighbor_offsets[i], como em grid_free_neighbors()), ou -1 se
+ * ela ficaria parada.
+ */
+int person_choose(person_t* person, grid_t* grid, unsigned mask);
+
+/**
+ * Retorna 0 se o objetivo da pessoa é inalcançável a partir da posição atual
+ * (o campo de distâncias existe e a marca com GRID_FIELD_UNREACHABLE), ou 1
+ * caso contrário. Sem campo, presume que o objetivo é alcançável.
+ */
+int person_reachable(person_t* person, grid_t* grid);
+
+/**
+ * Raio (e comprimento máximo) dos desvios de person_reroute().
+ */
+#define GRID_DETOUR_RADIUS 24
+
+/**
+ * Tira a pessoa de um mínimo local do algoritmo guloso (um beco entre
+ * obstáculos, onde ela oscila sem nunca chegar): procura, em até
+ * GRID_DETOUR_RADIUS passos desviando de obstáculos (pessoas são
+ * ignoradas), a célula mais próxima do objetivo, e a pessoa passa a seguir
+ * esse caminho (person->detour) como um objetivo temporário. Só há desvio
+ * se essa célula está a uma distância euclidiana ao quadrado menor que
+ * below. Retorna 1 se a pessoa ganhou um desvio.
+ *
+ * Precondições:
+ * - person->current_pos é uma posição válida de grid
+ *   [UNDEFINED BEHAVIOR se violada]
+ */
+int person_reroute(person_t* person, grid_t* grid, int64_t below);
+
+/**
+ * Último recurso de quem person_reroute() não tira do beco: a pessoa passa
+ * a seguir (person->detour) um caminho mais curto até o objetivo desviando
+ * de obstáculos (pessoas são ignoradas), descendo pelo campo field, que
+ * pode ser compartilhado por todas as pessoas com o mesmo objetivo (veja
+ * grid_field_fill()). Retorna 1 se a pessoa ganhou o desvio, ou 0 se o
+ * objetivo é inalcançável.
+ *
+ * Precondições:
+ * - field->goal == person->goal_pos [abort() se violada]
+ * - person->current_pos é uma posição válida de grid
+ *   [UNDEFINED BEHAVIOR se violada]
+ */
+int person_route(person_t* person, grid_t* grid, grid_field_t* field);
+
+/**
+ * Retorna 1 se, estando a célula vizinha cell livre, person_next_pos() tiraria
+ * a pessoa do lugar (cell é estritamente melhor que a posição atual pelo
+ * critério de person_next_pos()). Retorna 1 sempre que a pessoa usaria o
+ * algoritmo guloso. Não consulta a cache de campos: usa person->field.
+ */
+int person_improves(person_t* person, grid_t* grid, pos_t cell);
+
 
 #endif /*INE5410_GRID_H_*/
 
@@ -0,0 +1,63 @@
+#include "heap.h"
+#include <stdlib.h>
+#include <assert.h>
+
+void heap_init(heap_t* h, size_t capacity) {
+    assert(capacity > 0);
+    h->size = 0;
+    h->capacity = capacity;
+    h->entries = malloc(capacity*sizeof(heap_entry_t));
+}
+
+void heap_destroy(heap_t* h) {
+    free(h->entries);
+    h->entries = NULL;
+}
+
+void heap_push(heap_t* h, uint64_t key, void* val) {
+    if (h->size == h->capacity) {
+        h->capacity *= 2;
+        h->entries = realloc(h->entries, h->capacity*sizeof(heap_entry_t));
+    }
+    // sobe com um "buraco" em vez de trocas sucessivas
+    size_t i = h->size++;
+    while (i > 0) {
+        size_t parent = (i-1) / HEAP_ARITY;
+        if (h->entries[parent].key <= key)
+            break;
+        h->entries[i] = h->entries[parent];
+        i = parent;
+    }
+    h->entries[i].key = key;
+    h->entries[i].val = val;
+}
+
+int heap_pop_until(heap_t* h, uint64_t max_key, void** out) {
+    if (!h->size || h->entries[0].key > max_key)
+        return 0;
+    *out = h->entries[0].val;
+    heap_entry_t last = h->entries[--h->size];
+    size_t i = 0;
+    while (1) {
+        size_t first = i*HEAP_ARITY + 1;
+        if (first >= h->size)
+            break;
+        size_t end = first + HEAP_ARITY, min = first;
+        if (end > h->size)
+            end = h->size;
+        for (size_t c = first+1; c < end; ++c) {
+            if (h->entries[c].key < h->entries[min].key)
+                min = c;
+        }
+        if (h->entries[min].key >= last.key)
+            break;
+        h->entries[i] = h->entries[min];
+        i = min;
+    }
+    h->entries[i] = last;
+    return 1;
+}
+
+int heap_empty(heap_t* h) {
+    return h->size == 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __HEAP_H__
+#define __HEAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Número de filhos de cada nó. Com 4 filhos a árvore tem metade da altura de
+ * um heap binário e os filhos de um nó ficam na mesma linha de cache.
+ */
+#define HEAP_ARITY 4
+
+typedef struct heap_entry_s {
+    uint64_t key;
+    void* val;
+} heap_entry_t;
+
+/**
+ * Heap de mínimo d-ário (HEAP_ARITY) de pares (key, val), em um vetor que
+ * cresce conforme necessário. Não é thread-safe.
+ */
+typedef struct {
+    heap_entry_t* entries;
+    size_t size, capacity;
+} heap_t;
+
+extern void heap_init(heap_t* h, size_t capacity);
+extern void heap_destroy(heap_t* h);
+extern void heap_push(heap_t* h, uint64_t key, void* val);
+/**
+ * Retira o par de menor key, se essa key for <= max_key. Retorna 1 e coloca
+ * o valor em *out, ou retorna 0 (heap vazio ou menor key > max_key).
+ */
+extern  int heap_pop_until(heap_t* h, uint64_t max_key, void** out);
+extern  int heap_empty(heap_t* h);
+
+#endif /*__HEAP_H__*/
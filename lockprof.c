@@ -0,0 +1,227 @@
+#include "lockprof.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* --- --- --- --- registro e shards  --- --- --- --- */
+
+static _Atomic(lockprof_site_t*) lockprof_sites;
+
+#ifndef LOCKPROF_DISABLE
+
+static atomic_int lockprof_next_thread;
+
+/**
+ * Índice da thread (atribuído no primeiro uso, começando em 1) e contador de
+ * aquisições para a amostragem do tempo com o lock tomado.
+ */
+static _Thread_local int lockprof_thread;
+static _Thread_local unsigned lockprof_tick;
+
+static uint64_t lockprof_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+static int lockprof_bucket(uint64_t ns) {
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+    return b < LOCKPROF_BUCKETS ? b : LOCKPROF_BUCKETS-1;
+}
+
+/**
+ * Shard da thread corrente em site. Na primeira chamada para o site, coloca-o
+ * na lista global (lockprof_report() só enxerga sites já usados).
+ */
+static lockprof_shard_t* lockprof_shard(lockprof_site_t* site) {
+    if (!atomic_load_explicit(&site->registered, memory_order_acquire)
+        && !atomic_exchange(&site->registered, 1)) {
+        lockprof_site_t* head = atomic_load(&lockprof_sites);
+        do {
+            site->next = head;
+        } while (!atomic_compare_exchange_weak(&lockprof_sites, &head, site));
+    }
+    if (!lockprof_thread)
+        lockprof_thread = atomic_fetch_add(&lockprof_next_thread, 1) + 1;
+    return site->shards + lockprof_thread % LOCKPROF_SHARDS;
+}
+
+static void lockprof_add(atomic_size_t* c, size_t v) {
+    atomic_fetch_add_explicit(c, v, memory_order_relaxed);
+}
+
+static void lockprof_add64(atomic_uint_least64_t* c, uint64_t v) {
+    atomic_fetch_add_explicit(c, v, memory_order_relaxed);
+}
+
+/* --- --- --- --- aquisição  --- --- --- --- */
+
+void lockprof_acquire(lockprof_site_t* site, pthread_mutex_t* m) {
+    lockprof_shard_t* s = lockprof_shard(site);
+    lockprof_add(&s->acquired, 1);
+    if (!pthread_mutex_trylock(m))
+        return;
+    uint64_t t0 = lockprof_now_ns();
+    pthread_mutex_lock(m);
+    uint64_t wait = lockprof_now_ns() - t0;
+    lockprof_add(&s->contended, 1);
+    lockprof_add64(&s->wait_ns, wait);
+    lockprof_add(&s->wait_hist[lockprof_bucket(wait)], 1);
+}
+
+uint64_t lockprof_hold_begin(lockprof_site_t* site) {
+    (void)site;
+    // token 0 = aquisição não amostrada
+    if (lockprof_tick++ % LOCKPROF_HOLD_SAMPLE)
+        return 0;
+    return lockprof_now_ns() | 1;
+}
+
+void lockprof_hold_end(lockprof_site_t* site, uint64_t token) {
+    if (!token)
+        return;
+    uint64_t hold = lockprof_now_ns() - token;
+    lockprof_shard_t* s = lockprof_shard(site);
+    lockprof_add(&s->hold_samples, 1);
+    lockprof_add64(&s->hold_ns, hold);
+    lockprof_add(&s->hold_hist[lockprof_bucket(hold)], 1);
+}
+
+uint64_t lockprof_lock(lockprof_site_t* site, pthread_mutex_t* m) {
+    lockprof_acquire(site, m);
+    return lockprof_hold_begin(site);
+}
+
+void lockprof_unlock(lockprof_site_t* site, pthread_mutex_t* m,
+                     uint64_t token) {
+    lockprof_hold_end(site, token);
+    pthread_mutex_unlock(m);
+}
+
+void lockprof_cond_wait(lockprof_site_t* site, pthread_cond_t* c,
+                        pthread_mutex_t* m, uint64_t* token) {
+    lockprof_hold_end(site, *token);
+    pthread_cond_wait(c, m);
+    // A reaquisição dentro de pthread_cond_wait() não é contada: o tempo
+    // até ela é a espera pela condição, não pelo mutex
+    *token = *token ? lockprof_now_ns() | 1 : 0;
+}
+
+#endif /*LOCKPROF_DISABLE*/
+
+/* --- --- --- --- relatório  --- --- --- --- */
+
+/**
+ * Soma dos shards de um site.
+ */
+typedef struct lockprof_total_s {
+    lockprof_site_t* site;
+    size_t acquired, contended, hold_samples;
+    uint64_t wait_ns, hold_ns;
+    size_t wait_hist[LOCKPROF_BUCKETS], hold_hist[LOCKPROF_BUCKETS];
+} lockprof_total_t;
+
+static void lockprof_sum(lockprof_site_t* site, lockprof_total_t* t) {
+    memset(t, 0, sizeof(lockprof_total_t));
+    t->site = site;
+    for (int i = 0; i < LOCKPROF_SHARDS; ++i) {
+        lockprof_shard_t* s = site->shards + i;
+        t->acquired += atomic_load_explicit(&s->acquired, memory_order_relaxed);
+        t->contended += atomic_load_explicit(&s->contended, memory_order_relaxed);
+        t->hold_samples += atomic_load_explicit(&s->hold_samples,
+                                                memory_order_relaxed);
+        t->wait_ns += atomic_load_explicit(&s->wait_ns, memory_order_relaxed);
+        t->hold_ns += atomic_load_explicit(&s->hold_ns, memory_order_relaxed);
+        for (int b = 0; b < LOCKPROF_BUCKETS; ++b) {
+            t->wait_hist[b] += atomic_load_explicit(&s->wait_hist[b],
+                                                    memory_order_relaxed);
+            t->hold_hist[b] += atomic_load_explicit(&s->hold_hist[b],
+                                                    memory_order_relaxed);
+        }
+    }
+}
+
+static int lockprof_cmp(const void* a, const void* b) {
+    uint64_t wa = ((const lockprof_total_t*)a)->wait_ns;
+    uint64_t wb = ((const lockprof_total_t*)b)->wait_ns;
+    if (wa != wb)
+        return wa < wb ? 1 : -1;
+    size_t ca = ((const lockprof_total_t*)a)->acquired;
+    size_t cb = ((const lockprof_total_t*)b)->acquired;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/**
+ * Limite superior (ns) do bucket que contém o percentil p do histograma, ou
+ * 0 se ele está vazio.
+ */
+static uint64_t lockprof_percentile(const size_t* hist, double p) {
+    size_t n = 0;
+    for (int b = 0; b < LOCKPROF_BUCKETS; ++b)
+        n += hist[b];
+    if (!n)
+        return 0;
+    size_t rank = (size_t)(p*(n-1)) + 1, seen = 0;
+    for (int b = 0; b < LOCKPROF_BUCKETS; ++b) {
+        if ((seen += hist[b]) >= rank)
+            return (uint64_t)2 << b;
+    }
+    return (uint64_t)2 << (LOCKPROF_BUCKETS-1);
+}
+
+/**
+ * Formata ns com unidade em buf (ao menos 16 bytes).
+ */
+static const char* lockprof_fmt(char* buf, uint64_t ns) {
+    if (ns < 10000)
+        snprintf(buf, 16, "%lluns", (unsigned long long)ns);
+    else if (ns < 10000000)
+        snprintf(buf, 16, "%.1fus", ns/1e3);
+    else if (ns < 10000000000u)
+        snprintf(buf, 16, "%.1fms", ns/1e6);
+    else
+        snprintf(buf, 16, "%.1fs", ns/1e9);
+    return buf;
+}
+
+void lockprof_report(int fd, int top) {
+    size_t n = 0;
+    for (lockprof_site_t* s = atomic_load(&lockprof_sites); s; s = s->next)
+        ++n;
+    if (!n)
+        return;
+    lockprof_total_t* totals = malloc(n*sizeof(lockprof_total_t));
+    size_t i = 0;
+    for (lockprof_site_t* s = atomic_load(&lockprof_sites); s; s = s->next)
+        lockprof_sum(s, totals + i++);
+    qsort(totals, n, sizeof(lockprof_total_t), lockprof_cmp);
+
+    if ((size_t)top > n)
+        top = n;
+    char line[512], b[5][16];
+    int len = snprintf(line, sizeof(line),
+                       "Lock sites (top %d of %zu by wait time; hold sampled "
+                       "1/%d)\n%-32s %10s %10s %9s %9s %9s %9s %9s\n",
+                       top, n, LOCKPROF_HOLD_SAMPLE, "site", "acquired",
+                       "contended", "wait", "wait p50", "wait p99",
+                       "hold p50", "hold p99");
+    write(fd, line, len);
+    for (i = 0; i < n && i < (size_t)top; ++i) {
+        lockprof_total_t* t = totals + i;
+        len = snprintf(line, sizeof(line),
+                       "%-32s %10zu %10zu %9s %9s %9s %9s %9s  %s:%d\n",
+                       t->site->name, t->acquired, t->contended,
+                       lockprof_fmt(b[0], t->wait_ns),
+                       lockprof_fmt(b[1], lockprof_percentile(t->wait_hist, .5)),
+                       lockprof_fmt(b[2], lockprof_percentile(t->wait_hist, .99)),
+                       lockprof_fmt(b[3], lockprof_percentile(t->hold_hist, .5)),
+                       lockprof_fmt(b[4], lockprof_percentile(t->hold_hist, .99)),
+                       t->site->file, t->site->line);
+        if (len >= (int)sizeof(line))
+            len = sizeof(line)-1;
+        write(fd, line, len);
+    }
+    free(totals);
+}
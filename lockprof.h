@@ -0,0 +1,122 @@
+#ifndef __LOCKPROF_H__
+#define __LOCKPROF_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Perfil de contenção de locks. Cada ponto do código que trava um mutex
+ * declara um lockprof_site_t estático (LOCKPROF_SITE) e trava por
+ * lockprof_lock()/lockprof_unlock() em vez de pthread_mutex_lock()/unlock().
+ *
+ * Cada site conta aquisições e aquisições contidas (pthread_mutex_trylock()
+ * falhou) e guarda histogramas em escala log2 (o bucket i conta durações em
+ * [2^i, 2^(i+1)) ns) do tempo de espera, medido só nas aquisições contidas, e
+ * do tempo com o lock tomado, amostrado em 1 de cada LOCKPROF_HOLD_SAMPLE
+ * aquisições de cada thread. Uma aquisição sem contenção custa um trylock e
+ * um incremento relaxed no shard da thread: o perfil fica ligado por padrão.
+ * Compilar com -DLOCKPROF_DISABLE (make LOCKPROF=0) troca tudo por chamadas
+ * diretas ao pthread.
+ */
+#define LOCKPROF_BUCKETS     32
+#define LOCKPROF_SHARDS      16
+#define LOCKPROF_HOLD_SAMPLE 64
+#define LOCKPROF_CACHE_LINE  64
+
+/**
+ * Contadores de um site usados por um subconjunto das threads (escolhido
+ * pelo índice da thread), para que threads diferentes não disputem a mesma
+ * linha de cache.
+ */
+typedef struct lockprof_shard_s {
+    _Alignas(LOCKPROF_CACHE_LINE) atomic_size_t acquired, contended;
+    atomic_uint_least64_t wait_ns, hold_ns;
+    atomic_size_t hold_samples;
+    atomic_size_t wait_hist[LOCKPROF_BUCKETS];
+    atomic_size_t hold_hist[LOCKPROF_BUCKETS];
+} lockprof_shard_t;
+
+typedef struct lockprof_site_s {
+    const char* name;
+    const char* file;
+    int line;
+    atomic_int registered;
+    struct lockprof_site_s* next; ///< lista global de sites já usados
+    lockprof_shard_t shards[LOCKPROF_SHARDS];
+} lockprof_site_t;
+
+/**
+ * Declara o site var (estático) com o nome name.
+ */
+#define LOCKPROF_SITE(var, name) \
+    static lockprof_site_t var = {name, __FILE__, __LINE__}
+
+#ifndef LOCKPROF_DISABLE
+
+/**
+ * Trava m, contando a aquisição em site. Retorna o token a ser passado a
+ * lockprof_unlock() (ou a lockprof_hold_end()).
+ */
+extern uint64_t lockprof_lock(lockprof_site_t* site, pthread_mutex_t* m);
+extern void lockprof_unlock(lockprof_site_t* site, pthread_mutex_t* m,
+                            uint64_t token);
+/**
+ * pthread_cond_wait() que não conta a espera pela condição como tempo com
+ * o lock tomado. *token é o valor retornado por lockprof_lock().
+ */
+extern void lockprof_cond_wait(lockprof_site_t* site, pthread_cond_t* c,
+                               pthread_mutex_t* m, uint64_t* token);
+
+/**
+ * Partes de lockprof_lock()/lockprof_unlock() para quem trava vários mutexes
+ * de um mesmo site de uma vez (como grid_lock_neighborhood()): cada mutex é
+ * travado com lockprof_acquire() e o tempo com todos tomados é medido por
+ * lockprof_hold_begin()/lockprof_hold_end().
+ */
+extern void lockprof_acquire(lockprof_site_t* site, pthread_mutex_t* m);
+extern uint64_t lockprof_hold_begin(lockprof_site_t* site);
+extern void lockprof_hold_end(lockprof_site_t* site, uint64_t token);
+
+#else
+
+static inline uint64_t lockprof_lock(lockprof_site_t* site,
+                                     pthread_mutex_t* m) {
+    (void)site;
+    pthread_mutex_lock(m);
+    return 0;
+}
+static inline void lockprof_unlock(lockprof_site_t* site, pthread_mutex_t* m,
+                                   uint64_t token) {
+    (void)site; (void)token;
+    pthread_mutex_unlock(m);
+}
+static inline void lockprof_cond_wait(lockprof_site_t* site,
+                                      pthread_cond_t* c, pthread_mutex_t* m,
+                                      uint64_t* token) {
+    (void)site; (void)token;
+    pthread_cond_wait(c, m);
+}
+static inline void lockprof_acquire(lockprof_site_t* site,
+                                    pthread_mutex_t* m) {
+    (void)site;
+    pthread_mutex_lock(m);
+}
+static inline uint64_t lockprof_hold_begin(lockprof_site_t* site) {
+    (void)site;
+    return 0;
+}
+static inline void lockprof_hold_end(lockprof_site_t* site, uint64_t token) {
+    (void)site; (void)token;
+}
+
+#endif /*LOCKPROF_DISABLE*/
+
+/**
+ * Escreve em fd os top sites com maior tempo total de espera (desde o início
+ * do processo), com contagens e percentis dos histogramas.
+ */
+extern void lockprof_report(int fd, int top);
+
+#endif /*__LOCKPROF_H__*/
@@ -5,26 +5,107 @@
 
 int main(int argc, char** argv) {
     int cycles = 1;
+    if (argc == 4 && !strcmp(argv[1], "--convert")) {
+        test_t test;
+        int err = 0;
+        if ((err = test_setup(&test, 1, argv[2])))
+            return err;
+        if ((err = test_save(&test, argv[3])))
+            printf("Não consegui gravar %s: %s\n", argv[3], strerror(err));
+        test_tear_down(&test);
+        return err;
+    }
     if (argc < 3) {
-        printf("Uso: %s n_threads test [cycles]\n"
+        printf("Uso: %s n_threads test [cycles [mode [metrics [opções]]]]\n"
+               "     %s --convert test.test test.scn\n"
                "\n"
                "Onde: \n"
                "    n_threads é o número de threads a serem usadas na simulação\n"
                "    test      é o caminho de um arquivo de testes, como \n"
                "              tests/forever_alone.\n"
                "    cycles    é o número de vezes que cada person_t é re-plugado\n"
-               "              após chegar no seu objetivo. O padrão é %d",
-               argv[0], cycles);
+               "              após chegar no seu objetivo. O padrão é %d\n"
+               "    mode      é locked (padrão), det (turnos determinísticos,\n"
+               "              veja SIM_MODE_DETERMINISTIC), bands (uma faixa\n"
+               "              de linhas por thread, veja SIM_MODE_BANDS),\n"
+               "              event (só pessoas ativas custam, veja\n"
+               "              SIM_MODE_EVENT) ou coop (caminhos planejados\n"
+               "              em conjunto, veja SIM_MODE_COOPERATIVE)\n"
+               "    metrics   é json, csv ou off: escreve as métricas de cada turno\n"
+               "              na saída de erro (veja simulation_set_metrics())\n"
+               "    opções    são, em qualquer ordem:\n"
+               "              locks  escreve na saída de erro, ao fim, os locks\n"
+               "                     com mais contenção (veja\n"
+               "                     simulation_set_lock_report())\n"
+               "              rows   células do grid linha a linha (padrão)\n"
+               "              morton células do grid em ordem Z (veja\n"
+               "                     GRID_LAYOUT_MORTON)\n"
+               "              greedy sem campos de distância: todos usam o\n"
+               "                     algoritmo guloso (veja\n"
+               "                     grid_set_field_limit())\n"
+               "\n"
+               "--convert grava o cenário em texto test.test no formato binário\n"
+               "(veja scenario.h), que também é aceito como test.\n",
+               argv[0], argv[0], cycles);
         return 1;
     }
     int n_threads = atoi(argv[1]);
     if (argc >= 4) 
         cycles = atoi(argv[3]);
+    int mode = SIM_MODE_LOCKED;
+    if (argc >= 5) {
+        if (!strcmp(argv[4], "det")) {
+            mode = SIM_MODE_DETERMINISTIC;
+        } else if (!strcmp(argv[4], "bands")) {
+            mode = SIM_MODE_BANDS;
+        } else if (!strcmp(argv[4], "event")) {
+            mode = SIM_MODE_EVENT;
+        } else if (!strcmp(argv[4], "coop")) {
+            mode = SIM_MODE_COOPERATIVE;
+        } else if (strcmp(argv[4], "locked")) {
+            printf("Modo desconhecido: %s\n", argv[4]);
+            return 1;
+        }
+    }
     
+    int metrics = SIM_METRICS_OFF;
+    if (argc >= 6) {
+        if (!strcmp(argv[5], "json")) {
+            metrics = SIM_METRICS_JSON;
+        } else if (!strcmp(argv[5], "csv")) {
+            metrics = SIM_METRICS_CSV;
+        } else if (strcmp(argv[5], "off")) {
+            printf("Formato de métricas desconhecido: %s\n", argv[5]);
+            return 1;
+        }
+    }
+    int locks = 0, greedy = 0, layout = GRID_LAYOUT_ROWS;
+    for (int i = 6; i < argc; ++i) {
+        if (!strcmp(argv[i], "locks")) {
+            locks = 1;
+        } else if (!strcmp(argv[i], "rows")) {
+            layout = GRID_LAYOUT_ROWS;
+        } else if (!strcmp(argv[i], "morton")) {
+            layout = GRID_LAYOUT_MORTON;
+        } else if (!strcmp(argv[i], "greedy")) {
+            greedy = 1;
+        } else {
+            printf("Opção desconhecida: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
     test_t test;
     int err = 0;
     if ((err = test_setup(&test, n_threads, argv[2])))
         return err;
+    simulation_set_mode(&test.sim, mode);
+    simulation_set_layout(&test.sim, layout);
+    if (greedy)
+        grid_set_field_limit(&test.sim.grid, 0);
+    simulation_set_metrics(&test.sim, 2, metrics);
+    if (locks)
+        simulation_set_lock_report(&test.sim, 2);
     test_run(&test, cycles);
     test_tear_down(&test);
     
@@ -0,0 +1,326 @@
+#include "planner.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* --- --- --- --- tabela de reservas  --- --- --- --- */
+
+void planner_init(planner_t* pl) {
+    pl->cap = 1024;
+    pl->entries = calloc(pl->cap, sizeof(planner_entry_t));
+    pl->used = 0;
+    pl->turn = 0;
+    pl->search = 0;
+    pl->seen = calloc(PLANNER_STATES, sizeof(uint32_t));
+    pl->parent = malloc(PLANNER_STATES*sizeof(int32_t));
+    pl->next = malloc(PLANNER_STATES*sizeof(int32_t));
+}
+
+void planner_destroy(planner_t* pl) {
+    free(pl->entries);
+    free(pl->seen);
+    free(pl->parent);
+    free(pl->next);
+}
+
+void planner_begin(planner_t* pl, size_t turn) {
+    pl->turn = turn;
+}
+
+static size_t planner_hash(pos_t pos, size_t turn) {
+    uint64_t h = (uint64_t)(uint32_t)pos.x * 0x9e3779b97f4a7c15ull
+               ^ (uint64_t)(uint32_t)pos.y * 0xc2b2ae3d27d4eb4full
+               ^ (uint64_t)turn * 0x165667b19e3779f9ull;
+    return h ^ h >> 29;
+}
+
+/**
+ * Entrada de (pos, turn), liberada ou não, ou NULL se não existe.
+ */
+static planner_entry_t* planner_find(planner_t* pl, pos_t pos, size_t turn) {
+    size_t mask = pl->cap - 1;
+    for (size_t i = planner_hash(pos, turn) & mask; ; i = (i+1) & mask) {
+        planner_entry_t* e = pl->entries + i;
+        if (!e->turn)
+            return NULL;
+        if (e->turn == turn && pos_equals(e->pos, pos))
+            return e;
+    }
+}
+
+/**
+ * Reconstrói a tabela só com as reservas em vigor, com folga para que
+ * continue no máximo 1/4 cheia.
+ */
+static void planner_rehash(planner_t* pl) {
+    size_t live = 0;
+    for (size_t i = 0; i < pl->cap; ++i) {
+        planner_entry_t* e = pl->entries + i;
+        live += e->turn && e->owner && e->turn >= pl->turn;
+    }
+    size_t cap = 1024;
+    while (cap < 4*(live+1))
+        cap *= 2;
+    planner_entry_t* old = pl->entries;
+    size_t old_cap = pl->cap;
+    pl->entries = calloc(cap, sizeof(planner_entry_t));
+    pl->cap = cap;
+    pl->used = live;
+    for (size_t i = 0; i < old_cap; ++i) {
+        planner_entry_t* e = old + i;
+        if (!e->turn || !e->owner || e->turn < pl->turn)
+            continue;
+        size_t j = planner_hash(e->pos, e->turn) & (cap-1);
+        while (pl->entries[j].turn)
+            j = (j+1) & (cap-1);
+        pl->entries[j] = *e;
+    }
+    free(old);
+}
+
+/**
+ * Reserva pos no turno turn para owner. Retorna o dono anterior da reserva,
+ * ou NULL.
+ */
+static person_t* planner_set(planner_t* pl, pos_t pos, size_t turn,
+                             person_t* owner) {
+    if (2*(pl->used+1) > pl->cap)
+        planner_rehash(pl);
+    size_t mask = pl->cap - 1;
+    planner_entry_t* reuse = NULL, *e;
+    for (size_t i = planner_hash(pos, turn) & mask; ; i = (i+1) & mask) {
+        e = pl->entries + i;
+        if (!e->turn)
+            break;
+        if (e->turn == turn && pos_equals(e->pos, pos)) {
+            person_t* prev = e->owner;
+            e->owner = owner;
+            return prev;
+        }
+        // reservas liberadas ou vencidas podem dar lugar a outras
+        if (!reuse && (!e->owner || e->turn < pl->turn))
+            reuse = e;
+    }
+    if (!reuse) {
+        reuse = e;
+        ++pl->used;
+    }
+    reuse->pos = pos;
+    reuse->turn = turn;
+    reuse->owner = owner;
+    return NULL;
+}
+
+person_t* planner_owner(planner_t* pl, pos_t pos, size_t turn) {
+    planner_entry_t* e = planner_find(pl, pos, turn);
+    return e ? e->owner : NULL;
+}
+
+void planner_release(planner_t* pl, person_t* person, size_t from) {
+    for (int i = 0; i < person->plan_len; ++i) {
+        size_t turn = person->plan_time + i;
+        if (turn < from)
+            continue;
+        planner_entry_t* e = planner_find(pl, person->plan[i], turn);
+        if (e && e->owner == person)
+            e->owner = NULL;
+    }
+}
+
+person_t* planner_hold(planner_t* pl, person_t* person, size_t turn) {
+    planner_release(pl, person, turn);
+    if (!person->plan)
+        person->plan = malloc((PLANNER_WINDOW+2)*sizeof(pos_t));
+    person->plan[0] = person->plan[1] = person->current_pos;
+    person->plan_time = turn-1;
+    person->plan_len = 2;
+    person_t* prev = planner_set(pl, person->current_pos, turn, person);
+    return prev == person ? NULL : prev;
+}
+
+/* --- --- --- --- A* espaço-tempo  --- --- --- --- */
+
+/**
+ * Estado (dt, start + (dx, dy)) da busca: dt turnos após o passo reservado,
+ * com |dx|, |dy| <= dt.
+ */
+static inline int planner_state(int dt, int dx, int dy) {
+    return (dt*PLANNER_SPAN + dy+PLANNER_WINDOW)*PLANNER_SPAN
+           + dx+PLANNER_WINDOW;
+}
+
+static inline int planner_state_dt(int s) {
+    return s / (PLANNER_SPAN*PLANNER_SPAN);
+}
+
+static inline pos_t planner_state_pos(int s, pos_t start) {
+    int cell = s % (PLANNER_SPAN*PLANNER_SPAN);
+    return mk_pos(start.x + cell % PLANNER_SPAN - PLANNER_WINDOW,
+                  start.y + cell / PLANNER_SPAN - PLANNER_WINDOW);
+}
+
+/**
+ * Heurística do A*: passos até o objetivo pelo campo f, ou, sem campo, na
+ * 8-vizinhança sem obstáculos. Negativa se pos não alcança o objetivo.
+ */
+static inline int planner_h(grid_t* grid, grid_field_t* f, pos_t pos,
+                            pos_t goal) {
+    if (f)
+        return f->dist[grid_field_index(grid, pos)];
+    int dx = abs(goal.x - pos.x), dy = abs(goal.y - pos.y);
+    return dx > dy ? dx : dy;
+}
+
+/**
+ * Para onde a heurística sem campo aponta: o objetivo ou, durante um desvio
+ * (veja person_reroute()), a célula do desvio PLANNER_WINDOW passos à
+ * frente da última visitada. Avança person->detour_next até a posição
+ * atual.
+ */
+static pos_t planner_target(person_t* person) {
+    int len = person->detour_len;
+    for (int i = person->detour_next; i < len; ++i) {
+        if (pos_equals(person->detour[i], person->current_pos)) {
+            person->detour_next = i+1;
+            break;
+        }
+    }
+    if (person->detour_next >= len)
+        return person->goal_pos;
+    int i = person->detour_next + PLANNER_WINDOW;
+    return person->detour[i < len ? i : len-1];
+}
+
+void planner_plan(planner_t* pl, grid_t* grid, person_t* person,
+                  size_t from) {
+    pos_t start = person->plan[from - person->plan_time];
+    pos_t goal = person->goal_pos;
+    planner_release(pl, person, from+1);
+
+    grid_field_t* f = person->field;
+    if (!f || !pos_equals(f->goal, goal)
+           || f->obstacles_version != grid->obstacles_version) {
+        f = person->field = grid_field_get(grid, goal);
+    }
+    if (f && f->dist[grid_field_index(grid, start)] == GRID_FIELD_UNREACHABLE)
+        f = NULL;
+    // sem campo, a heurística mira o desvio, se houver
+    pos_t target = f ? goal : planner_target(person);
+
+    if (!++pl->search) {
+        memset(pl->seen, 0, PLANNER_STATES*sizeof(uint32_t));
+        pl->search = 1;
+    }
+    for (int b = 0; b < 2*PLANNER_WINDOW + 1; ++b)
+        pl->buckets[b] = -1;
+    // Com a heurística consistente, f nunca diminui ao longo de um caminho
+    // e fica em [f0, f0 + 2*PLANNER_WINDOW]: um bucket (LIFO) por valor
+    int f0 = planner_h(grid, f, start, target);
+    int s0 = planner_state(0, 0, 0);
+    pl->seen[s0] = pl->search;
+    pl->parent[s0] = -1;
+    pl->next[s0] = -1;
+    pl->buckets[0] = s0;
+
+    int end = -1, best = -1, best_dt = -1, best_h = 0;
+    for (int b = 0; b < 2*PLANNER_WINDOW + 1; ) {
+        int s = pl->buckets[b];
+        if (s < 0) {
+            ++b;
+            continue;
+        }
+        pl->buckets[b] = pl->next[s];
+        int dt = planner_state_dt(s);
+        pos_t pos = planner_state_pos(s, start);
+        size_t t = from + dt;
+        // A reserva da célula não depende de onde se veio, então só é
+        // conferida aqui, uma vez por estado, e não a cada vizinho empilhado
+        if (dt) {
+            person_t* owner = planner_owner(pl, pos, t);
+            if (owner && owner != person)
+                continue;
+        }
+        int h = f0 + b - dt;
+        if (dt > best_dt || (dt == best_dt && h < best_h)) {
+            best = s;
+            best_dt = dt;
+            best_h = h;
+        }
+        if (pos_equals(pos, goal) || dt == PLANNER_WINDOW) {
+            end = s;
+            break;
+        }
+        // Troca de lugar com quem vem para pos no turno t+1, que no turno t
+        // está em swap
+        person_t* here_next = planner_owner(pl, pos, t+1);
+        int has_swap = here_next && here_next != person
+                       && t >= here_next->plan_time
+                       && t - here_next->plan_time < (size_t)here_next->plan_len;
+        pos_t swap = has_swap ? here_next->plan[t - here_next->plan_time]
+                              : pos;
+        // Entre estados de mesmo f, o último empilhado é o primeiro a sair:
+        // os vizinhos são empilhados do mais longe ao mais perto do
+        // objetivo em linha reta (como em grid_score_neighbors()), senão o
+        // último deslocamento de grid_neighbor_offsets sempre ganharia e o
+        // caminho se afastaria da reta. Parado vem por último entre
+        // distâncias iguais, já que não gasta um passo.
+        int cand[GRID_NEIGHBOR_COUNT+1], cand_nb[GRID_NEIGHBOR_COUNT+1];
+        int64_t cand_d2[GRID_NEIGHBOR_COUNT+1];
+        int n_cand = 0;
+        for (int i = 0; i <= GRID_NEIGHBOR_COUNT; ++i) {
+            int stay = i == GRID_NEIGHBOR_COUNT;
+            pos_t n = stay ? pos : pos_add(pos, grid_neighbor_offsets[i]);
+            int ns = planner_state(dt+1, n.x - start.x, n.y - start.y);
+            // o campo já marca obstáculos como inalcançáveis (hn < 0)
+            if (pl->seen[ns] == pl->search || !grid_isvalid(grid, n)
+                || (!stay && !f
+                    && grid_get(grid, n, NULL) == GRID_OBJ_OBSTACLE)) {
+                continue;
+            }
+            // Quem chega ao objetivo sai do grid, então pode cruzar com
+            // outra pessoa (e chegar junto com outras) como no
+            // SIM_MODE_LOCKED
+            if (!stay && has_swap && pos_equals(n, swap)
+                && !pos_equals(n, goal)) {
+                continue;
+            }
+            int hn = planner_h(grid, f, n, target);
+            if (hn < 0)
+                continue;
+            int64_t gx = target.x - n.x, gy = target.y - n.y;
+            int64_t d2 = gx*gx + gy*gy;
+            int k = n_cand++;
+            for (; k > 0 && cand_d2[k-1] < d2; --k) {
+                cand[k] = cand[k-1];
+                cand_nb[k] = cand_nb[k-1];
+                cand_d2[k] = cand_d2[k-1];
+            }
+            cand[k] = ns;
+            cand_nb[k] = dt+1 + hn - f0;
+            cand_d2[k] = d2;
+        }
+        for (int k = 0; k < n_cand; ++k) {
+            int ns = cand[k], nb = cand_nb[k];
+            pl->seen[ns] = pl->search;
+            pl->parent[ns] = s;
+            pl->next[ns] = pl->buckets[nb];
+            pl->buckets[nb] = ns;
+        }
+    }
+    if (end < 0)
+        end = best;
+
+    // o plano sempre começa na posição atual, no fim do turno anterior
+    int depth = planner_state_dt(end);
+    int off = (int)(from - (pl->turn-1));
+    for (int s = end; s >= 0; s = pl->parent[s])
+        person->plan[off + planner_state_dt(s)] = planner_state_pos(s, start);
+    person->plan[0] = person->current_pos;
+    person->plan_time = pl->turn-1;
+    person->plan_len = off+depth+1;
+    // a chegada não ocupa o objetivo: só as células de passagem são
+    // reservadas
+    for (int dt = 1; dt <= depth; ++dt) {
+        if (!pos_equals(person->plan[off+dt], goal))
+            planner_set(pl, person->plan[off+dt], from+dt, person);
+    }
+}
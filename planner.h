@@ -0,0 +1,115 @@
+#ifndef INE5410_PLANNER_H_
+#define INE5410_PLANNER_H_
+
+#include "grid.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Planejador cooperativo do modo SIM_MODE_COOPERATIVE, no estilo do A*
+ * cooperativo em janela (WHCA*).
+ *
+ * Cada pessoa reserva, numa tabela espaço-tempo (célula, turno) -> pessoa,
+ * as células por onde vai passar nos próximos PLANNER_WINDOW turnos, e quem
+ * planeja depois desvia dessas reservas: ninguém entra numa célula reservada
+ * por outra pessoa para aquele turno nem troca de lugar com ela. A busca é um
+ * A* sobre (célula, turno) com a distância do campo de grid_field_get() como
+ * heurística. O campo ignora as pessoas, então é exato enquanto ninguém
+ * atrapalha e o A* só explora os desvios.
+ *
+ * O passo do turno seguinte de cada pessoa está sempre reservado: replanejar
+ * só muda o caminho a partir dele, e a simulação nunca precisa desfazer um
+ * passo já prometido a outra pessoa (veja planner_hold()).
+ *
+ * Não é thread-safe: a simulação só planeja na passagem de turno.
+ */
+#define PLANNER_WINDOW 8
+/**
+ * Turnos entre dois replanejamentos da mesma pessoa (pessoas com ids
+ * diferentes replanejam em turnos diferentes).
+ */
+#define PLANNER_REPLAN (PLANNER_WINDOW/2)
+
+/**
+ * Lado da caixa de busca em volta do ponto de partida e número de estados
+ * (célula, turno) que o A* pode visitar.
+ */
+#define PLANNER_SPAN   (2*PLANNER_WINDOW + 1)
+#define PLANNER_STATES ((PLANNER_WINDOW+1)*PLANNER_SPAN*PLANNER_SPAN)
+
+
+typedef struct planner_entry_s {
+    pos_t pos;
+    size_t turn;     ///< 0 se a entrada nunca foi usada
+    person_t* owner; ///< NULL se a reserva foi liberada
+} planner_entry_t;
+
+typedef struct planner_s {
+    /**
+     * Tabela hash de reservas, com endereçamento aberto. Reservas de turnos
+     * anteriores a turn estão vencidas e são descartadas quando a tabela
+     * cresce.
+     */
+    planner_entry_t* entries;
+    size_t cap, used; ///< used conta as entradas com turn != 0
+    size_t turn;
+    /**
+     * Estado do A*: seen[s] == search se o estado s já foi alcançado nesta
+     * busca, parent[s] é o estado anterior e next[s] o seguinte na lista do
+     * bucket de s (um bucket por valor de f).
+     */
+    uint32_t search;
+    uint32_t* seen;
+    int32_t* parent;
+    int32_t* next;
+    int32_t buckets[2*PLANNER_WINDOW + 1];
+} planner_t;
+
+void planner_init(planner_t* pl);
+void planner_destroy(planner_t* pl);
+
+/**
+ * Começa o turno turn: as reservas de turnos anteriores deixam de valer.
+ */
+void planner_begin(planner_t* pl, size_t turn);
+
+/**
+ * Retorna a pessoa que reservou pos para o turno turn, ou NULL.
+ */
+person_t* planner_owner(planner_t* pl, pos_t pos, size_t turn);
+
+/**
+ * Libera as reservas de person (as do caminho person->plan) dos turnos a
+ * partir de from.
+ */
+void planner_release(planner_t* pl, person_t* person, size_t from);
+
+/**
+ * Faz person ficar parada no turno turn: libera as reservas dela a partir de
+ * turn, troca person->plan por "fica onde está" e reserva a posição atual no
+ * turno turn, tomando a reserva de quem a tinha. Retorna essa pessoa (ou
+ * NULL), que pretendia entrar na célula de person e também precisa parar.
+ */
+person_t* planner_hold(planner_t* pl, person_t* person, size_t turn);
+
+/**
+ * Replaneja person a partir do passo já reservado para o turno from: libera
+ * as reservas dos turnos seguintes, busca o melhor caminho de até
+ * PLANNER_WINDOW turnos que respeita as reservas das demais pessoas e o
+ * reserva. Se nenhum caminho sai da janela nem chega ao objetivo, fica com o
+ * que vai mais longe no tempo.
+ *
+ * Normalmente from é o turno atual (o de planner_begin()). Quem acabou de
+ * parar com planner_hold() pode replanejar desde o turno anterior, isto é,
+ * desde a posição atual, e já sair do lugar no turno atual: a reserva que
+ * planner_hold() tomou garante que ficar parado continua possível.
+ *
+ * Precondições:
+ * - from é o turno atual, ou o anterior se person parou neste turno
+ *   [UNDEFINED BEHAVIOR se violada]
+ * - person->plan tem o passo do turno from, e ele não é o objetivo
+ *   [UNDEFINED BEHAVIOR se violada]
+ */
+void planner_plan(planner_t* pl, grid_t* grid, person_t* person, size_t from);
+
+#endif /*INE5410_PLANNER_H_*/
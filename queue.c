@@ -1,79 +1,201 @@
 #include "queue.h"
+#include "lockprof.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <assert.h>
 
+// Tentativas sem dormir antes de estacionar a thread em queue_wait() e
+// queue_push_back()
+#define QUEUE_SPIN 64
+
 void queue_init(queue_t* q, size_t capacity) {
     memset(q, 0, sizeof(queue_t));
+    assert(capacity > 0);
     q->capacity = capacity;
-    q->buf = calloc(capacity, sizeof(void*));
+    q->buf = calloc(capacity, sizeof(queue_slot_t));
+    for (size_t i = 0; i < capacity; ++i)
+        atomic_init(&q->buf[i].seq, i);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->consumers_waiting, 0);
+    atomic_init(&q->producers_waiting, 0);
     int err;
-    err = pthread_mutex_init(&q->mtx, NULL); assert(!err);
-    err = sem_init(&q->full, 0, 0);          assert(!err);
-    err = sem_init(&q->empty, 0, capacity);  assert(!err);
+    err = pthread_mutex_init(&q->mtx, NULL);      assert(!err);
+    err = pthread_cond_init(&q->not_empty, NULL); assert(!err);
+    err = pthread_cond_init(&q->not_full, NULL);  assert(!err);
 }
 
 void queue_destroy(queue_t* q) {
     assert(q->buf);
-    pthread_mutex_lock(&q->mtx);
     free(q->buf);
     q->buf = 0;
-    q->size = 0;
-    q->begin = q->end = 0;
-    pthread_mutex_unlock(&q->mtx);
-    sem_destroy(&q->empty);
-    sem_destroy(&q->full);
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
     pthread_mutex_destroy(&q->mtx);
 }
 
+static int queue_try_push(queue_t* q, void* val) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    queue_slot_t* slot;
+    while (1) {
+        slot = q->buf + pos % q->capacity;
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos+1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0; // cheio: o consumidor da volta anterior não terminou
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+    slot->val = val;
+    atomic_store_explicit(&slot->seq, pos+1, memory_order_release);
+    return 1;
+}
+
+static int queue_try_pop(queue_t* q, void** out) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    queue_slot_t* slot;
+    while (1) {
+        slot = q->buf + pos % q->capacity;
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos+1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0; // vazio
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+    *out = slot->val;
+    atomic_store_explicit(&slot->seq, pos + q->capacity, memory_order_release);
+    return 1;
+}
+
+/**
+ * Reserva até n posições publicadas e contíguas a partir de head.
+ */
+static size_t queue_claim_head(queue_t* q, size_t n, size_t* first) {
+    size_t cap = q->capacity;
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (1) {
+        size_t k = 0, seq = 0;
+        while (k < n && k < cap) {
+            seq = atomic_load_explicit(&q->buf[(pos+k) % cap].seq,
+                                       memory_order_acquire);
+            if (seq != pos+k+1)
+                break;
+            ++k;
+        }
+        if (k > 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos+k,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                *first = pos;
+                return k;
+            }
+        } else if ((intptr_t)seq - (intptr_t)(pos+1) < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Acorda uma (ou todas, se all != 0) thread estacionada em cond, se houver
+ * alguma.
+ *
+ * O fence seq_cst casa com o das threads que estacionam: ou a thread
+ * estacionando vê a alteração no ring, ou quem alterou o ring vê
+ * *waiting > 0. Como o estacionamento acontece com mtx travado, o signal não
+ * se perde.
+ */
+static void queue_wake(queue_t* q, atomic_int* waiting, pthread_cond_t* cond,
+                       int all) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) > 0) {
+        LOCKPROF_SITE(site, "queue_t.mtx (wake)");
+        uint64_t prof = lockprof_lock(&site, &q->mtx);
+        if (all)
+            pthread_cond_broadcast(cond);
+        else
+            pthread_cond_signal(cond);
+        lockprof_unlock(&site, &q->mtx, prof);
+    }
+}
+
 void queue_push_back(queue_t* q, void* val) {
     assert(q->buf);
-
-    sem_wait(&q->empty);
-    pthread_mutex_lock(&q->mtx);
-    q->buf[q->end] = val;
-//    printf("buf[%d] <- %p  (%ld)\n", q->end, val, pthread_self());
-    q->end = (q->end + 1) % q->capacity;
-    ++q->size;
-    sem_post(&q->full);
-    pthread_mutex_unlock(&q->mtx);
+    int ok = 0;
+    for (int i = 0; !ok && i < QUEUE_SPIN; ++i)
+        ok = queue_try_push(q, val);
+    if (!ok) {
+        LOCKPROF_SITE(site, "queue_t.mtx (full)");
+        uint64_t prof = lockprof_lock(&site, &q->mtx);
+        atomic_fetch_add(&q->producers_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!queue_try_push(q, val))
+            lockprof_cond_wait(&site, &q->not_full, &q->mtx, &prof);
+        atomic_fetch_sub(&q->producers_waiting, 1);
+        lockprof_unlock(&site, &q->mtx, prof);
+    }
+    queue_wake(q, &q->consumers_waiting, &q->not_empty, 0);
 }
 
 int  queue_pop(queue_t* q, void** out) {
     assert(out);
     assert(q->buf);
-    if (sem_trywait(&q->full) != 0)
+    if (!queue_try_pop(q, out))
         return 0;
-
-    pthread_mutex_lock(&q->mtx);
-    assert(q->size);
-    *out = q->buf[q->begin];
-    q->begin = (q->begin + 1) % q->capacity;
-    --q->size;    
-    sem_post(&q->empty);
-    pthread_mutex_unlock(&q->mtx);
+    queue_wake(q, &q->producers_waiting, &q->not_full, 0);
     return 1;
 }
 
 void* queue_wait(queue_t* q) {
     assert(q->buf);
-    sem_wait(&q->full);
-    pthread_mutex_lock(&q->mtx);
-    assert(q->size);
-    void* front = q->buf[q->begin];
-//    printf("buf[%d] -> %p  (%ld)\n", q->end, front, pthread_self());
-    q->begin = (q->begin + 1) % q->capacity;
-    --q->size;    
-    sem_post(&q->empty);
-    pthread_mutex_unlock(&q->mtx);
-
+    void* front;
+    int ok = 0;
+    for (int i = 0; !ok && i < QUEUE_SPIN; ++i)
+        ok = queue_try_pop(q, &front);
+    if (!ok) {
+        LOCKPROF_SITE(site, "queue_t.mtx (empty)");
+        uint64_t prof = lockprof_lock(&site, &q->mtx);
+        atomic_fetch_add(&q->consumers_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!queue_try_pop(q, &front))
+            lockprof_cond_wait(&site, &q->not_empty, &q->mtx, &prof);
+        atomic_fetch_sub(&q->consumers_waiting, 1);
+        lockprof_unlock(&site, &q->mtx, prof);
+    }
+    queue_wake(q, &q->producers_waiting, &q->not_full, 0);
     return front;
 }
 
+size_t queue_pop_many(queue_t* q, void** out, size_t max) {
+    assert(out);
+    assert(q->buf);
+    size_t pos, k = queue_claim_head(q, max, &pos);
+    for (size_t i = 0; i < k; ++i) {
+        queue_slot_t* slot = q->buf + (pos+i) % q->capacity;
+        out[i] = slot->val;
+        atomic_store_explicit(&slot->seq, pos+i+q->capacity,
+                              memory_order_release);
+    }
+    if (k)
+        queue_wake(q, &q->producers_waiting, &q->not_full, k > 1);
+    return k;
+}
+
 int queue_empty(queue_t* q) {
-    pthread_mutex_lock(&q->mtx);
-    int empty = q->size == 0;
-    pthread_mutex_unlock(&q->mtx);
-    return empty;
+    return atomic_load(&q->head) == atomic_load(&q->tail);
 }
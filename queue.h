@@ -2,22 +2,55 @@
 #define __QUEUE_H__
 
 #include <pthread.h>
-#include <semaphore.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
+#define QUEUE_CACHE_LINE 64
+
+/**
+ * Posição do ring. seq indica o estado da posição: seq == pos significa que
+ * a posição está livre para o produtor da volta pos; seq == pos+1 significa
+ * que o valor da volta pos já foi publicado e pode ser consumido.
+ */
+typedef struct queue_slot_s {
+    atomic_size_t seq;
+    void* val;
+} queue_slot_t;
+
+/**
+ * Fila limitada MPMC sem locks (ring com números de sequência por posição).
+ * head e tail são contadores que só crescem; a posição no ring é
+ * contador % capacity. Ficam em linhas de cache separadas para que
+ * produtores e consumidores não disputem a mesma linha.
+ *
+ * O mutex e as variáveis de condição só são usados para dormir quando o ring
+ * está realmente vazio (queue_wait()) ou cheio (queue_push_back()).
+ */
 typedef struct {
     int capacity;
-    int size;
-    int begin, end;
-    void** buf;
+    queue_slot_t* buf;
+    char pad0[QUEUE_CACHE_LINE];
+    atomic_size_t head; ///< próxima posição a consumir
+    char pad1[QUEUE_CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_size_t tail; ///< próxima posição a produzir
+    char pad2[QUEUE_CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_int consumers_waiting, producers_waiting;
     pthread_mutex_t mtx;
-    sem_t full, empty;
+    pthread_cond_t not_empty, not_full;
 } queue_t;
 
 extern void  queue_init(queue_t* q, size_t capacity);
 extern void  queue_destroy(queue_t* q);
 extern void  queue_push_back(queue_t* q, void* val);
-extern  int  queue_pop(queue_t* q, void** out); 
+extern  int  queue_pop(queue_t* q, void** out);
 extern void* queue_wait(queue_t* q);
 extern  int  queue_empty(queue_t* q);
 
+/**
+ * Remove até max valores (os mais antigos) para out, sem bloquear, com um
+ * único CAS. Retorna quantos valores foram removidos (0 se a fila estava
+ * vazia).
+ */
+extern size_t queue_pop_many(queue_t* q, void** out, size_t max);
+
 #endif /*__QUEUE_H__*/
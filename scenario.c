@@ -0,0 +1,179 @@
+#include "scenario.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/**
+ * Deslocamento dos registros de pessoas: depois dos comprimentos, alinhado a
+ * 8 bytes.
+ */
+static size_t scenario_persons_offset(uint64_t n_runs) {
+    size_t off = sizeof(scenario_header_t) + n_runs*sizeof(uint32_t);
+    return (off + 7) & ~(size_t)7;
+}
+
+int scenario_is_binary(const void* data, size_t size) {
+    uint32_t magic;
+    if (size < sizeof(magic))
+        return 0;
+    memcpy(&magic, data, sizeof(magic));
+    return magic == SCENARIO_MAGIC;
+}
+
+int scenario_view(scenario_t* s, void* data, size_t size) {
+    memset(s, 0, sizeof(scenario_t));
+    if (size < sizeof(scenario_header_t) || !scenario_is_binary(data, size))
+        return EINVAL;
+    scenario_header_t* h = (scenario_header_t*)data;
+    if (h->version != SCENARIO_VERSION || h->width <= 0 || h->height <= 0
+        || h->n_runs > (size - sizeof(scenario_header_t))/sizeof(uint32_t)) {
+        return EINVAL;
+    }
+    size_t off = scenario_persons_offset(h->n_runs);
+    uint64_t n = (uint64_t)h->n_persons + h->n_insertions;
+    if (off > size || n > (size - off)/sizeof(scenario_person_t))
+        return EINVAL;
+    // Os comprimentos devem cobrir exatamente o grid
+    uint64_t cells = 0;
+    uint32_t* runs = (uint32_t*)(h+1);
+    for (uint64_t i = 0; i < h->n_runs; ++i)
+        cells += runs[i];
+    if (cells != (uint64_t)h->width*h->height)
+        return EINVAL;
+
+    s->data = data;
+    s->size = size;
+    s->header = h;
+    s->runs = runs;
+    s->persons = (scenario_person_t*)((char*)data + off);
+    s->insertions = s->persons + h->n_persons;
+    return 0;
+}
+
+/**
+ * Percorre o grid em ordem de linhas e escreve os comprimentos em runs (ou
+ * só conta, se runs == NULL). Retorna quantos comprimentos foram gerados.
+ */
+static uint64_t scenario_encode_runs(grid_t* grid, uint32_t* runs) {
+    uint64_t n = 0;
+    uint32_t run = 0;
+    int obstacle = 0; // tipo do comprimento corrente
+    pos_t p;
+    for (p.y = 0; p.y < grid->height; ++p.y) {
+        for (p.x = 0; p.x < grid->width; ++p.x) {
+            // O trecho da linha num bloco, se todo do tipo corrente, só
+            // estende o comprimento
+            int len = grid->width - p.x < GRID_CHUNK_SIZE ? grid->width - p.x
+                                                          : GRID_CHUNK_SIZE;
+            if (!(p.x % GRID_CHUNK_SIZE) && run <= UINT32_MAX - (uint32_t)len
+                && grid_count_rect(grid, p, mk_pos(p.x+len, p.y+1),
+                                   GRID_OBJ_OBSTACLE)
+                   == (obstacle ? (size_t)len : 0)) {
+                run += len;
+                p.x += len-1;
+                continue;
+            }
+            int here = grid_get(grid, p, NULL) == GRID_OBJ_OBSTACLE;
+            if (here != obstacle || run == UINT32_MAX) {
+                // no limite de uint32_t, um comprimento 0 do outro tipo
+                // continua a sequência
+                if (runs)
+                    runs[n] = run;
+                ++n;
+                run = 0;
+                if (here != obstacle) {
+                    obstacle = here;
+                } else {
+                    if (runs)
+                        runs[n] = 0;
+                    ++n;
+                }
+            }
+            ++run;
+        }
+    }
+    if (runs)
+        runs[n] = run;
+    return n+1;
+}
+
+void scenario_create(scenario_t* s, grid_t* grid, size_t time,
+                     uint32_t n_persons, uint32_t n_insertions,
+                     int insertion_interval) {
+    uint64_t n_runs = scenario_encode_runs(grid, NULL);
+    size_t off = scenario_persons_offset(n_runs);
+    size_t size = off + ((size_t)n_persons + n_insertions)*sizeof(scenario_person_t);
+    void* data = calloc(1, size);
+    scenario_header_t* h = (scenario_header_t*)data;
+    h->magic = SCENARIO_MAGIC;
+    h->version = SCENARIO_VERSION;
+    h->width = grid->width;
+    h->height = grid->height;
+    h->time = time;
+    h->n_runs = n_runs;
+    h->n_persons = n_persons;
+    h->n_insertions = n_insertions;
+    h->insertion_interval = insertion_interval;
+    scenario_encode_runs(grid, (uint32_t*)(h+1));
+
+    int err = scenario_view(s, data, size); assert(!err);
+    s->own = SCENARIO_OWN_MALLOC;
+}
+
+int scenario_save(const scenario_t* s, const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return errno;
+    int err = fwrite(s->data, 1, s->size, f) == s->size ? 0 : errno;
+    if (fclose(f) && !err)
+        err = errno;
+    return err;
+}
+
+void scenario_close(scenario_t* s) {
+    if (s->own == SCENARIO_OWN_MALLOC)
+        free(s->data);
+    memset(s, 0, sizeof(scenario_t));
+}
+
+/**
+ * Coloca obstáculos nas células [cell, end) (em ordem de linhas): o resto da
+ * primeira linha, as linhas inteiras e o começo da última, um retângulo cada.
+ */
+static void scenario_fill_run(grid_t* grid, uint64_t cell, uint64_t end) {
+    int w = grid->width;
+    pos_t from = {cell % w, cell / w}, to = {end % w, end / w};
+    if (from.y == to.y) {
+        grid_fill_rect(grid, from, mk_pos(to.x, to.y+1), GRID_OBJ_OBSTACLE);
+        return;
+    }
+    if (from.x) {
+        grid_fill_rect(grid, from, mk_pos(w, from.y+1), GRID_OBJ_OBSTACLE);
+        from = mk_pos(0, from.y+1);
+    }
+    grid_fill_rect(grid, from, mk_pos(w, to.y), GRID_OBJ_OBSTACLE);
+    grid_fill_rect(grid, mk_pos(0, to.y), mk_pos(to.x, to.y+1),
+                   GRID_OBJ_OBSTACLE);
+}
+
+void scenario_load_obstacles(const scenario_t* s, grid_t* grid) {
+    uint64_t cell = 0;
+    for (uint64_t i = 0; i < s->header->n_runs; ++i) {
+        uint64_t end = cell + s->runs[i];
+        if (i % 2 && end > cell)
+            scenario_fill_run(grid, cell, end);
+        cell = end;
+    }
+}
+
+void scenario_pack(scenario_person_t* rec, const person_t* person) {
+    rec->time = person->time;
+    rec->id = person->id;
+    rec->x = person->current_pos.x;
+    rec->y = person->current_pos.y;
+    rec->goal_x = person->goal_pos.x;
+    rec->goal_y = person->goal_pos.y;
+    rec->reserved = 0;
+}
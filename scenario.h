@@ -0,0 +1,104 @@
+#ifndef INE5410_SCENARIO_H_
+#define INE5410_SCENARIO_H_
+
+#include "grid.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Formato binário de cenários e checkpoints. O arquivo é, em ordem:
+ *
+ * - scenario_header_t;
+ * - header.n_runs comprimentos (uint32_t) da camada de obstáculos, em ordem
+ *   de linhas (y, depois x), alternando células livres e obstáculos e
+ *   começando pelas livres (o primeiro comprimento pode ser 0);
+ * - preenchimento até múltiplo de 8 bytes;
+ * - header.n_persons registros scenario_person_t das pessoas plugadas;
+ * - header.n_insertions registros das pessoas do bloco insertions.
+ *
+ * Os inteiros estão na ordem de bytes da máquina que gravou o arquivo: um
+ * magic trocado é tratado como formato inválido.
+ */
+#define SCENARIO_MAGIC   0x314e4353u ///< "SCN1" em little-endian
+#define SCENARIO_VERSION 1
+
+typedef struct scenario_header_s {
+    uint32_t magic, version;
+    int32_t width, height;
+    uint64_t time;   ///< turno do checkpoint (0 em cenários convertidos)
+    uint64_t n_runs;
+    uint32_t n_persons, n_insertions;
+    int32_t insertion_interval;
+    int32_t reserved;
+} scenario_header_t;
+
+typedef struct scenario_person_s {
+    uint64_t time;
+    int32_t id;
+    int32_t x, y;           ///< current_pos
+    int32_t goal_x, goal_y; ///< goal_pos
+    int32_t reserved;
+} scenario_person_t;
+
+#define SCENARIO_OWN_NONE   0 ///< dados de quem chamou scenario_view()
+#define SCENARIO_OWN_MALLOC 1 ///< criado por scenario_create()
+
+/**
+ * Visão de um cenário binário: os ponteiros apontam diretamente para os
+ * dados do arquivo (nada é copiado ao abrir).
+ */
+typedef struct scenario_s {
+    void* data;
+    size_t size;
+    int own; ///< SCENARIO_OWN_*
+    scenario_header_t* header;
+    uint32_t* runs;
+    scenario_person_t* persons;
+    scenario_person_t* insertions;
+} scenario_t;
+
+/**
+ * Retorna 1 se [data, data+size) começa com SCENARIO_MAGIC.
+ */
+int scenario_is_binary(const void* data, size_t size);
+
+/**
+ * Monta s sobre os size bytes de data, que continuam pertencendo a quem
+ * chama. Retorna 0 ou EINVAL se o conteúdo não é um cenário válido desta
+ * versão.
+ */
+int scenario_view(scenario_t* s, void* data, size_t size);
+
+/**
+ * Cria em memória um cenário com os obstáculos de grid e espaço para
+ * n_persons pessoas e n_insertions inserções, que quem chama preenche com
+ * scenario_pack().
+ */
+void scenario_create(scenario_t* s, grid_t* grid, size_t time,
+                     uint32_t n_persons, uint32_t n_insertions,
+                     int insertion_interval);
+
+/**
+ * Grava em path os bytes do cenário. Retorna 0 ou o errno da falha.
+ */
+int scenario_save(const scenario_t* s, const char* path);
+
+/**
+ * Libera o que scenario_create() alocou.
+ */
+void scenario_close(scenario_t* s);
+
+/**
+ * Coloca no grid os obstáculos do cenário.
+ *
+ * Precondições:
+ * - grid tem as dimensões de s->header [UNDEFINED BEHAVIOR se violada]
+ */
+void scenario_load_obstacles(const scenario_t* s, grid_t* grid);
+
+/**
+ * Copia person para o registro rec.
+ */
+void scenario_pack(scenario_person_t* rec, const person_t* person);
+
+#endif /*INE5410_SCENARIO_H_*/
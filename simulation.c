@@ -1,34 +1,1666 @@
 #include "simulation.h"
+#include "futex.h"
+#include "lockprof.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <stdarg.h>
+#include <unistd.h>
 
+/* --- --- --- --- sim_barrier_t  --- --- --- --- */
+
+static void sim_barrier_init(sim_barrier_t* b, int count) {
+    int err;
+    err = pthread_mutex_init(&b->mtx, NULL); assert(!err);
+    err = pthread_cond_init(&b->cond, NULL); assert(!err);
+    b->count = count;
+    b->waiting = 0;
+    b->generation = 0;
+}
+
+static void sim_barrier_destroy(sim_barrier_t* b) {
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->mtx);
+}
+
+static void sim_barrier_wait(sim_barrier_t* b) {
+    LOCKPROF_SITE(site, "sim_barrier_t.mtx");
+    uint64_t prof = lockprof_lock(&site, &b->mtx);
+    unsigned gen = b->generation;
+    if (++b->waiting == b->count) {
+        b->waiting = 0;
+        ++b->generation;
+        pthread_cond_broadcast(&b->cond);
+    } else {
+        while (gen == b->generation)
+            lockprof_cond_wait(&site, &b->cond, &b->mtx, &prof);
+    }
+    lockprof_unlock(&site, &b->mtx, prof);
+}
+
+/* --- --- --- --- sim_band_t  --- --- --- --- */
+
+static void sim_band_init(sim_band_t* b, int y0, int y1, int width) {
+    b->y0 = y0;
+    b->y1 = y1;
+    b->persons_size = 0;
+    b->persons = malloc((b->persons_cap = 64)*sizeof(person_t*));
+    // Por turno, no máximo uma linha inteira entra por cada fronteira
+    queue_init(&b->handoff, 2*(size_t)width);
+}
+
+static void sim_band_destroy(sim_band_t* b) {
+    free(b->persons);
+    queue_destroy(&b->handoff);
+}
+
+static void sim_band_add(sim_band_t* b, person_t* p) {
+    if (b->persons_size == b->persons_cap) {
+        b->persons_cap *= 2;
+        b->persons = realloc(b->persons, b->persons_cap*sizeof(person_t*));
+    }
+    b->persons[b->persons_size++] = p;
+}
+
+/**
+ * Retira p da lista da faixa (a última pessoa da lista ocupa o seu lugar).
+ */
+static void sim_band_remove(sim_band_t* b, person_t* p) {
+    for (int i = 0; i < b->persons_size; ++i) {
+        if (b->persons[i] == p) {
+            b->persons[i] = b->persons[--b->persons_size];
+            return;
+        }
+    }
+}
+
+/**
+ * Retorna 1 se a vizinhança de pos (e de qualquer célula para onde a pessoa
+ * em pos possa ir) fica a mais de uma linha de distância de outras faixas.
+ */
+static int sim_band_interior(sim_band_t* b, pos_t pos, int height) {
+    return (b->y0 == 0 || pos.y >= b->y0+2)
+        && (b->y1 == height || pos.y < b->y1-2);
+}
+
+/* --- --- --- --- sim_list_t  --- --- --- --- */
+
+static void sim_list_init(sim_list_t* l) {
+    l->size = 0;
+    l->items = malloc((l->cap = 16)*sizeof(person_t*));
+}
+
+static void sim_list_push(sim_list_t* l, person_t* p) {
+    if (l->size == l->cap) {
+        l->cap *= 2;
+        l->items = realloc(l->items, l->cap*sizeof(person_t*));
+    }
+    l->items[l->size++] = p;
+}
+
+/* --- --- --- --- sim_batch_t  --- --- --- --- */
+
+void sim_batch_init(sim_batch_t* b, sim_batch_fn on_done, void* ctx) {
+    memset(&b->link, 0, sizeof(sim_request_t));
+    b->link.op = SIM_REQ_BATCH;
+    b->size = 0;
+    b->items = malloc((b->cap = 16)*sizeof(sim_request_t));
+    b->on_done = on_done;
+    b->ctx = ctx;
+    atomic_init(&b->state, SIM_BATCH_IDLE);
+    b->done_next = NULL;
+}
+
+void sim_batch_destroy(sim_batch_t* b) {
+    assert(atomic_load(&b->state) == SIM_BATCH_IDLE);
+    free(b->items);
+    b->items = NULL;
+}
+
+static void sim_batch_add(sim_batch_t* b, person_t* person, int op) {
+    if (b->size == b->cap) {
+        b->cap *= 2;
+        b->items = realloc(b->items, b->cap*sizeof(sim_request_t));
+    }
+    sim_request_t r = {person, op, 0, 0, NULL};
+    b->items[b->size++] = r;
+}
+
+void sim_batch_plug(sim_batch_t* b, person_t* person) {
+    sim_batch_add(b, person, SIM_REQ_PLUG);
+}
+
+void sim_batch_unplug(sim_batch_t* b, person_t* person) {
+    sim_batch_add(b, person, SIM_REQ_UNPLUG);
+}
+
+void sim_batch_clear(sim_batch_t* b) {
+    b->size = 0;
+}
+
+int sim_batch_pending(sim_batch_t* b) {
+    return atomic_load(&b->state) != SIM_BATCH_IDLE;
+}
+
+void sim_batch_wait(sim_batch_t* b) {
+    int s = atomic_load(&b->state);
+    while (s != SIM_BATCH_IDLE) {
+        // avisa simulation_finish_batches() que há quem acordar
+        if (s == SIM_BATCH_PENDING && !atomic_compare_exchange_weak(&b->state,
+                                                &s, SIM_BATCH_WAITING)) {
+            continue;
+        }
+        futex_wait(&b->state, SIM_BATCH_WAITING);
+        s = atomic_load(&b->state);
+    }
+}
+
+/* --- --- --- --- simulation_t  --- --- --- --- */
+
+static double simulation_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+/**
+ * Resultado de simulation_move()
+ */
+#define SIM_MOVED    0 ///< andou
+#define SIM_PARKED   1 ///< ficou no lugar e foi estacionada
+#define SIM_ARRIVED  2 ///< chegou ao objetivo e saiu do grid
+#define SIM_GONE     3 ///< já tinha sido removida por unplug
+#define SIM_PROPOSED 4 ///< simulation_propose(): o passo fica para o commit
+#define SIM_BLOCKED  5 ///< simulation_commit(): ficou no lugar
+
+/**
+ * Conta em w->turn o resultado de um passo.
+ */
+static void simulation_count(sim_worker_t* w, int result) {
+    w->turn.moves += result == SIM_MOVED || result == SIM_ARRIVED;
+    w->turn.blocked += result == SIM_PARKED || result == SIM_BLOCKED;
+    w->turn.arrived += result == SIM_ARRIVED;
+}
+
+/**
+ * Retorna a faixa que contém a linha y.
+ */
+static sim_band_t* simulation_band_of(simulation_t* sim, int y) {
+    int i = (long)y*sim->n_threads/sim->grid.height;
+    while (y < sim->bands[i].y0)
+        --i;
+    while (y >= sim->bands[i].y1)
+        ++i;
+    return sim->bands + i;
+}
+
+static void simulation_park(simulation_t* sim, person_t* p) {
+    if (!atomic_exchange_explicit(&p->parked, 1, memory_order_relaxed))
+        atomic_fetch_add_explicit(&sim->n_parked, 1, memory_order_relaxed);
+}
+
+/**
+ * Retorna 1 se p estava estacionada.
+ */
+static int simulation_unpark(simulation_t* sim, person_t* p) {
+    if (!atomic_exchange_explicit(&p->parked, 0, memory_order_relaxed))
+        return 0;
+    atomic_fetch_sub_explicit(&sim->n_parked, 1, memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * Hook de grid_set(): acorda as pessoas estacionadas em volta de pos, que
+ * acabou de ser liberada, se pos as aproxima do objetivo. Roda com os locks
+ * (ou a posse exclusiva) da vizinhança de pos, os mesmos sob os quais essas
+ * pessoas estacionaram. No modo SIM_MODE_EVENT, quem acorda vai para a pilha
+ * sim->woken e volta ao heap na passagem de turno.
+ *
+ * Nos modos SIM_MODE_DETERMINISTIC e SIM_MODE_COOPERATIVE ninguém
+ * estaciona: o turno libera células sem locks enquanto outras threads
+ * ocupam as vizinhas, e ler essas células aqui seria uma corrida.
+ */
+static void simulation_wake_neighbors(grid_t* g, pos_t pos, void* ctx) {
+    simulation_t* sim = (simulation_t*)ctx;
+    if (sim->mode == SIM_MODE_DETERMINISTIC
+        || sim->mode == SIM_MODE_COOPERATIVE
+        || !atomic_load_explicit(&sim->n_parked, memory_order_relaxed)) {
+        return;
+    }
+    unsigned persons = grid_neighbors_of_type(g, pos, GRID_OBJ_PERSON);
+    for (int i = 0; persons; ++i, persons >>= 1) {
+        person_t* q;
+        if (!(persons & 1))
+            continue;
+        grid_get(g, pos_add(pos, grid_neighbor_offsets[i]), &q);
+        if (atomic_load_explicit(&q->parked, memory_order_relaxed)
+            && person_improves(q, g, pos) && simulation_unpark(sim, q)
+            && sim->mode == SIM_MODE_EVENT) {
+            q->wake_next = atomic_load_explicit(&sim->woken,
+                                                memory_order_relaxed);
+            while (!atomic_compare_exchange_weak_explicit(&sim->woken,
+                        &q->wake_next, q,
+                        memory_order_release, memory_order_relaxed)) ;
+        }
+    }
+}
 
 void simulation_init(simulation_t* sim, int n_threads, int width, int height) {
     grid_init(&sim->grid, width, height);
+    grid_set_free_hook(&sim->grid, simulation_wake_neighbors, sim);
     sim->time = 0;
-    // ...
+    sim->n_threads = n_threads > 0 ? n_threads : 1;
+    sim->workers = NULL;
+    sim->mode = SIM_MODE_LOCKED;
+    sim->claims = NULL;
+    sim->bands = NULL;
+    memset(&sim->planner, 0, sizeof(planner_t));
+    sim_list_init(&sim->replan);
+    sim_list_init(&sim->leaving);
+    sim_list_init(&sim->routing);
+    memset(&sim->route_field, 0, sizeof(grid_field_t));
+    sim->gridlock_period = SIM_GRIDLOCK_PERIOD;
+    memset(&sim->gridlock, 0, sizeof(sim_gridlock_stats_t));
+    sim->gridlock_size = 0;
+    sim->gridlock_nodes = malloc((sim->gridlock_cap = 16)
+                                 *sizeof(sim_gridlock_node_t));
+    atomic_init(&sim->n_parked, 0);
+    heap_init(&sim->events, 64);
+    atomic_init(&sim->woken, NULL);
+    sim->started = sim->shutting_down = sim->halted = 0;
+    sim_barrier_init(&sim->barrier, sim->n_threads);
+    int err;
+    err = pthread_mutex_init(&sim->mtx, NULL);           assert(!err);
+    err = pthread_cond_init(&sim->requests_cond, NULL);  assert(!err);
+    sim->requests = NULL;
+    sim->metrics_fd = -1;
+    sim->metrics_format = SIM_METRICS_OFF;
+    sim->metrics_header = 0;
+    sim->metrics_buf = NULL;
+    sim->metrics_cap = 0;
+    sim->turn_plugs = sim->turn_unplugs = 0;
+    sim->turn_start_ms = sim->boundary_ms = 0;
+    sim->lock_report_fd = -1;
+    sim->persons_size = 0;
+    sim->persons = malloc((sim->persons_cap = 64)*sizeof(person_t*));
+    memset(&sim->stats, 0, sizeof(sim_stats_t));
 }
 
-void simulation_destroy(simulation_t* simulation) {
-    // ...
-    grid_destroy(&simulation->grid);
-    // ...
+void simulation_destroy(simulation_t* sim) {
+    if (sim->started) {
+        pthread_mutex_lock(&sim->mtx);
+        sim->shutting_down = 1;
+        pthread_cond_broadcast(&sim->requests_cond);
+        pthread_mutex_unlock(&sim->mtx);
+        for (int i = 0; i < sim->n_threads; ++i) {
+            pthread_join(sim->workers[i].thread, NULL);
+            deque_destroy(&sim->workers[i].deque);
+            free(sim->workers[i].ready.items);
+            free(sim->workers[i].finished.items);
+        }
+        free(sim->workers);
+    }
+    // Quem ainda estava plugado deixa a simulação agora
+    for (int i = 0; i < sim->persons_size; ++i) {
+        sim->persons[i]->plugged = 0;
+        person_leave(sim->persons[i]);
+    }
+    free(sim->persons);
+    if (sim->claims) {
+        size_t n = (size_t)sim->grid.chunks_x * sim->grid.chunks_y;
+        for (size_t i = 0; i < n; ++i)
+            free(atomic_load(sim->claims+i));
+        free(sim->claims);
+    }
+    free(sim->metrics_buf);
+    heap_destroy(&sim->events);
+    planner_destroy(&sim->planner);
+    free(sim->replan.items);
+    free(sim->leaving.items);
+    free(sim->routing.items);
+    free(sim->route_field.dist);
+    free(sim->gridlock_nodes);
+    if (sim->bands) {
+        for (int i = 0; i < sim->n_threads; ++i)
+            sim_band_destroy(sim->bands+i);
+        free(sim->bands);
+    }
+    pthread_cond_destroy(&sim->requests_cond);
+    pthread_mutex_destroy(&sim->mtx);
+    sim_barrier_destroy(&sim->barrier);
+    grid_destroy(&sim->grid);
+    if (sim->lock_report_fd >= 0)
+        lockprof_report(sim->lock_report_fd, SIM_LOCK_REPORT_TOP);
 }
 
 int simulation_plug_unsafe(simulation_t* sim, person_t* person) {
-    // ...
+    pos_t pos = person->current_pos;
+    if (person->plugged || !grid_isvalid(&sim->grid, pos)
+        || grid_get(&sim->grid, pos, NULL) != GRID_OBJ_EMPTY) {
+        return 0;
+    }
+    // person->time (o último turno em que a pessoa foi processada) vem de
+    // um checkpoint ou de antes de ela sair: só não pode estar no futuro
+    if (person->time > sim->time)
+        person->time = sim->time;
+    person->done = 0;
+    person->plan_len = 0;
+    person->detour_len = person->detour_next = 0;
+    person->gridlock_best = INT64_MAX;
+    person->gridlock_stall = 0;
+    simulation_unpark(sim, person);
+    if (pos_equals(pos, person->goal_pos))
+        return 1; // já chegou: person_join() continua retornando direto
+
+    person_enter(person);
+    person->plugged = 1;
+    grid_set_person(&sim->grid, pos, person);
+    if (sim->persons_size == sim->persons_cap) {
+        sim->persons_cap *= 2;
+        sim->persons = realloc(sim->persons, sim->persons_cap*sizeof(person_t*));
+    }
+    person->sim_index = sim->persons_size;
+    sim->persons[sim->persons_size++] = person;
+    if (sim->started && sim->mode == SIM_MODE_EVENT)
+        heap_push(&sim->events, sim->time+1, person);
+    return 1;
+}
+
+/**
+ * Chama person_leave() para as pessoas em sim->leaving e esvazia a lista.
+ */
+static void simulation_release(simulation_t* sim) {
+    for (int i = 0; i < sim->leaving.size; ++i)
+        person_leave(sim->leaving.items[i]);
+    sim->leaving.size = 0;
+}
+
+/**
+ * Retira p de sim->persons (a última pessoa da lista ocupa o seu lugar). Quem
+ * espera em person_join(p) é liberado por simulation_release().
+ */
+static void simulation_detach(simulation_t* sim, person_t* p) {
+    person_t* last = sim->persons[--sim->persons_size];
+    sim->persons[p->sim_index] = last;
+    last->sim_index = p->sim_index;
+    p->plugged = 0;
+    sim_list_push(&sim->leaving, p);
+}
+
+/**
+ * Remove person do grid. A remoção da lista (e o person_leave()) acontece na
+ * próxima passagem de turno (ou já, se ela estava estacionada no modo
+ * SIM_MODE_EVENT).
+ */
+static void simulation_remove(simulation_t* sim, person_t* person) {
+    if (!person->plugged || person->done)
+        return;
+    person_t* there = NULL;
+    if (grid_get(&sim->grid, person->current_pos, &there) == GRID_OBJ_PERSON
+        && there == person) {
+        grid_set(&sim->grid, person->current_pos, GRID_OBJ_EMPTY);
+    }
+    person->done = 1;
+    // no modo SIM_MODE_EVENT, quem não está estacionado sai da lista quando
+    // for retirado do heap
+    if (simulation_unpark(sim, person) && sim->started
+        && sim->mode == SIM_MODE_EVENT) {
+        simulation_detach(sim, person);
+    }
+}
+
+/**
+ * Copia o grid e as pessoas plugadas para o scenario_t em r->data.
+ */
+static void simulation_snapshot(simulation_t* sim, sim_request_t* r) {
+    uint32_t n = 0;
+    for (int i = 0; i < sim->persons_size; ++i)
+        n += !sim->persons[i]->done;
+    scenario_t* s = (scenario_t*)r->data;
+    scenario_create(s, &sim->grid, sim->time, n, 0, 0);
+    n = 0;
+    for (int i = 0; i < sim->persons_size; ++i) {
+        if (!sim->persons[i]->done)
+            scenario_pack(s->persons + n++, sim->persons[i]);
+    }
+}
+
+static void simulation_apply(simulation_t* sim, sim_request_t* r) {
+    if (r->op == SIM_REQ_PLUG) {
+        r->result = simulation_plug_unsafe(sim, r->person);
+        sim->turn_plugs += r->result;
+    } else if (r->op == SIM_REQ_UNPLUG) {
+        simulation_remove(sim, r->person);
+        ++sim->turn_unplugs;
+    } else {
+        simulation_snapshot(sim, r);
+    }
+}
+
+/**
+ * Aplica todos os pedidos pendentes, em ordem de chegada. Retorna os lotes
+ * aplicados (encadeados por done_next), que devem ser passados a
+ * simulation_finish_batches() depois que sim->mtx for destravado.
+ *
+ * Precondições:
+ * - sim->mtx está travado
+ * - nenhuma thread está movendo pessoas
+ */
+static sim_batch_t* simulation_apply_requests(simulation_t* sim) {
+    // a lista é LIFO: inverte para aplicar em ordem de chegada
+    sim_request_t* fifo = NULL;
+    while (sim->requests) {
+        sim_request_t* r = sim->requests;
+        sim->requests = r->next;
+        r->next = fifo;
+        fifo = r;
+    }
+    sim_batch_t* batches = NULL, **tail = &batches;
+    for (sim_request_t* r = fifo, *next; r; r = next) {
+        next = r->next; // r deixa de existir assim que o dono vê r->done
+        if (r->op == SIM_REQ_BATCH) {
+            sim_batch_t* b = (sim_batch_t*)r;
+            for (int i = 0; i < b->size; ++i)
+                simulation_apply(sim, b->items+i);
+            b->done_next = NULL;
+            *tail = b;
+            tail = &b->done_next;
+        } else {
+            simulation_apply(sim, r);
+            r->done = 1;
+        }
+    }
+    simulation_release(sim);
+    pthread_cond_broadcast(&sim->requests_cond);
+    return batches;
+}
+
+/**
+ * Conclui os lotes aplicados: chama on_done e libera quem espera em
+ * sim_batch_wait().
+ */
+static void simulation_finish_batches(sim_batch_t* b) {
+    for (sim_batch_t* next; b; b = next) {
+        next = b->done_next; // b pode deixar de existir após a conclusão
+        if (b->on_done)
+            b->on_done(b, b->ctx);
+        if (atomic_exchange(&b->state, SIM_BATCH_IDLE) == SIM_BATCH_WAITING)
+            futex_wake_all(&b->state);
+    }
+}
+
+static void simulation_submit(simulation_t* sim, sim_request_t* req) {
+    sim_batch_t* batches = NULL;
+    LOCKPROF_SITE(site, "simulation_t.mtx (submit)");
+    uint64_t prof = lockprof_lock(&site, &sim->mtx);
+    req->next = sim->requests;
+    sim->requests = req;
+    if (!sim->started || sim->halted) {
+        // Não há threads executando: é seguro aplicar agora
+        batches = simulation_apply_requests(sim);
+    } else {
+        pthread_cond_broadcast(&sim->requests_cond);
+        while (!req->done)
+            lockprof_cond_wait(&site, &sim->requests_cond, &sim->mtx, &prof);
+    }
+    lockprof_unlock(&site, &sim->mtx, prof);
+    simulation_finish_batches(batches);
+}
+
+void simulation_submit_batch(simulation_t* sim, sim_batch_t* batch) {
+    int idle = SIM_BATCH_IDLE;
+    if (!atomic_compare_exchange_strong(&batch->state, &idle,
+                                        SIM_BATCH_PENDING)) {
+        abort();
+    }
+    sim_batch_t* batches = NULL;
+    LOCKPROF_SITE(site, "simulation_t.mtx (submit_batch)");
+    uint64_t prof = lockprof_lock(&site, &sim->mtx);
+    batch->link.next = sim->requests;
+    sim->requests = &batch->link;
+    if (!sim->started || sim->halted)
+        batches = simulation_apply_requests(sim);
+    else
+        pthread_cond_broadcast(&sim->requests_cond);
+    lockprof_unlock(&site, &sim->mtx, prof);
+    simulation_finish_batches(batches);
+}
+
+int simulation_plug(simulation_t* sim, person_t* person) {
+    sim_request_t req = {person, SIM_REQ_PLUG, 0, 0, NULL};
+    simulation_submit(sim, &req);
+    return req.result;
+}
+
+void simulation_unplug(simulation_t* sim, person_t* person) {
+    sim_request_t req = {person, SIM_REQ_UNPLUG, 0, 0, NULL};
+    simulation_submit(sim, &req);
+}
+
+int simulation_checkpoint(simulation_t* sim, const char* path) {
+    scenario_t s;
+    sim_request_t req = {NULL, SIM_REQ_CHECKPOINT, 0, 0, NULL, &s};
+    simulation_submit(sim, &req);
+    int err = scenario_save(&s, path);
+    scenario_close(&s);
+    return err;
+}
+
+/**
+ * Acrescenta ao texto de sim->metrics_buf (com *len bytes) o resultado de
+ * fmt, aumentando o buffer se necessário.
+ */
+static void simulation_metrics_printf(simulation_t* sim, size_t* len,
+                                      const char* fmt, ...) {
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(sim->metrics_buf + *len, sim->metrics_cap - *len,
+                          fmt, ap);
+        va_end(ap);
+        if (*len + n < sim->metrics_cap) {
+            *len += n;
+            return;
+        }
+        sim->metrics_cap = 2*(*len + n + 1);
+        sim->metrics_buf = realloc(sim->metrics_buf, sim->metrics_cap);
+    }
 }
 
-int simulation_plug(simulation_t* simulation, person_t* person) {
-    // ...
+/**
+ * Escreve em sim->metrics_fd a linha do turno que terminou em end_ms, com
+ * uma única chamada a write().
+ */
+static void simulation_export_metrics(simulation_t* sim, double end_ms) {
+    int json = sim->metrics_format == SIM_METRICS_JSON;
+    size_t len = 0;
+    if (!sim->metrics_buf) {
+        sim->metrics_cap = 512 + 64*sim->n_threads;
+        sim->metrics_buf = malloc(sim->metrics_cap);
+    }
+    sim_turn_metrics_t sum = {0};
+    for (int i = 0; i < sim->n_threads; ++i) {
+        sim_turn_metrics_t* t = &sim->workers[i].turn;
+        sum.steps += t->steps;
+        sum.moves += t->moves;
+        sum.blocked += t->blocked;
+        sum.arrived += t->arrived;
+        sum.decide_ms += t->decide_ms;
+        sum.commit_ms += t->commit_ms;
+        sum.barrier_ms += t->barrier_ms;
+        sum.idle_ms += t->idle_ms;
+    }
+    if (sim->metrics_header && !json) {
+        simulation_metrics_printf(sim, &len, "turn,ms,boundary_ms,persons,"
+                "parked,plugs,unplugs,steps,moves,blocked,arrived,decide_ms,"
+                "commit_ms,barrier_ms,idle_ms");
+        for (int i = 0; i < sim->n_threads; ++i)
+            simulation_metrics_printf(sim, &len, ",w%d_busy_ms,w%d_idle_ms",
+                                      i, i);
+        simulation_metrics_printf(sim, &len, "\n");
+    }
+    sim->metrics_header = 0;
+    simulation_metrics_printf(sim, &len, json
+            ? "{\"turn\":%zu,\"ms\":%.3f,\"boundary_ms\":%.3f,"
+              "\"persons\":%d,\"parked\":%d,\"plugs\":%d,\"unplugs\":%d,"
+              "\"steps\":%zu,\"moves\":%zu,\"blocked\":%zu,"
+              "\"arrived\":%zu,\"decide_ms\":%.3f,\"commit_ms\":%.3f,"
+              "\"barrier_ms\":%.3f,\"idle_ms\":%.3f,\"workers\":["
+            : "%zu,%.3f,%.3f,%d,%d,%d,%d,%zu,%zu,%zu,%zu,%.3f,%.3f,%.3f,%.3f",
+            sim->time, end_ms - sim->turn_start_ms, sim->boundary_ms,
+            sim->persons_size, atomic_load(&sim->n_parked), sim->turn_plugs,
+            sim->turn_unplugs, sum.steps, sum.moves, sum.blocked, sum.arrived,
+            sum.decide_ms, sum.commit_ms, sum.barrier_ms, sum.idle_ms);
+    for (int i = 0; i < sim->n_threads; ++i) {
+        sim_turn_metrics_t* t = &sim->workers[i].turn;
+        simulation_metrics_printf(sim, &len, json
+                ? "%s{\"busy_ms\":%.3f,\"idle_ms\":%.3f}" : "%s%.3f,%.3f",
+                json && !i ? "" : ",", t->decide_ms + t->commit_ms,
+                t->idle_ms + t->barrier_ms);
+    }
+    simulation_metrics_printf(sim, &len, json ? "]}\n" : "\n");
+    ssize_t n = write(sim->metrics_fd, sim->metrics_buf, len);
+    (void)n; // métricas são descartáveis: erros de escrita são ignorados
 }
 
-void simulation_unplug(simulation_t* simulation, person_t* person) {
-    // ...
+/**
+ * Fecha o turno que acabou de terminar: a barreira do fim do turno libera
+ * quando a última thread termina, então a espera de cada uma é a diferença
+ * entre o seu fim e o da última. Soma os contadores do turno em
+ * sim_worker_t.stats, exporta as métricas e os zera.
+ *
+ * Precondições:
+ * - sim->mtx está travado
+ * - nenhuma thread está movendo pessoas
+ */
+static void simulation_close_turn(simulation_t* sim) {
+    double end_ms = 0;
+    for (int i = 0; i < sim->n_threads; ++i) {
+        if (sim->workers[i].turn.end_ms > end_ms)
+            end_ms = sim->workers[i].turn.end_ms;
+    }
+    for (int i = 0; i < sim->n_threads; ++i) {
+        sim_worker_t* w = sim->workers + i;
+        if (w->turn.end_ms > 0)
+            w->turn.barrier_ms += end_ms - w->turn.end_ms;
+        w->stats.steps += w->turn.steps;
+        w->stats.moves += w->turn.moves;
+        w->stats.idle_ms += w->turn.idle_ms + w->turn.barrier_ms;
+    }
+    // o primeiro turno ainda não aconteceu na primeira passagem de turno
+    if (sim->metrics_format != SIM_METRICS_OFF && sim->turn_start_ms > 0)
+        simulation_export_metrics(sim, end_ms);
+    for (int i = 0; i < sim->n_threads; ++i)
+        memset(&sim->workers[i].turn, 0, sizeof(sim_turn_metrics_t));
+    sim->turn_plugs = sim->turn_unplugs = 0;
 }
 
-void simulation_start(simulation_t* simulation) {
-    // ...
+/**
+ * Soma as estatísticas das threads em sim->stats.
+ *
+ * Precondições:
+ * - sim->mtx está travado
+ * - nenhuma thread está movendo pessoas
+ */
+static void simulation_collect_stats(simulation_t* sim) {
+    sim_stats_t* total = &sim->stats;
+    memset(total, 0, sizeof(sim_stats_t));
+    total->turns = sim->time;
+    for (int i = 0; i < sim->n_threads; ++i) {
+        sim_stats_t* s = &sim->workers[i].stats;
+        total->steps += s->steps;
+        total->moves += s->moves;
+        total->steals += s->steals;
+        total->steal_attempts += s->steal_attempts;
+        total->idle_ms += s->idle_ms;
+    }
+    total->stalls = sim->stalls;
+    total->gridlock = sim->gridlock;
 }
 
+/**
+ * SIM_MODE_EVENT: devolve ao heap as pessoas acordadas desde a última
+ * chamada.
+ */
+static void simulation_drain_woken(simulation_t* sim) {
+    person_t* p = atomic_exchange_explicit(&sim->woken, NULL,
+                                           memory_order_acquire);
+    for (; p; p = p->wake_next)
+        heap_push(&sim->events, sim->time+1, p);
+}
+
+/**
+ * SIM_MODE_EVENT: retira da simulação quem chegou ao objetivo no turno que
+ * terminou e reagenda quem continua ativo. Só toca em quem se moveu.
+ */
+static void simulation_collect_events(simulation_t* sim) {
+    for (int i = 0; i < sim->n_threads; ++i) {
+        sim_worker_t* w = sim->workers + i;
+        for (int j = 0; j < w->finished.size; ++j)
+            simulation_detach(sim, w->finished.items[j]);
+        for (int j = 0; j < w->ready.size; ++j)
+            heap_push(&sim->events, w->ready.items[j]->time+1, w->ready.items[j]);
+        w->finished.size = w->ready.size = 0;
+    }
+    simulation_drain_woken(sim);
+}
+
+/**
+ * SIM_MODE_EVENT: distribui entre os deques as pessoas agendadas para o
+ * turno sim->time.
+ */
+static void simulation_dispatch_events(simulation_t* sim) {
+    person_t* p;
+    int w = 0;
+    while (heap_pop_until(&sim->events, sim->time, (void**)&p)) {
+        if (p->done) {
+            simulation_detach(sim, p); // removida por unplug
+            continue;
+        }
+        deque_push(&sim->workers[w].deque, p);
+        w = (w+1) % sim->n_threads;
+    }
+}
+
+/**
+ * Ordem de planejamento do SIM_MODE_COOPERATIVE: id e, entre ids iguais, a
+ * posição em simulation_t.persons.
+ */
+static int simulation_plan_cmp(const void* a, const void* b) {
+    const person_t* p = *(person_t* const*)a;
+    const person_t* q = *(person_t* const*)b;
+    if (p->id != q->id)
+        return p->id < q->id ? -1 : 1;
+    return p->sim_index < q->sim_index ? -1 : p->sim_index > q->sim_index;
+}
+
+/**
+ * SIM_MODE_COOPERATIVE: garante que toda pessoa tem reservado o passo do
+ * turno sim->time, replaneja quem precisa e anota esse passo em next_pos.
+ */
+static void simulation_plan_turn(simulation_t* sim) {
+    planner_t* pl = &sim->planner;
+    size_t turn = sim->time;
+    planner_begin(pl, turn);
+    // removidas por unplug nesta passagem de turno
+    for (int i = 0; i < sim->persons_size; ++i) {
+        if (sim->persons[i]->done)
+            planner_release(pl, sim->persons[i], turn);
+    }
+    // Quem não tem o passo do turno (pessoas novas, ou quem não achou
+    // caminho) fica parado, e quem ia entrar na sua célula também
+    for (int i = 0; i < sim->persons_size; ++i) {
+        person_t* p = sim->persons[i];
+        if (!p->done && turn - p->plan_time >= (size_t)p->plan_len) {
+            while (p)
+                p = planner_hold(pl, p, turn);
+        }
+    }
+    // Replaneja quem ficaria sem o passo do próximo turno (inclusive quem
+    // acabou de parar) e, a cada PLANNER_REPLAN turnos, todo mundo
+    sim->replan.size = 0;
+    for (int i = 0; i < sim->persons_size; ++i) {
+        person_t* p = sim->persons[i];
+        if (p->done)
+            continue;
+        size_t k = turn - p->plan_time;
+        if (pos_equals(p->plan[k], p->goal_pos))
+            continue; // chega neste turno
+        if (k == (size_t)p->plan_len-1
+            || (turn + (unsigned)p->id) % PLANNER_REPLAN == 0) {
+            sim_list_push(&sim->replan, p);
+        }
+    }
+    qsort(sim->replan.items, sim->replan.size, sizeof(person_t*),
+          simulation_plan_cmp);
+    // quem parou neste turno planeja desde a posição atual e pode sair do
+    // lugar já neste turno
+    for (int i = 0; i < sim->replan.size; ++i) {
+        person_t* p = sim->replan.items[i];
+        planner_plan(pl, &sim->grid, p,
+                     p->plan_time == turn-1 ? turn-1 : turn);
+    }
+    for (int i = 0; i < sim->persons_size; ++i) {
+        person_t* p = sim->persons[i];
+        if (!p->done)
+            p->next_pos = p->plan[turn - p->plan_time];
+    }
+}
+
+/**
+ * Entrega às threads as pessoas que se movem no turno sim->time. first_new
+ * é o índice em sim->persons da primeira pessoa plugada na passagem de
+ * turno.
+ */
+static void simulation_prepare_turn(simulation_t* sim, int first_new) {
+    if (sim->mode == SIM_MODE_EVENT) {
+        simulation_drain_woken(sim); // acordadas por unplugs
+        simulation_dispatch_events(sim);
+        return;
+    }
+    if (sim->mode == SIM_MODE_COOPERATIVE) {
+        simulation_plan_turn(sim);
+        return;
+    }
+    if (sim->mode == SIM_MODE_BANDS) {
+        // as listas das faixas persistem entre turnos: só entra quem chegou
+        for (int i = first_new; i < sim->persons_size; ++i) {
+            person_t* p = sim->persons[i];
+            sim_band_add(simulation_band_of(sim, p->current_pos.y), p);
+        }
+        return;
+    }
+    // Reparte persons em fatias contíguas, empilhadas de trás para frente:
+    // cada dona percorre sua fatia em ordem e os ladrões levam o final dela.
+    // Enquanto as demais threads estão na barreira, esta pode fazer o papel
+    // de dona de todos os deques.
+    long size = sim->persons_size;
+    for (int w = 0; w < sim->n_threads; ++w) {
+        int lo = size*w/sim->n_threads, hi = size*(w+1)/sim->n_threads;
+        for (int i = hi-1; i >= lo; --i) {
+            person_t* p = sim->persons[i];
+            if (!atomic_load_explicit(&p->parked, memory_order_relaxed))
+                deque_push(&sim->workers[w].deque, p);
+        }
+    }
+}
+
+/* --- --- --- --- gridlocks  --- --- --- --- */
+
+/**
+ * Buscas seguidas sem se aproximar do objetivo até que uma pessoa no
+ * algoritmo guloso ganhe um desvio.
+ */
+#define SIM_GRIDLOCK_PATIENCE 2
+/**
+ * Buscas seguidas sem se aproximar do objetivo até que os desvios locais
+ * sejam trocados por um caminho pelo grid inteiro (veja person_route()).
+ */
+#define SIM_GRIDLOCK_ROUTE (4*SIM_GRIDLOCK_PATIENCE)
+/**
+ * Objetivos (cada um custa uma BFS pelo grid inteiro) para os quais uma
+ * busca calcula caminhos, salvo se todos estão parados. Quem fica para
+ * depois tenta de novo na busca seguinte.
+ */
+#define SIM_GRIDLOCK_ROUTES 4
+
+static sim_gridlock_node_t* simulation_gridlock_push(simulation_t* sim,
+                                                     person_t* p) {
+    if (sim->gridlock_size == sim->gridlock_cap) {
+        sim->gridlock_cap *= 2;
+        sim->gridlock_nodes = realloc(sim->gridlock_nodes,
+                sim->gridlock_cap*sizeof(sim_gridlock_node_t));
+    }
+    sim_gridlock_node_t* n = sim->gridlock_nodes + sim->gridlock_size++;
+    n->person = p;
+    n->wanted = 0;
+    n->succ = -1;
+    n->mark = 0;
+    n->next = -1;
+    p->gridlock = sim->gridlock_size;
+    return n;
+}
+
+/**
+ * Nó da pessoa em pos, ou NULL se pos não tem uma pessoa bloqueada.
+ */
+static sim_gridlock_node_t* simulation_gridlock_at(simulation_t* sim,
+                                                   pos_t pos) {
+    person_t* q;
+    if (grid_get(&sim->grid, pos, &q) != GRID_OBJ_PERSON || !q->gridlock)
+        return NULL;
+    return sim->gridlock_nodes + q->gridlock-1;
+}
+
+/**
+ * Move de uma vez todas as pessoas do ciclo que começa no nó first, cada uma
+ * para a célula da seguinte. Quem chega ao objetivo deixa a simulação como
+ * num unplug.
+ */
+static void simulation_gridlock_rotate(simulation_t* sim, int first) {
+    grid_t* g = &sim->grid;
+    sim_gridlock_node_t* nodes = sim->gridlock_nodes;
+    int i = first;
+    do {
+        nodes[i].person->next_pos = nodes[nodes[i].succ].person->current_pos;
+        i = nodes[i].succ;
+    } while (i != first);
+    do {
+        person_t* p = nodes[i].person;
+        pos_t dest = p->next_pos;
+        if (!pos_equals(dest, p->goal_pos)) {
+            // faixas: p não está em nenhuma fila de entrega, pois não se
+            // moveu no turno
+            if (sim->mode == SIM_MODE_BANDS) {
+                sim_band_t* from = simulation_band_of(sim, p->current_pos.y);
+                sim_band_t* to = simulation_band_of(sim, dest.y);
+                if (from != to) {
+                    sim_band_remove(from, p);
+                    sim_band_add(to, p);
+                }
+            }
+            grid_set_person(g, dest, p);
+        }
+        p->last_move = sim->time;
+        ++sim->gridlock.moves;
+        i = nodes[i].succ;
+    } while (i != first);
+    // as células do ciclo foram todas reocupadas, exceto a que cada chegada
+    // deixaria para trás se tivesse entrado nela
+    do {
+        person_t* p = nodes[i].person;
+        if (pos_equals(p->next_pos, p->goal_pos)) {
+            grid_set(g, p->next_pos, GRID_OBJ_EMPTY);
+            p->current_pos = p->next_pos;
+            simulation_remove(sim, p);
+        } else if (simulation_unpark(sim, p) && sim->mode == SIM_MODE_EVENT) {
+            heap_push(&sim->events, sim->time+1, p);
+        }
+        i = nodes[i].succ;
+    } while (i != first);
+}
+
+/**
+ * Ordem de simulation_t.routing: objetivo, id e, entre ids iguais, a posição
+ * em simulation_t.persons.
+ */
+static int simulation_route_cmp(const void* a, const void* b) {
+    const person_t* p = *(person_t* const*)a;
+    const person_t* q = *(person_t* const*)b;
+    if (p->goal_pos.y != q->goal_pos.y)
+        return p->goal_pos.y < q->goal_pos.y ? -1 : 1;
+    if (p->goal_pos.x != q->goal_pos.x)
+        return p->goal_pos.x < q->goal_pos.x ? -1 : 1;
+    if (p->id != q->id)
+        return p->id < q->id ? -1 : 1;
+    return p->sim_index < q->sim_index ? -1 : p->sim_index > q->sim_index;
+}
+
+/**
+ * Dá a cada pessoa de sim->routing um caminho pelo grid inteiro, com uma
+ * única BFS por objetivo, até SIM_GRIDLOCK_ROUTES objetivos (ou todos, se
+ * idle). Quem não alcança o objetivo sai da simulação. Esvazia a lista.
+ */
+static void simulation_route_stalled(simulation_t* sim, int idle) {
+    grid_t* g = &sim->grid;
+    sim_list_t* l = &sim->routing;
+    qsort(l->items, l->size, sizeof(person_t*), simulation_route_cmp);
+    int goals = 0, too_big = 0;
+    for (int i = 0; i < l->size; ++i) {
+        person_t* p = l->items[i];
+        if (!i || !pos_equals(p->goal_pos, l->items[i-1]->goal_pos)) {
+            if (++goals > SIM_GRIDLOCK_ROUTES && !idle)
+                break;
+            too_big = grid_field_fill(g, &sim->route_field, p->goal_pos);
+        }
+        // com o caminho, ou sem como calculá-lo, a contagem recomeça
+        p->gridlock_stall = 0;
+        if (too_big)
+            continue;
+        if (!person_route(p, g, &sim->route_field)) {
+            simulation_remove(sim, p);
+            ++sim->gridlock.stranded;
+            continue;
+        }
+        ++sim->gridlock.reroutes;
+        if (simulation_unpark(sim, p) && sim->mode == SIM_MODE_EVENT)
+            heap_push(&sim->events, sim->time+1, p);
+    }
+    l->size = 0;
+}
+
+/**
+ * Procura gridlocks (veja simulation_set_gridlock()) e os desfaz.
+ *
+ * Precondições:
+ * - nenhuma thread está movendo pessoas
+ */
+static void simulation_resolve_gridlocks(simulation_t* sim) {
+    int event = sim->mode == SIM_MODE_EVENT;
+    int idle = event ? heap_empty(&sim->events)
+                     : atomic_load(&sim->n_parked) == sim->persons_size;
+    if (!sim->gridlock_period || !sim->persons_size
+        || (sim->time % sim->gridlock_period && !idle)) {
+        return;
+    }
+    ++sim->gridlock.checks;
+    grid_t* g = &sim->grid;
+
+    // Quem não alcança o objetivo, ou está cercado por obstáculos, nunca
+    // sai do lugar. De trás para frente: simulation_remove() pode tirar a
+    // pessoa da lista no modo SIM_MODE_EVENT
+    for (int i = sim->persons_size-1; i >= 0; --i) {
+        person_t* p = sim->persons[i];
+        if (p->done)
+            continue;
+        // com campo, estar cercada já é ser inalcançável
+        if (!person_reachable(p, g)
+            || (!p->field
+                && !grid_neighbors_of_type(g, p->current_pos, GRID_OBJ_EMPTY)
+                && !grid_neighbors_of_type(g, p->current_pos, GRID_OBJ_PERSON))) {
+            simulation_remove(sim, p);
+            ++sim->gridlock.stranded;
+        }
+    }
+    // Com campo, a pessoa só anda para células mais próximas do objetivo.
+    // Sem ele, o algoritmo guloso (ou o planner, que também mira direto no
+    // objetivo) pode oscilar para sempre num beco: quem não se aproxima do
+    // objetivo por SIM_GRIDLOCK_PATIENCE buscas seguidas (ou já na primeira,
+    // se todos estão parados e a próxima busca só viria com algum pedido)
+    // ganha um desvio. Se não há desvio local, ou eles não a aproximam por
+    // SIM_GRIDLOCK_ROUTE buscas, segue um caminho pelo grid inteiro, ou sai
+    // se não há caminho
+    for (int i = sim->persons_size-1; i >= 0; --i) {
+        person_t* p = sim->persons[i];
+        if (p->done || p->field)
+            continue;
+        int64_t dx = p->goal_pos.x - p->current_pos.x,
+                dy = p->goal_pos.y - p->current_pos.y;
+        if (dx*dx + dy*dy < p->gridlock_best) {
+            p->gridlock_best = dx*dx + dy*dy;
+            p->gridlock_stall = 0;
+        } else if (p->detour_next < p->detour_len
+                   && p->last_move + sim->gridlock_period > sim->time) {
+            continue; // ainda seguindo o desvio
+        } else if (++p->gridlock_stall >= SIM_GRIDLOCK_PATIENCE || idle) {
+            // desvios locais que nunca a aproximam também não adiantam
+            if (p->gridlock_stall >= SIM_GRIDLOCK_ROUTE || idle
+                || !person_reroute(p, g, p->gridlock_best)) {
+                // até ganhar o caminho, as próximas buscas vão direto a ele
+                p->gridlock_stall = SIM_GRIDLOCK_ROUTE;
+                sim_list_push(&sim->routing, p);
+                continue;
+            }
+            ++sim->gridlock.reroutes;
+            if (simulation_unpark(sim, p) && event)
+                heap_push(&sim->events, sim->time+1, p);
+        }
+    }
+    simulation_route_stalled(sim, idle);
+    // as reservas do planner já evitam ciclos
+    if (sim->mode == SIM_MODE_COOPERATIVE)
+        return;
+
+    // Bloqueadas: não se moveram no turno e não têm célula livre para onde
+    // ir. Cada uma espera pelas vizinhas nas células que a aproximariam do
+    // objetivo
+    sim->gridlock_size = 0;
+    for (int i = 0; i < sim->persons_size; ++i) {
+        person_t* p = sim->persons[i];
+        if (p->done || p->last_move == sim->time
+            || person_choose(p, g, grid_free_neighbors(g, p->current_pos)) >= 0) {
+            continue;
+        }
+        sim_gridlock_node_t* n = simulation_gridlock_push(sim, p);
+        unsigned persons = grid_neighbors_of_type(g, p->current_pos,
+                                                  GRID_OBJ_PERSON);
+        for (int k = 0; persons; ++k, persons >>= 1) {
+            pos_t cell = pos_add(p->current_pos, grid_neighbor_offsets[k]);
+            if ((persons & 1) && person_improves(p, g, cell))
+                n->wanted |= 1u << k;
+        }
+    }
+    sim_gridlock_node_t* nodes = sim->gridlock_nodes;
+    int size = sim->gridlock_size;
+
+    // Descarta quem espera por alguém que ainda se move e, em seguida, quem
+    // esperava pelas descartadas, até sobrarem só as presas
+    int stack = -1;
+    for (int i = 0; i < size; ++i) {
+        unsigned wanted = nodes[i].wanted;
+        for (int k = 0; wanted; ++k, wanted >>= 1) {
+            pos_t cell = pos_add(nodes[i].person->current_pos,
+                                 grid_neighbor_offsets[k]);
+            if ((wanted & 1) && !simulation_gridlock_at(sim, cell)) {
+                nodes[i].mark = SIM_GRIDLOCK_FREE;
+                nodes[i].next = stack;
+                stack = i;
+                break;
+            }
+        }
+    }
+    while (stack >= 0) {
+        pos_t pos = nodes[stack].person->current_pos;
+        stack = nodes[stack].next;
+        for (int k = 0; k < GRID_NEIGHBOR_COUNT; ++k) {
+            sim_gridlock_node_t* n = simulation_gridlock_at(sim,
+                    pos_add(pos, grid_neighbor_offsets[k]));
+            // pos é a vizinha oposta a k de n
+            if (!n || n->mark
+                || !(n->wanted & 1u << (GRID_NEIGHBOR_COUNT-1 - k))) {
+                continue;
+            }
+            n->mark = SIM_GRIDLOCK_FREE;
+            n->next = stack;
+            stack = (int)(n - nodes);
+        }
+    }
+
+    // Entre as presas, cada uma toma a célula que person_next_pos() escolheria
+    // se as vizinhas que ela espera saíssem, e sempre é de outra presa
+    for (int i = 0; i < size; ++i) {
+        if (nodes[i].mark)
+            continue;
+        ++sim->gridlock.stuck;
+        person_t* p = nodes[i].person;
+        int k = person_choose(p, g, nodes[i].wanted);
+        if (k >= 0) {
+            sim_gridlock_node_t* n = simulation_gridlock_at(sim,
+                    pos_add(p->current_pos, grid_neighbor_offsets[k]));
+            nodes[i].succ = (int)(n - nodes);
+        }
+    }
+    // Seguindo succ a partir de cada presa, o percurso termina num ciclo
+    // (ao reencontrar uma presa que ele mesmo visitou) ou em alguém já
+    // visitado. Os ciclos são os mesmos em qualquer ordem de visita
+    int walks = 0;
+    for (int i = 0; i < size; ++i) {
+        if (nodes[i].mark)
+            continue;
+        int walk = ++walks, j = i;
+        while (j >= 0 && !nodes[j].mark) {
+            nodes[j].mark = walk;
+            j = nodes[j].succ;
+        }
+        if (j >= 0 && nodes[j].mark == walk) {
+            simulation_gridlock_rotate(sim, j);
+            ++sim->gridlock.cycles;
+        }
+    }
+    for (int i = 0; i < size; ++i)
+        nodes[i].person->gridlock = 0;
+    if (event)
+        simulation_drain_woken(sim); // acordadas por chegadas e remoções
+}
+
+/**
+ * Executada por uma única thread (id 0) enquanto as demais aguardam na
+ * barreira. Retira quem chegou ao objetivo, aplica plugs/unplugs e prepara o
+ * próximo turno.
+ */
+static void simulation_turn_boundary(simulation_t* sim) {
+    double t0 = simulation_now_ms();
+    int event = sim->mode == SIM_MODE_EVENT;
+    if (event) {
+        simulation_collect_events(sim);
+    } else {
+        int j = 0;
+        for (int i = 0; i < sim->persons_size; ++i) {
+            person_t* p = sim->persons[i];
+            if (p->done) {
+                if (sim->mode == SIM_MODE_COOPERATIVE)
+                    planner_release(&sim->planner, p, 0);
+                p->plugged = 0;
+                sim_list_push(&sim->leaving, p);
+            } else {
+                p->sim_index = j;
+                sim->persons[j++] = p;
+            }
+        }
+        sim->persons_size = j;
+    }
+    simulation_resolve_gridlocks(sim);
+    // nenhuma thread lê o grid agora: blocos que esvaziaram podem ser liberados
+    grid_release_chunks(&sim->grid);
+
+    LOCKPROF_SITE(site, "simulation_t.mtx (boundary)");
+    uint64_t prof = lockprof_lock(&site, &sim->mtx);
+    simulation_close_turn(sim);
+    simulation_collect_stats(sim);
+    simulation_release(sim);
+    int parked = atomic_load(&sim->n_parked);
+    sim->stats.parked = parked;
+    // Sem ninguém que possa se mover, dorme até chegar algum pedido. Só
+    // pedidos liberam células quando todos estão estacionados; se ainda há
+    // pessoas, elas estão travadas, e a espera fica registrada em stats.
+    double wait_ms = simulation_now_ms();
+    while (!sim->shutting_down && !sim->requests
+           && (event ? heap_empty(&sim->events)
+                     : parked == sim->persons_size)) {
+        if (sim->persons_size && !sim->stats.stalled) {
+            sim->stats.stalls = ++sim->stalls;
+            sim->stats.stalled = sim->persons_size;
+        }
+        lockprof_cond_wait(&site, &sim->requests_cond, &sim->mtx, &prof);
+    }
+    sim->stats.stalled = 0;
+    t0 += simulation_now_ms() - wait_ms; // a espera não conta
+    int first_new = sim->persons_size;
+    sim_batch_t* batches = simulation_apply_requests(sim);
+    sim->halted = sim->shutting_down;
+    lockprof_unlock(&site, &sim->mtx, prof);
+    simulation_finish_batches(batches);
+
+    ++sim->time;
+    simulation_prepare_turn(sim, first_new);
+    sim->turn_start_ms = simulation_now_ms();
+    sim->boundary_ms = sim->turn_start_ms - t0;
+}
+
+/**
+ * Move p um passo. Quem chama garante que nenhuma outra thread lê ou altera a
+ * vizinhança de p ao mesmo tempo. Retorna SIM_MOVED, SIM_PARKED,
+ * SIM_ARRIVED ou SIM_GONE.
+ */
+static int simulation_move(simulation_t* sim, person_t* p) {
+    if (p->done)
+        return SIM_GONE;
+    int result = SIM_MOVED;
+    grid_t* g = &sim->grid;
+    pos_t next = person_next_pos(p, g);
+    if (!pos_equals(next, p->current_pos)) {
+        grid_set(g, p->current_pos, GRID_OBJ_EMPTY);
+        if (pos_equals(next, p->goal_pos)) {
+            // chegou: deixa o grid agora e a simulação na passagem de turno
+            p->current_pos = next;
+            p->done = 1;
+            result = SIM_ARRIVED;
+        } else {
+            grid_set_person(g, next, p);
+        }
+        p->last_move = sim->time;
+    } else {
+        // person_next_pos() só depende de quais vizinhos estão livres: nada
+        // muda até que seja liberado um vizinho melhor que a posição atual
+        simulation_park(sim, p);
+        result = SIM_PARKED;
+    }
+    p->time = sim->time;
+    return result;
+}
+
+static int simulation_step(simulation_t* sim, person_t* p) {
+    grid_lock_t lock;
+    grid_lock_neighborhood(&sim->grid, p->current_pos, &lock);
+    int result = simulation_move(sim, p);
+    grid_unlock(&sim->grid, &lock);
+    return result;
+}
+
+/**
+ * Chave de person em simulation_t.claims no turno corrente.
+ */
+static uint64_t simulation_claim_key(simulation_t* sim, person_t* p) {
+    return (uint64_t)sim->time << 32 | (UINT32_MAX - (uint32_t)p->id);
+}
+
+/**
+ * Reivindicação da célula pos em simulation_t.claims, alocando a tabela do
+ * bloco de pos se ainda não existe.
+ */
+static _Atomic(uint64_t)* simulation_claim(simulation_t* sim, pos_t pos) {
+    grid_t* g = &sim->grid;
+    _Atomic(_Atomic(uint64_t)*)* link = sim->claims
+        + (size_t)(pos.y >> GRID_CHUNK_BITS)*g->chunks_x
+        + (pos.x >> GRID_CHUNK_BITS);
+    _Atomic(uint64_t)* tbl = atomic_load_explicit(link, memory_order_acquire);
+    if (!tbl) {
+        _Atomic(uint64_t)* mine = calloc(GRID_CHUNK_SIZE*GRID_CHUNK_SIZE,
+                                         sizeof(uint64_t));
+        if (atomic_compare_exchange_strong_explicit(link, &tbl, mine,
+                memory_order_acq_rel, memory_order_acquire)) {
+            tbl = mine;
+        } else {
+            free(mine); // outra thread publicou antes; tbl é a dela
+        }
+    }
+    return tbl + ((pos.y & (GRID_CHUNK_SIZE-1)) << GRID_CHUNK_BITS
+                  | (pos.x & (GRID_CHUNK_SIZE-1)));
+}
+
+/**
+ * Primeira fase de um turno SIM_MODE_DETERMINISTIC: calcula o próximo passo
+ * de p sobre o grid do turno anterior e reivindica a célula de destino.
+ */
+static int simulation_propose(simulation_t* sim, person_t* p) {
+    p->next_pos = p->current_pos;
+    if (p->done)
+        return SIM_GONE;
+    grid_t* g = &sim->grid;
+    pos_t next = person_next_pos(p, g);
+    if (pos_equals(next, p->current_pos))
+        return SIM_PROPOSED;
+    p->next_pos = next;
+    uint64_t key = simulation_claim_key(sim, p);
+    _Atomic(uint64_t)* claim = simulation_claim(sim, next);
+    uint64_t cur = atomic_load_explicit(claim, memory_order_relaxed);
+    while (cur < key && !atomic_compare_exchange_weak_explicit(claim, &cur,
+                key, memory_order_relaxed, memory_order_relaxed)) ;
+    return SIM_PROPOSED;
+}
+
+/**
+ * Segunda fase de um turno SIM_MODE_DETERMINISTIC: move p se sua
+ * reivindicação venceu. As células de destino estavam vazias no grid do
+ * turno anterior e as de origem ocupadas, então nenhuma célula é escrita por
+ * duas pessoas. Retorna SIM_MOVED, SIM_ARRIVED, SIM_BLOCKED ou SIM_GONE.
+ */
+static int simulation_commit(simulation_t* sim, person_t* p) {
+    if (p->done)
+        return SIM_GONE;
+    int result = SIM_BLOCKED;
+    grid_t* g = &sim->grid;
+    pos_t next = p->next_pos;
+    if (!pos_equals(next, p->current_pos)) {
+        _Atomic(uint64_t)* claim = simulation_claim(sim, next);
+        uint64_t key = simulation_claim_key(sim, p);
+        // a vencedora troca sua chave por uma que nenhuma pessoa do turno
+        // tem: mesmo com ids repetidos, só uma entra na célula
+        if (atomic_compare_exchange_strong_explicit(claim, &key,
+                    (uint64_t)sim->time << 32,
+                    memory_order_relaxed, memory_order_relaxed)) {
+            grid_set(g, p->current_pos, GRID_OBJ_EMPTY);
+            if (pos_equals(next, p->goal_pos)) {
+                p->current_pos = next;
+                p->done = 1;
+                result = SIM_ARRIVED;
+            } else {
+                grid_set_person(g, next, p);
+                result = SIM_MOVED;
+            }
+            p->last_move = sim->time;
+        }
+    }
+    p->time = sim->time;
+    return result;
+}
+
+/**
+ * Segunda fase de um turno SIM_MODE_COOPERATIVE: p entra em next_pos, que
+ * ela reservou e que quem estava lá já esvaziou. Retorna SIM_MOVED,
+ * SIM_ARRIVED, SIM_BLOCKED ou SIM_GONE.
+ */
+static int simulation_advance(simulation_t* sim, person_t* p) {
+    if (p->done)
+        return SIM_GONE;
+    int result = SIM_BLOCKED;
+    pos_t next = p->next_pos;
+    if (!pos_equals(next, p->current_pos)) {
+        if (pos_equals(next, p->goal_pos)) {
+            p->current_pos = next;
+            p->done = 1;
+            result = SIM_ARRIVED;
+        } else {
+            grid_set_person(&sim->grid, next, p);
+            result = SIM_MOVED;
+        }
+        p->last_move = sim->time;
+    }
+    p->time = sim->time;
+    return result;
+}
+
+typedef int (*simulation_step_fn)(simulation_t* sim, person_t* p);
+
+/**
+ * SIM_MODE_EVENT: anota, para a passagem de turno, o que fazer com p depois
+ * de result = simulation_move(). Quem estacionou fica fora do heap até ser
+ * acordado.
+ */
+static void simulation_after_step(simulation_t* sim, sim_worker_t* w,
+                                  person_t* p, int result) {
+    if (sim->mode != SIM_MODE_EVENT)
+        return;
+    if (result == SIM_ARRIVED || result == SIM_GONE)
+        sim_list_push(&w->finished, p);
+    else if (result == SIM_MOVED)
+        sim_list_push(&w->ready, p);
+}
+
+/**
+ * Rouba pessoas das outras threads enquanto houver alguma nos deques.
+ * Nenhum trabalho novo é criado durante o turno, então uma rodada em que
+ * todos os deques estão vazios significa que não há mais o que roubar.
+ * Retorna o tempo (ms) gasto processando as pessoas roubadas.
+ */
+static double simulation_steal_loop(simulation_t* sim, sim_worker_t* w,
+                                    simulation_step_fn step) {
+    int n = sim->n_threads;
+    double busy_ms = 0;
+    while (1) {
+        int found = 0, contended = 0;
+        w->rng ^= w->rng << 13;
+        w->rng ^= w->rng >> 17;
+        w->rng ^= w->rng << 5;
+        for (int k = 0; k < n-1; ++k) {
+            int victim = (w->id + 1 + (w->rng + k) % (n-1)) % n;
+            person_t* p;
+            ++w->stats.steal_attempts;
+            int r = deque_steal(&sim->workers[victim].deque, (void**)&p);
+            if (r == DEQUE_OK) {
+                double t0 = simulation_now_ms();
+                ++w->stats.steals;
+                ++w->turn.steps;
+                int result = step(sim, p);
+                simulation_count(w, result);
+                simulation_after_step(sim, w, p, result);
+                busy_ms += simulation_now_ms() - t0;
+                found = 1;
+                break;
+            }
+            contended |= r == DEQUE_ABORT;
+        }
+        if (!found) {
+            if (!contended)
+                break;
+            sched_yield();
+        }
+    }
+    return busy_ms;
+}
+
+/**
+ * Espera na barreira no meio de um turno. Retorna o instante em que a
+ * barreira liberou.
+ */
+static double simulation_mid_barrier(simulation_t* sim, sim_worker_t* w) {
+    double t0 = simulation_now_ms();
+    sim_barrier_wait(&sim->barrier);
+    double t1 = simulation_now_ms();
+    w->turn.barrier_ms += t1 - t0;
+    return t1;
+}
+
+/**
+ * Turno dos modos SIM_MODE_LOCKED, SIM_MODE_DETERMINISTIC e
+ * SIM_MODE_EVENT: consome o próprio deque e depois rouba dos outros.
+ */
+static void simulation_run_deques(simulation_t* sim, sim_worker_t* w) {
+    int det = sim->mode == SIM_MODE_DETERMINISTIC;
+    simulation_step_fn step = det ? simulation_propose : simulation_step;
+    double t0 = simulation_now_ms();
+    person_t* p;
+    while (deque_pop(&w->deque, (void**)&p)) {
+        int result = step(sim, p);
+        simulation_count(w, result);
+        simulation_after_step(sim, w, p, result);
+        ++w->turn.steps;
+    }
+    double t1 = simulation_now_ms();
+    w->turn.decide_ms += t1 - t0;
+    if (sim->n_threads > 1) {
+        double busy_ms = simulation_steal_loop(sim, w, step);
+        t0 = t1;
+        t1 = simulation_now_ms();
+        w->turn.decide_ms += busy_ms;
+        w->turn.idle_ms += t1 - t0 - busy_ms;
+    }
+    if (det) {
+        // todas as propostas feitas: aplica as da fatia desta thread
+        t0 = simulation_mid_barrier(sim, w);
+        long size = sim->persons_size;
+        int lo = size*w->id/sim->n_threads,
+            hi = size*(w->id+1)/sim->n_threads;
+        for (int i = lo; i < hi; ++i)
+            simulation_count(w, simulation_commit(sim, sim->persons[i]));
+        t1 = simulation_now_ms();
+        w->turn.commit_ms += t1 - t0;
+    }
+    w->turn.end_ms = t1;
+}
+
+/**
+ * Turno do modo SIM_MODE_BANDS para a faixa da thread w.
+ */
+static void simulation_run_band(simulation_t* sim, sim_worker_t* w) {
+    double t0 = simulation_now_ms();
+    sim_band_t* b = sim->bands + w->id;
+    int height = sim->grid.height;
+    // recebe quem cruzou a fronteira no turno anterior
+    person_t* in[64];
+    size_t n;
+    while ((n = queue_pop_many(&b->handoff, (void**)in, 64))) {
+        for (size_t i = 0; i < n; ++i)
+            sim_band_add(b, in[i]);
+    }
+
+    for (int i = 0; i < b->persons_size; ++i) {
+        person_t* p = b->persons[i];
+        if (atomic_load_explicit(&p->parked, memory_order_relaxed))
+            continue;
+        if (sim_band_interior(b, p->current_pos, height)) {
+            simulation_count(w, simulation_move(sim, p));
+            ++w->turn.steps;
+        }
+    }
+    w->turn.decide_ms += simulation_now_ms() - t0;
+    // o halo de cada faixa só é movido depois que os interiores vizinhos
+    // terminaram
+    t0 = simulation_mid_barrier(sim, w);
+    for (int i = 0; i < b->persons_size; ++i) {
+        person_t* p = b->persons[i];
+        if (p->time != sim->time
+            && !atomic_load_explicit(&p->parked, memory_order_relaxed)) {
+            simulation_count(w, simulation_step(sim, p));
+            ++w->turn.steps;
+        }
+    }
+    double t1 = simulation_now_ms();
+    w->turn.decide_ms += t1 - t0;
+
+    // retira quem terminou e entrega quem saiu da faixa
+    int j = 0;
+    for (int i = 0; i < b->persons_size; ++i) {
+        person_t* p = b->persons[i];
+        int y = p->current_pos.y;
+        if (p->done)
+            continue;
+        if (y < b->y0 || y >= b->y1)
+            queue_push_back(&simulation_band_of(sim, y)->handoff, p);
+        else
+            b->persons[j++] = p;
+    }
+    b->persons_size = j;
+    w->turn.end_ms = simulation_now_ms();
+    w->turn.commit_ms += w->turn.end_ms - t1;
+}
+
+/**
+ * Turno do modo SIM_MODE_COOPERATIVE para a fatia de persons da thread w:
+ * os passos foram reservados na passagem de turno e não disputam células.
+ */
+static void simulation_run_coop(simulation_t* sim, sim_worker_t* w) {
+    double t0 = simulation_now_ms();
+    long size = sim->persons_size;
+    int lo = size*w->id/sim->n_threads, hi = size*(w->id+1)/sim->n_threads;
+    for (int i = lo; i < hi; ++i) {
+        person_t* p = sim->persons[i];
+        if (!p->done && !pos_equals(p->next_pos, p->current_pos))
+            grid_set(&sim->grid, p->current_pos, GRID_OBJ_EMPTY);
+    }
+    w->turn.decide_ms += simulation_now_ms() - t0;
+    // todas as células de origem vazias: ocupa as de destino
+    t0 = simulation_mid_barrier(sim, w);
+    for (int i = lo; i < hi; ++i) {
+        simulation_count(w, simulation_advance(sim, sim->persons[i]));
+        ++w->turn.steps;
+    }
+    w->turn.end_ms = simulation_now_ms();
+    w->turn.commit_ms += w->turn.end_ms - t0;
+}
+
+static void* simulation_worker(void* arg) {
+    sim_worker_t* w = (sim_worker_t*)arg;
+    simulation_t* sim = w->sim;
+    while (1) {
+        if (w->id == 0)
+            simulation_turn_boundary(sim);
+        sim_barrier_wait(&sim->barrier);
+        if (sim->halted)
+            break;
+        if (sim->mode == SIM_MODE_BANDS)
+            simulation_run_band(sim, w);
+        else if (sim->mode == SIM_MODE_COOPERATIVE)
+            simulation_run_coop(sim, w);
+        else
+            simulation_run_deques(sim, w);
+        // espera pelas demais threads (a passagem de turno calcula a espera
+        // a partir de w->turn.end_ms)
+        sim_barrier_wait(&sim->barrier);
+    }
+    return NULL;
+}
+
+void simulation_set_mode(simulation_t* sim, int mode) {
+    pthread_mutex_lock(&sim->mtx);
+    if (sim->started || mode < SIM_MODE_LOCKED || mode > SIM_MODE_COOPERATIVE)
+        abort();
+    sim->mode = mode;
+    pthread_mutex_unlock(&sim->mtx);
+}
+
+void simulation_set_gridlock(simulation_t* sim, unsigned period) {
+    pthread_mutex_lock(&sim->mtx);
+    if (sim->started)
+        abort();
+    sim->gridlock_period = period;
+    pthread_mutex_unlock(&sim->mtx);
+}
+
+void simulation_set_layout(simulation_t* sim, int layout) {
+    pthread_mutex_lock(&sim->mtx);
+    if (sim->started)
+        abort();
+    grid_set_layout(&sim->grid, layout);
+    pthread_mutex_unlock(&sim->mtx);
+}
+
+void simulation_start(simulation_t* sim) {
+    pthread_mutex_lock(&sim->mtx);
+    assert(!sim->started);
+    sim->started = 1;
+    pthread_mutex_unlock(&sim->mtx);
+
+    if (sim->mode == SIM_MODE_DETERMINISTIC) {
+        sim->claims = calloc((size_t)sim->grid.chunks_x*sim->grid.chunks_y,
+                             sizeof(_Atomic(uint64_t)*));
+    }
+    if (sim->mode == SIM_MODE_COOPERATIVE)
+        planner_init(&sim->planner);
+    if (sim->mode == SIM_MODE_BANDS) {
+        int n = sim->n_threads, h = sim->grid.height;
+        sim->bands = malloc(n*sizeof(sim_band_t));
+        for (int i = 0; i < n; ++i)
+            sim_band_init(sim->bands+i, (long)h*i/n, (long)h*(i+1)/n,
+                          sim->grid.width);
+        // quem já saiu só deixa persons na primeira passagem de turno, que
+        // libera a pessoa antes de qualquer faixa rodar
+        for (int i = 0; i < sim->persons_size; ++i) {
+            person_t* p = sim->persons[i];
+            if (!p->done)
+                sim_band_add(simulation_band_of(sim, p->current_pos.y), p);
+        }
+    }
+    if (sim->mode == SIM_MODE_EVENT) {
+        // de trás para frente: simulation_detach() move a última pessoa
+        for (int i = sim->persons_size-1; i >= 0; --i) {
+            person_t* p = sim->persons[i];
+            if (p->done)
+                simulation_detach(sim, p);
+            else
+                heap_push(&sim->events, sim->time+1, p);
+        }
+    }
+    sim->workers = calloc(sim->n_threads, sizeof(sim_worker_t));
+    for (int i = 0; i < sim->n_threads; ++i) {
+        sim->workers[i].sim = sim;
+        sim->workers[i].id = i;
+        sim->workers[i].rng = 2463534242u + i;
+        deque_init(&sim->workers[i].deque, 64);
+        sim_list_init(&sim->workers[i].ready);
+        sim_list_init(&sim->workers[i].finished);
+    }
+    // a primeira passagem de turno já usa os deques de todas as threads
+    for (int i = 0; i < sim->n_threads; ++i) {
+        pthread_create(&sim->workers[i].thread, NULL, simulation_worker,
+                       sim->workers+i);
+    }
+}
+
+void simulation_set_metrics(simulation_t* sim, int fd, int format) {
+    pthread_mutex_lock(&sim->mtx);
+    if (format < SIM_METRICS_OFF || format > SIM_METRICS_CSV)
+        abort();
+    sim->metrics_header = format == SIM_METRICS_CSV
+                          && (sim->metrics_format != format
+                              || sim->metrics_fd != fd);
+    sim->metrics_fd = fd;
+    sim->metrics_format = format;
+    pthread_mutex_unlock(&sim->mtx);
+}
+
+void simulation_set_lock_report(simulation_t* sim, int fd) {
+    pthread_mutex_lock(&sim->mtx);
+    sim->lock_report_fd = fd;
+    pthread_mutex_unlock(&sim->mtx);
+}
+
+void simulation_get_stats(simulation_t* sim, sim_stats_t* stats) {
+    LOCKPROF_SITE(site, "simulation_t.mtx (get_stats)");
+    uint64_t prof = lockprof_lock(&site, &sim->mtx);
+    *stats = sim->stats;
+    lockprof_unlock(&site, &sim->mtx, prof);
+}
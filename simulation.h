@@ -2,12 +2,340 @@
 #define INE5410_SIMULATION_H_
 
 #include "grid.h"
-#include "queue.h"
+#include "deque.h"
+#include "heap.h"
+#include "planner.h"
+#include "scenario.h"
+
+/**
+ * Barreira reutilizável (pthread_barrier_t não existe no Mac OS).
+ */
+typedef struct sim_barrier_s {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    int count, waiting;
+    unsigned generation;
+} sim_barrier_t;
+
+/**
+ * Pedido de plug/unplug feito com a simulação em andamento. Os pedidos são
+ * alocados na pilha de quem chama simulation_plug()/simulation_unplug() e
+ * aplicados pela simulação na passagem de turno.
+ */
+typedef struct sim_request_s {
+    person_t* person;
+    int op;     ///< SIM_REQ_*
+    int result; ///< retorno de simulation_plug_unsafe() (só para plug)
+    int done;   ///< 1 após o pedido ser aplicado
+    struct sim_request_s* next;
+    void* data; ///< SIM_REQ_CHECKPOINT: scenario_t a preencher
+} sim_request_t;
+
+#define SIM_REQ_PLUG       1
+#define SIM_REQ_UNPLUG     2
+#define SIM_REQ_BATCH      3 ///< o pedido é sim_batch_t.link
+#define SIM_REQ_CHECKPOINT 4
+
+struct sim_batch_s;
+typedef void (*sim_batch_fn)(struct sim_batch_s* batch, void* ctx);
+
+/**
+ * Lote de plugs/unplugs entregue de uma vez com simulation_submit_batch().
+ *
+ * O lote entra na fila de pedidos como um único pedido e é aplicado inteiro,
+ * na ordem em que as operações foram adicionadas, na próxima passagem de
+ * turno. Quem submete não bloqueia: pode esperar com sim_batch_wait(),
+ * consultar sim_batch_pending() ou receber a chamada on_done.
+ */
+typedef struct sim_batch_s {
+    sim_request_t link;   ///< entrada do lote na fila simulation_t.requests
+    sim_request_t* items; ///< operações; items[i].result é o retorno do plug
+    int size, cap;
+    sim_batch_fn on_done; ///< chamada após a aplicação (pode ser NULL)
+    void* ctx;
+    /**
+     * SIM_BATCH_IDLE, SIM_BATCH_PENDING ou SIM_BATCH_WAITING (pendente e com
+     * alguém em sim_batch_wait()).
+     */
+    atomic_int state;
+    struct sim_batch_s* done_next; ///< lotes aplicados e ainda não concluídos
+} sim_batch_t;
+
+#define SIM_BATCH_IDLE    0
+#define SIM_BATCH_PENDING 1
+#define SIM_BATCH_WAITING 2
+
+/**
+ * Modos de execução dos turnos (veja simulation_set_mode()).
+ *
+ * SIM_MODE_LOCKED: cada pessoa é movida de uma vez, com os tiles da sua
+ * vizinhança travados. Pessoas que disputam uma célula são decididas pela
+ * ordem em que as threads chegam aos locks.
+ *
+ * SIM_MODE_DETERMINISTIC: o turno tem duas fases separadas por uma barreira.
+ * Na primeira, todas as pessoas calculam seu próximo passo lendo o grid do
+ * turno anterior (que não muda nessa fase) e reivindicam a célula de destino
+ * na tabela simulation_t.claims; a reivindicação de menor id vence. Na
+ * segunda, as vencedoras se movem. Nenhum lock de célula é usado e, para os
+ * mesmos plugs/unplugs em cada turno, o resultado é idêntico para qualquer
+ * número de threads (desde que os ids sejam únicos e a cache de campos não
+ * atinja GRID_FIELD_MAX_CELLS).
+ */
+#define SIM_MODE_LOCKED        0
+#define SIM_MODE_DETERMINISTIC 1
+/**
+ * SIM_MODE_BANDS: o grid é dividido em faixas horizontais de linhas, uma por
+ * thread (veja sim_band_t). Cada thread move as pessoas da sua faixa, sem
+ * locks longe das fronteiras e com os locks de tile perto delas.
+ */
+#define SIM_MODE_BANDS         2
+/**
+ * SIM_MODE_EVENT: cada pessoa que pode se mover é agendada em
+ * simulation_t.events pelo turno do seu próximo movimento. Pessoas
+ * estacionadas não ficam no heap (voltam a ele quando acordadas) e quem
+ * chegou ao objetivo sai da lista sem varredura: o custo de cada turno é
+ * proporcional às pessoas ativas, não às plugadas.
+ */
+#define SIM_MODE_EVENT         3
+/**
+ * SIM_MODE_COOPERATIVE: as pessoas planejam juntas (veja planner.h). Na
+ * passagem de turno, quem precisa replaneja, em ordem de id, desviando das
+ * células que as outras reservaram para os próximos turnos; no turno, cada
+ * pessoa dá o passo reservado, sem locks e sem disputa. Uma pessoa pode
+ * entrar na célula que outra deixa no mesmo turno (o turno esvazia as
+ * células de origem e, depois de uma barreira, ocupa as de destino). Como no
+ * SIM_MODE_DETERMINISTIC, o resultado não depende do número de threads.
+ */
+#define SIM_MODE_COOPERATIVE   4
+
+/**
+ * Faixa de linhas [y0, y1) do grid, de posse de uma única thread no modo
+ * SIM_MODE_BANDS.
+ *
+ * Pessoas a mais de 2 linhas de uma fronteira com outra faixa (o "interior")
+ * não podem disputar células com pessoas de outras faixas, e são movidas sem
+ * sincronização alguma. As demais (o "halo") são movidas depois de uma
+ * barreira, com grid_lock_neighborhood(). Quem cruza a fronteira é entregue
+ * à faixa vizinha pela fila handoff e entra na lista dela no turno seguinte.
+ */
+typedef struct sim_band_s {
+    int y0, y1;
+    /**
+     * Pessoas da faixa (só a dona altera, exceto na passagem de turno).
+     */
+    person_t** persons;
+    int persons_size, persons_cap;
+    queue_t handoff;
+} sim_band_t;
+
+/**
+ * Lista de pessoas que cresce conforme necessário.
+ */
+typedef struct sim_list_s {
+    person_t** items;
+    int size, cap;
+} sim_list_t;
+
+/**
+ * O que a busca por gridlocks (veja simulation_set_gridlock()) fez desde
+ * simulation_start().
+ */
+typedef struct sim_gridlock_stats_s {
+    size_t checks;   ///< buscas feitas
+    size_t stuck;    ///< pessoas bloqueadas só por outras bloqueadas (somadas)
+    size_t cycles;   ///< ciclos de espera desfeitos
+    size_t moves;    ///< passos dados ao desfazer os ciclos
+    size_t reroutes; ///< desvios dados a quem estava preso num beco
+    size_t stranded; ///< pessoas removidas por não alcançarem o objetivo
+} sim_gridlock_stats_t;
+
+/**
+ * Pessoa bloqueada durante uma busca por gridlocks: wanted tem um bit por
+ * vizinha (como em grid_free_neighbors()) que ocupa uma célula para onde ela
+ * iria, e succ é o índice da vizinha cuja célula ela toma se o ciclo for
+ * desfeito (-1 se nenhuma). mark é 0 enquanto ela pode estar presa,
+ * SIM_GRIDLOCK_FREE se espera por alguém que ainda se move, ou o número do
+ * percurso que a visitou. next encadeia a pilha de descartadas.
+ */
+typedef struct sim_gridlock_node_s {
+    person_t* person;
+    unsigned wanted;
+    int succ, mark, next;
+} sim_gridlock_node_t;
+
+#define SIM_GRIDLOCK_FREE -1
+
+/**
+ * Estatísticas do escalonador, acumuladas desde simulation_start().
+ */
+typedef struct sim_stats_s {
+    size_t turns;          ///< turnos executados
+    size_t steps;          ///< pessoas processadas (soma de todos os turnos)
+    size_t moves;          ///< passos efetivamente dados (inclui chegadas)
+    size_t steals;         ///< pessoas roubadas do deque de outra thread
+    size_t steal_attempts; ///< tentativas de roubo, com ou sem sucesso
+    double idle_ms;        ///< tempo somado das threads procurando trabalho
+    size_t parked;         ///< pessoas estacionadas na última passagem de turno
+    size_t stalls;         ///< esperas com todas as pessoas estacionadas
+    size_t stalled;        ///< pessoas paradas na espera em curso (ou 0)
+    sim_gridlock_stats_t gridlock;
+} sim_stats_t;
+
+/**
+ * Contadores de um turno de uma thread. Só a própria thread escreve durante
+ * o turno; a passagem de turno soma em sim_worker_t.stats, exporta (veja
+ * simulation_set_metrics()) e zera.
+ */
+typedef struct sim_turn_metrics_s {
+    size_t steps;      ///< pessoas processadas
+    size_t moves;      ///< passos dados (inclui chegadas)
+    size_t blocked;    ///< decisões de ficar no lugar
+    size_t arrived;    ///< pessoas que chegaram ao objetivo
+    double decide_ms;  ///< calculando e dando passos
+    double commit_ms;  ///< aplicando passos (det) ou entregando pessoas (bands)
+    double idle_ms;    ///< procurando o que roubar
+    double barrier_ms; ///< esperando nas barreiras do turno
+    double end_ms;     ///< instante em que o trabalho da thread terminou
+} sim_turn_metrics_t;
+
+#define SIM_METRICS_OFF  0
+#define SIM_METRICS_JSON 1 ///< um objeto JSON por linha e por turno
+#define SIM_METRICS_CSV  2 ///< cabeçalho e uma linha por turno
+
+struct simulation_s;
+
+/**
+ * Estado de cada thread da simulação. A thread de id 0 é também responsável
+ * pelas passagens de turno.
+ *
+ * A cada turno a passagem de turno empilha em deque uma fatia de
+ * simulation_t.persons, que a thread consome pelo fundo; quando ele
+ * esvazia, rouba do topo dos deques das outras threads até que o turno
+ * termine. stats só é escrito pela própria thread e somado em
+ * simulation_t.stats na passagem de turno.
+ */
+typedef struct sim_worker_s {
+    struct simulation_s* sim;
+    int id;
+    pthread_t thread;
+    deque_t deque;
+    unsigned rng; ///< estado do xorshift que escolhe a vítima dos roubos
+    sim_stats_t stats;
+    sim_turn_metrics_t turn;
+    /**
+     * SIM_MODE_EVENT: pessoas movidas pela thread no turno que continuam
+     * ativas (ready) ou que chegaram ao objetivo (finished). Esvaziadas na
+     * passagem de turno.
+     */
+    sim_list_t ready, finished;
+} sim_worker_t;
 
 typedef struct simulation_s {
     grid_t grid;
     size_t time;
-    // Você provavelmente quer adicionar coisas aqui
+    int n_threads;
+    sim_worker_t* workers;
+    int mode; ///< SIM_MODE_*
+    int started, shutting_down;
+    /**
+     * Cópia de shutting_down feita pela passagem de turno. Quando 1, as
+     * threads terminaram (ou estão terminando) e não aplicarão mais pedidos.
+     */
+    int halted;
+    sim_barrier_t barrier;
+
+    /**
+     * Protege persons fora dos turnos, requests e shutting_down. requests_cond
+     * é sinalizada na passagem de turno (pedidos aplicados) e a cada novo
+     * pedido (a simulação dorme enquanto não há pessoas).
+     */
+    pthread_mutex_t mtx;
+    pthread_cond_t requests_cond;
+    sim_request_t* requests;
+
+    /**
+     * Pessoas atualmente plugadas. Só é alterada na passagem de turno.
+     */
+    person_t** persons;
+    int persons_size, persons_cap;
+
+    /**
+     * Reivindicações de células do modo SIM_MODE_DETERMINISTIC: uma tabela
+     * de GRID_CHUNK_SIZE x GRID_CHUNK_SIZE por bloco de grid_t.chunks,
+     * alocada quando alguém reivindica uma célula do bloco pela primeira
+     * vez (o índice de blocos é alocado em simulation_start()). Cada valor é
+     * (time << 32) | (UINT32_MAX - id): o maior valor da célula no turno
+     * corrente é o da pessoa de menor id, e valores de turnos anteriores
+     * sempre perdem, então a tabela nunca precisa ser limpa.
+     */
+    _Atomic(_Atomic(uint64_t)*)* claims;
+    /**
+     * Pessoas com person_t.parked == 1. Enquanto é 0, liberar uma célula não
+     * precisa procurar quem acordar.
+     */
+    atomic_int n_parked;
+    /**
+     * SIM_MODE_EVENT: próximos movimentos, com chave igual ao turno em que a
+     * pessoa se move (só a passagem de turno usa), e pilha sem locks das
+     * pessoas acordadas durante o turno (encadeadas por
+     * person_t.wake_next).
+     */
+    heap_t events;
+    _Atomic(person_t*) woken;
+    /**
+     * Faixas do modo SIM_MODE_BANDS (uma por thread), criadas em
+     * simulation_start().
+     */
+    sim_band_t* bands;
+    /**
+     * SIM_MODE_COOPERATIVE: reservas e caminhos (iniciado em
+     * simulation_start()) e, durante a passagem de turno, a lista de quem
+     * replaneja no turno.
+     */
+    planner_t planner;
+    sim_list_t replan;
+    /**
+     * Pessoas retiradas de persons à espera de person_leave(), chamada só
+     * depois que a passagem de turno publica em stats o turno em que elas
+     * chegaram (quem sai de person_join() já vê esse turno). Protegida por
+     * mtx fora da passagem de turno.
+     */
+    sim_list_t leaving;
+    /**
+     * Busca por gridlocks: turnos entre duas buscas (0 desliga) e o que elas
+     * fizeram até agora (só a passagem de turno usa). gridlock_nodes guarda
+     * as pessoas bloqueadas durante uma busca.
+     */
+    unsigned gridlock_period;
+    sim_gridlock_stats_t gridlock;
+    sim_gridlock_node_t* gridlock_nodes;
+    int gridlock_size, gridlock_cap;
+    /**
+     * Durante uma busca, quem vai seguir um caminho pelo grid inteiro (veja
+     * person_route()), e o campo sem cache de onde saem esses caminhos, um
+     * objetivo de cada vez.
+     */
+    sim_list_t routing;
+    grid_field_t route_field;
+    /**
+     * Soma das estatísticas das threads, atualizada na passagem de turno
+     * (protegida por mtx). stalls conta as vezes em que a passagem de turno
+     * dormiu sem ninguém que pudesse se mover (veja sim_stats_t.stalls).
+     */
+    sim_stats_t stats;
+    size_t stalls;
+    /**
+     * Exportação de métricas por turno (protegida por mtx). turn_plugs e
+     * turn_unplugs contam os pedidos aplicados na última passagem de turno;
+     * turn_start_ms e boundary_ms são o início do turno corrente e a duração
+     * da passagem de turno que o precedeu.
+     */
+    int metrics_fd, metrics_format, metrics_header;
+    char* metrics_buf;
+    size_t metrics_cap;
+    int turn_plugs, turn_unplugs;
+    double turn_start_ms, boundary_ms;
+    int lock_report_fd; ///< veja simulation_set_lock_report()
 } simulation_t;
 
 /**
@@ -26,7 +354,7 @@ void simulation_destroy(simulation_t* simulation);
 
 /**
  * Insere uma pessoa no simulation. A pessoa será inserida na passagem de um
- * turno para outro, de modo a não causar inconsistências na simulação. 
+ * turno para outro, de modo a não causar inconsistências na simulação.
  *
  * Caso a posição já esteja ocupada, retorna com valor 0. Se person->current_pos
  * estiver vazio, retorna com valor 1.
@@ -42,7 +370,7 @@ int simulation_plug_unsafe(simulation_t* simulation, person_t* person);
  * Versão de simulation_plug_unsafe que pode ser chamada com a simulação em
  * andamento.
  *
- * A pessoa será inserida de modo a não causar inconsistências na simulação. 
+ * A pessoa será inserida de modo a não causar inconsistências na simulação.
  * Isso implica que essa função bloqueará até que a inserção seja segura
  */
 int simulation_plug(simulation_t* simulation, person_t* person);
@@ -52,10 +380,160 @@ int simulation_plug(simulation_t* simulation, person_t* person);
  */
 void simulation_unplug(simulation_t* simulation, person_t* person);
 
+/**
+ * Inicializa um lote vazio. on_done (se não for NULL) é chamada com ctx
+ * sempre que o lote terminar de ser aplicado, pela thread que o aplicou e
+ * sem nenhum lock da simulação travado; ela pode submeter outros lotes.
+ */
+void sim_batch_init(sim_batch_t* batch, sim_batch_fn on_done, void* ctx);
+
+/**
+ * Libera os recursos do lote.
+ *
+ * Precondições:
+ * - o lote não está pendente [UNDEFINED BEHAVIOR se violada]
+ */
+void sim_batch_destroy(sim_batch_t* batch);
+
+/**
+ * Adiciona ao lote a inserção (sim_batch_plug) ou a remoção
+ * (sim_batch_unplug) de person. sim_batch_clear() esvazia o lote.
+ *
+ * Precondições:
+ * - o lote não está pendente [UNDEFINED BEHAVIOR se violada]
+ */
+void sim_batch_plug(sim_batch_t* batch, person_t* person);
+void sim_batch_unplug(sim_batch_t* batch, person_t* person);
+void sim_batch_clear(sim_batch_t* batch);
+
+/**
+ * Entrega o lote à simulação e retorna sem esperar. Com a simulação parada
+ * (antes de simulation_start() ou durante o encerramento) o lote é aplicado
+ * imediatamente. Um lote concluído pode ser submetido de novo.
+ *
+ * Precondições:
+ * - o lote não está pendente [abort() se violada]
+ * - as pessoas do lote seguem as precondições de simulation_plug_unsafe()
+ */
+void simulation_submit_batch(simulation_t* simulation, sim_batch_t* batch);
+
+/**
+ * Retorna 1 enquanto o lote não tiver sido aplicado (e on_done retornado).
+ */
+int sim_batch_pending(sim_batch_t* batch);
+
+/**
+ * Bloqueia até que o lote tenha sido aplicado e on_done tenha retornado.
+ */
+void sim_batch_wait(sim_batch_t* batch);
+
+/**
+ * Escolhe como os turnos são executados (SIM_MODE_LOCKED, o padrão,
+ * SIM_MODE_DETERMINISTIC, SIM_MODE_BANDS, SIM_MODE_EVENT ou
+ * SIM_MODE_COOPERATIVE).
+ *
+ * Precondições:
+ * - simulation_start() ainda não foi chamada [abort() se violada]
+ */
+void simulation_set_mode(simulation_t* simulation, int mode);
+
+/**
+ * Troca a ordem das células do grid (GRID_LAYOUT_ROWS, o padrão, ou
+ * GRID_LAYOUT_MORTON; veja grid_set_layout()).
+ *
+ * Precondições:
+ * - simulation_start() ainda não foi chamada [abort() se violada]
+ * - layout é um GRID_LAYOUT_*               [abort() se violada]
+ */
+void simulation_set_layout(simulation_t* simulation, int layout);
+
+/**
+ * Período padrão da busca por gridlocks, em turnos.
+ */
+#define SIM_GRIDLOCK_PERIOD 16
+
+/**
+ * Faz a passagem de turno procurar gridlocks a cada period turnos (0
+ * desliga; o padrão é SIM_GRIDLOCK_PERIOD) e também sempre que ninguém mais
+ * pode se mover. Sem isso, pessoas que esperam umas pelas outras (em ciclo,
+ * como duas que querem trocar de lugar num corredor, ou num beco de onde
+ * person_next_pos() não as tira) nunca chegam, e person_join() nunca
+ * retorna.
+ *
+ * A busca monta o grafo de espera: cada pessoa que não se move desde o
+ * turno anterior e não tem para onde ir espera pelas vizinhas que ocupam
+ * as células que ela tomaria. Descartadas as que esperam por alguém que
+ * ainda se move, sobram as bloqueadas de vez. Cada ciclo entre elas (cada
+ * uma quer a célula da seguinte) é desfeito movendo todas de uma vez para a
+ * célula da seguinte, o que nenhum modo consegue fazer passo a passo.
+ *
+ * Quem usa o algoritmo guloso (sem campo de distâncias) e não se aproxima
+ * do objetivo por algumas buscas seguidas está oscilando num beco: ganha um
+ * desvio (veja person_reroute() e person_route()). As pessoas que não
+ * alcançam mais o objetivo (cercadas por obstáculos, ou sem caminho pelo
+ * grid) são removidas da simulação, como se tivessem chegado. Nada disso
+ * depende da ordem das pessoas nem do número de threads.
+ *
+ * Se ainda assim todas ficam paradas, a simulação espera por pedidos e
+ * registra a espera em sim_stats_t.stalls e sim_stats_t.stalled.
+ *
+ * No modo SIM_MODE_COOPERATIVE não há ciclos para desfazer (o planner já os
+ * evita): só os desvios e a remoção de quem não alcança o objetivo valem.
+ *
+ * Precondições:
+ * - simulation_start() ainda não foi chamada [abort() se violada]
+ */
+void simulation_set_gridlock(simulation_t* simulation, unsigned period);
+
 /**
  * Inicia a execução do simulation. Essa função não bloqueia: ela retorna
  * imediatamente e a execução prossegue em background.
  */
 void simulation_start(simulation_t* simulation);
 
+/**
+ * Grava em path (no formato de scenario.h) o grid e as pessoas plugadas na
+ * próxima passagem de turno, com header.time igual ao turno. Bloqueia só até
+ * a passagem de turno copiar o estado: a escrita do arquivo acontece com a
+ * simulação já seguindo. Retorna 0 ou o errno da escrita.
+ */
+int simulation_checkpoint(simulation_t* simulation, const char* path);
+
+/**
+ * Passa a escrever em fd, ao fim de cada turno, uma linha com as métricas
+ * do turno no formato SIM_METRICS_JSON ou SIM_METRICS_CSV (que começa com
+ * um cabeçalho), ou desliga a exportação (SIM_METRICS_OFF). Pode ser
+ * chamada a qualquer momento; vale a partir da próxima passagem de turno.
+ *
+ * Cada linha tem o turno, sua duração (ms), a passagem de turno anterior
+ * (boundary_ms), pessoas plugadas e estacionadas, plugs e unplugs aplicados
+ * antes do turno, pessoas processadas, passos, decisões de ficar no lugar,
+ * chegadas, o tempo somado das threads em cada fase (decide, commit,
+ * barrier e idle) e o tempo ocupado e ocioso de cada thread.
+ *
+ * Precondições:
+ * - format é SIM_METRICS_* [abort() se violada]
+ * - fd continua aberto enquanto a exportação estiver ligada
+ */
+void simulation_set_metrics(simulation_t* simulation, int fd, int format);
+
+/**
+ * Quantos sites o relatório de simulation_set_lock_report() lista.
+ */
+#define SIM_LOCK_REPORT_TOP 8
+
+/**
+ * Faz simulation_destroy() escrever em fd os SIM_LOCK_REPORT_TOP sites de
+ * lock com maior tempo de espera (veja lockprof.h), ou desliga o relatório
+ * (fd < 0, o padrão). Os contadores são do processo inteiro, não só desta
+ * simulação. Sem efeito se compilado com LOCKPROF_DISABLE.
+ */
+void simulation_set_lock_report(simulation_t* simulation, int fd);
+
+/**
+ * Copia para *stats as estatísticas do escalonador até a última passagem de
+ * turno.
+ */
+void simulation_get_stats(simulation_t* simulation, sim_stats_t* stats);
+
 #endif /*INE5410_SIMULATION_H_*/
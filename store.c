@@ -0,0 +1,146 @@
+#include "store.h"
+#include "lockprof.h"
+#include <stdlib.h>
+#include <assert.h>
+
+/* --- --- --- --- store_t  --- --- --- --- */
+
+void store_init(store_t* store) {
+    store->chunks = NULL;
+    store->chunks_cap = 0;
+    store->size = 0;
+}
+
+void store_destroy(store_t* store) {
+    for (size_t i = 0; i < store->size; ++i)
+        person_destroy(store_get(store, i));
+    size_t n_chunks = (store->size + STORE_CHUNK_MASK) >> STORE_CHUNK_BITS;
+    for (size_t i = 0; i < n_chunks; ++i)
+        free(store->chunks[i]);
+    free(store->chunks);
+    store_init(store);
+}
+
+store_handle_t store_add(store_t* store, int id, pos_t pos, pos_t goal,
+                         size_t time) {
+    store_handle_t h = store->size++;
+    size_t chunk = h >> STORE_CHUNK_BITS;
+    if (!(h & STORE_CHUNK_MASK)) {
+        // só a tabela de ponteiros é realocada; os blocos ficam onde estão
+        if (chunk == store->chunks_cap) {
+            store->chunks_cap = store->chunks_cap ? 2*store->chunks_cap : 4;
+            store->chunks = realloc(store->chunks,
+                                    store->chunks_cap*sizeof(store_chunk_t*));
+        }
+        store->chunks[chunk] = malloc(sizeof(store_chunk_t));
+    }
+    store_chunk_t* c = store->chunks[chunk];
+    int i = h & STORE_CHUNK_MASK;
+    c->start_pos[i] = pos;
+    person_t* p = c->persons + i;
+    person_init(p, id);
+    p->current_pos = pos;
+    p->goal_pos = goal;
+    p->time = time;
+    return h;
+}
+
+void store_rewind(store_t* store, store_handle_t h) {
+    store_chunk_t* c = store_chunk(store, h);
+    int i = h & STORE_CHUNK_MASK;
+    c->persons[i].current_pos = c->start_pos[i];
+}
+
+void store_join_all(store_t* store) {
+    person_group_t group;
+    person_group_init(&group);
+    for (size_t i = 0; i < store->size; ++i)
+        person_group_add(&group, store_get(store, i));
+    person_group_join(&group);
+}
+
+/* --- --- --- --- store_pool_t  --- --- --- --- */
+
+void store_pool_init(store_pool_t* pool) {
+    int err = pthread_mutex_init(&pool->mtx, NULL); assert(!err);
+    store_init(&pool->store);
+    pool->free = NULL;
+}
+
+void store_pool_destroy(store_pool_t* pool) {
+    store_destroy(&pool->store);
+    pthread_mutex_destroy(&pool->mtx);
+}
+
+void store_cache_init(store_cache_t* cache, store_pool_t* pool) {
+    cache->pool = pool;
+    cache->free = NULL;
+    cache->n_free = 0;
+}
+
+/**
+ * Passa até n pessoas da lista do cache para a do pool.
+ */
+static void store_cache_release(store_cache_t* cache, int n) {
+    if (!n || !cache->free)
+        return;
+    person_t* first = cache->free, *last = first;
+    int k = 1;
+    for (; k < n && last->wake_next; ++k)
+        last = last->wake_next;
+    cache->free = last->wake_next;
+    cache->n_free -= k;
+    LOCKPROF_SITE(site, "store_pool_t.mtx (release)");
+    uint64_t prof = lockprof_lock(&site, &cache->pool->mtx);
+    last->wake_next = cache->pool->free;
+    cache->pool->free = first;
+    lockprof_unlock(&site, &cache->pool->mtx, prof);
+}
+
+void store_cache_flush(store_cache_t* cache) {
+    store_cache_release(cache, cache->n_free);
+}
+
+/**
+ * Traz STORE_CACHE_BATCH pessoas para o cache: primeiro as livres do pool,
+ * depois pessoas novas do store do pool.
+ */
+static void store_cache_refill(store_cache_t* cache) {
+    store_pool_t* pool = cache->pool;
+    LOCKPROF_SITE(site, "store_pool_t.mtx (refill)");
+    uint64_t prof = lockprof_lock(&site, &pool->mtx);
+    int n = 0;
+    for (; n < STORE_CACHE_BATCH && pool->free; ++n) {
+        person_t* p = pool->free;
+        pool->free = p->wake_next;
+        p->wake_next = cache->free;
+        cache->free = p;
+    }
+    pos_t none = {-1, -1};
+    for (; n < STORE_CACHE_BATCH; ++n) {
+        person_t* p = store_get(&pool->store,
+                                store_add(&pool->store, 0, none, none, 0));
+        p->wake_next = cache->free;
+        cache->free = p;
+    }
+    lockprof_unlock(&site, &pool->mtx, prof);
+    cache->n_free += n;
+}
+
+person_t* store_cache_alloc(store_cache_t* cache, int id) {
+    if (!cache->free)
+        store_cache_refill(cache);
+    person_t* p = cache->free;
+    cache->free = p->wake_next;
+    --cache->n_free;
+    person_recycle(p, id);
+    return p;
+}
+
+void store_cache_free(store_cache_t* cache, person_t* person) {
+    person->wake_next = cache->free;
+    cache->free = person;
+    // guarda no máximo 2 lotes: o excesso volta ao pool
+    if (++cache->n_free > 2*STORE_CACHE_BATCH)
+        store_cache_release(cache, STORE_CACHE_BATCH);
+}
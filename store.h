@@ -0,0 +1,139 @@
+#ifndef INE5410_STORE_H_
+#define INE5410_STORE_H_
+
+#include "grid.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Armazém de pessoas. As pessoas ficam em blocos de STORE_CHUNK_SIZE que
+ * nunca mudam de lugar: crescer só aloca um bloco novo (e, de vez em quando,
+ * dobra a tabela de blocos), então o handle de uma pessoa (seu índice) e o
+ * seu endereço valem até store_destroy(), sem copiar nem reinicializar nada.
+ *
+ * Além dos person_t, cada bloco guarda num array separado a posição
+ * inicial de cada pessoa, que store_rewind() restaura. O estado que muda a
+ * cada turno (current_pos, goal_pos, time) fica no próprio person_t, e não
+ * em arrays separados por campo: o grid, os deques, as faixas e o heap de
+ * eventos entregam person_t*, e separar esses campos custaria uma indireção
+ * a mais em cada passo.
+ */
+#define STORE_CHUNK_BITS 10
+#define STORE_CHUNK_SIZE (1 << STORE_CHUNK_BITS)
+#define STORE_CHUNK_MASK (STORE_CHUNK_SIZE - 1)
+
+typedef uint32_t store_handle_t;
+
+typedef struct store_chunk_s {
+    pos_t start_pos[STORE_CHUNK_SIZE];
+    person_t persons[STORE_CHUNK_SIZE];
+} store_chunk_t;
+
+typedef struct store_s {
+    store_chunk_t** chunks;
+    size_t chunks_cap; ///< capacidade da tabela de blocos
+    size_t size;       ///< número de pessoas
+} store_t;
+
+void store_init(store_t* store);
+/**
+ * Chama person_destroy() em todas as pessoas e libera os blocos.
+ */
+void store_destroy(store_t* store);
+
+/**
+ * Acrescenta uma pessoa com person_init(id), current_pos = pos,
+ * goal_pos = goal e time = time, registrando pos como posição inicial.
+ * Retorna o handle da pessoa (O(1) amortizado).
+ *
+ * Precondições:
+ * - nenhuma outra thread usa store durante a chamada
+ */
+store_handle_t store_add(store_t* store, int id, pos_t pos, pos_t goal,
+                         size_t time);
+
+static inline store_chunk_t* store_chunk(const store_t* store, store_handle_t h) {
+    return store->chunks[h >> STORE_CHUNK_BITS];
+}
+
+/**
+ * Retorna a pessoa do handle h. O endereço não muda enquanto store existir.
+ */
+static inline person_t* store_get(const store_t* store, store_handle_t h) {
+    return store_chunk(store, h)->persons + (h & STORE_CHUNK_MASK);
+}
+
+/**
+ * Devolve a pessoa de h à posição inicial (o objetivo e o turno não mudam).
+ *
+ * Precondições:
+ * - a pessoa não está plugada em nenhuma simulação
+ */
+void store_rewind(store_t* store, store_handle_t h);
+
+/**
+ * Equivale a person_join() em cada pessoa de store, mas com uma única espera
+ * (veja person_group_t).
+ */
+void store_join_all(store_t* store);
+
+/* --- --- --- --- store_pool_t  --- --- --- --- */
+
+/**
+ * Quantas pessoas um store_cache_t troca com o pool de cada vez.
+ */
+#define STORE_CACHE_BATCH 32
+
+/**
+ * Pool de pessoas para quem cria e descarta pessoas continuamente. As
+ * pessoas vêm de um store_t (nunca mudam de lugar nem são liberadas antes de
+ * store_pool_destroy()) e as devolvidas são reaproveitadas com
+ * person_recycle(), sem malloc e sem gastar slots novos do grid.
+ *
+ * Cada thread usa o pool por um store_cache_t próprio, que guarda uma lista
+ * local de pessoas livres e só trava mtx para trocar STORE_CACHE_BATCH
+ * pessoas com a lista do pool.
+ */
+typedef struct store_pool_s {
+    pthread_mutex_t mtx;
+    store_t store;
+    person_t* free; ///< pessoas livres, encadeadas por wake_next
+} store_pool_t;
+
+typedef struct store_cache_s {
+    store_pool_t* pool;
+    person_t* free;
+    int n_free;
+} store_cache_t;
+
+void store_pool_init(store_pool_t* pool);
+/**
+ * Destrói todas as pessoas que o pool já entregou.
+ *
+ * Precondições:
+ * - todos os caches do pool foram esvaziados com store_cache_flush()
+ * - nenhuma pessoa do pool está plugada
+ */
+void store_pool_destroy(store_pool_t* pool);
+
+void store_cache_init(store_cache_t* cache, store_pool_t* pool);
+/**
+ * Devolve ao pool as pessoas livres do cache.
+ */
+void store_cache_flush(store_cache_t* cache);
+
+/**
+ * Retorna uma pessoa como se recém inicializada com person_init(id).
+ */
+person_t* store_cache_alloc(store_cache_t* cache, int id);
+/**
+ * Devolve person, que não deve mais ser usada, ao cache.
+ *
+ * Precondições:
+ * - as de person_recycle()
+ * - person veio de store_cache_alloc() com um cache do mesmo pool
+ */
+void store_cache_free(store_cache_t* cache, person_t* person);
+
+#endif /*INE5410_STORE_H_*/
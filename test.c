@@ -1,7 +1,12 @@
 #include "test.h"
+#include "scenario.h"
 #include <time.h>
 #include <sys/time.h>
-#include <regex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
@@ -12,189 +17,307 @@
 #define STAGE_PERSONS    3
 #define STAGE_INSERTIONS 4
 
-static int test_mk_rx(regex_t* rx, const char* str) {
-    int err;
-    if ((err = regcomp(rx, str, REG_EXTENDED|REG_NEWLINE))) {
-        int size = regerror(err, rx, NULL, 0);
-        char* err_buf = malloc(size+1);
-        regerror(err, rx, err_buf, size);
-        printf("Error compiling regex: %s\n", err_buf);
-        free(err_buf);
+#define LINE_OTHER    0 ///< cabeçalho, linha vazia ou linha não reconhecida
+#define LINE_SIZE     1 ///< "W x H"
+#define LINE_OBSTACLE 2 ///< "X,Y @ X1 x Y1"
+#define LINE_PERSON   3 ///< "X,Y -> GX,GY"
+#define LINE_INSERTIONS_HDR 4 ///< "insertions: MS"
+
+static int test__is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static int test__is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/**
+ * Casa o início de [s, end) com fmt, onde '%' lê um inteiro sem sinal
+ * (guardado em vals, na ordem) e os demais caracteres devem aparecer
+ * literalmente. Espaços e tabs são ignorados antes de cada elemento, exceto
+ * entre letras consecutivas de fmt. O restante da linha é ignorado.
+ *
+ * Retorna 1 se a linha casou.
+ */
+static int test__match(const char* s, const char* end, const char* fmt,
+                       int* vals) {
+    for (const char* f = fmt; *f; ++f) {
+        if (f == fmt || !test__is_alpha(f[-1]) || !test__is_alpha(*f)) {
+            while (s < end && test__is_blank(*s))
+                ++s;
+        }
+        if (*f == '%') {
+            if (s == end || *s < '0' || *s > '9')
+                return 0;
+            long v = 0;
+            for (; s < end && *s >= '0' && *s <= '9'; ++s)
+                v = v < INT_MAX ? v*10 + (*s - '0') : INT_MAX;
+            *vals++ = v < INT_MAX ? (int)v : INT_MAX;
+        } else if (s < end && *s == *f) {
+            ++s;
+        } else {
+            return 0;
+        }
     }
-    return err;
+    return 1;
 }
 
-int test_parse_int(const char* str, regmatch_t* match) {
-    char buf[32];
-    int size = match->rm_eo - match->rm_so;
-    assert(size < 32);
-    memcpy(buf, str+match->rm_so, size);
-    buf[size] = 0;
-    return strtol(buf, NULL, 10);
+/**
+ * Classifica a linha [s, end) de um arquivo .test. Cabeçalhos mudam *stage
+ * (o de inserções é LINE_INSERTIONS_HDR, com o intervalo em vals[0]); as
+ * demais linhas só são reconhecidas no formato esperado pelo estágio
+ * corrente. Retorna LINE_*, com os números da linha em vals.
+ */
+static int test__scan_line(const char* s, const char* end, int* stage,
+                           int vals[4]) {
+    if (test__match(s, end, "obstacles:", vals)) {
+        *stage = STAGE_OBSTACLES;
+    } else if (test__match(s, end, "persons:", vals)) {
+        *stage = STAGE_PERSONS;
+    } else if (test__match(s, end, "insertions:%", vals)) {
+        *stage = STAGE_INSERTIONS;
+        return LINE_INSERTIONS_HDR;
+    } else if (*stage == STAGE_SIZE) {
+        if (test__match(s, end, "%x%", vals))
+            return LINE_SIZE;
+    } else if (*stage == STAGE_OBSTACLES) {
+        if (test__match(s, end, "%,%@%x%", vals))
+            return LINE_OBSTACLE;
+    } else if (test__match(s, end, "%,%->%,%", vals)) {
+        return LINE_PERSON;
+    }
+    return LINE_OTHER;
 }
 
-static person_t* test__emplace_person(person_t** data, int* cap, int* size) {
-    if (*size == *cap) {
-        // validator-pthreads.c não lida bem com sem_t mudando de endereço
-        // destroi as pessoas e as reconstrói na nova localização
-        *cap *= 2;
-        person_t* ndata = (person_t*) malloc(*cap * sizeof(person_t));
-        for (int i = 0; i < *size; ++i) {
-            person_t cp = (*data)[i];
-            person_destroy(*data+i); //destroi sem_t
-            person_init(ndata+i, cp.id); //cria novo sem_t
-            ndata[i].current_pos = cp.current_pos;
-            ndata[i].goal_pos = cp.goal_pos;
-            ndata[i].time = cp.time;
+/**
+ * Mapeia o arquivo em path na memória (somente leitura). Um arquivo vazio
+ * resulta em *data == NULL e *size == 0. Retorna 0 ou o errno da falha.
+ */
+static int test__map_file(const char* path, const char** data, size_t* size) {
+    *data = NULL;
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno;
+    struct stat st;
+    int err = fstat(fd, &st) ? errno : 0;
+    if (!err && st.st_size > 0) {
+        void* m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            err = errno;
+        } else {
+            posix_madvise(m, st.st_size, POSIX_MADV_SEQUENTIAL);
+            *data = m;
+            *size = st.st_size;
         }
-        free(*data);
-        *data = ndata;
     }
-    person_t* p = *data + *size;
-    ++*size;
-    return p;
+    close(fd);
+    return err;
 }
 
-static void test__free_persons(person_t* data, int size) {
-    for (int i = 0; i < size; ++i)
-        person_destroy(data+i);
-    free(data);
+/**
+ * Plug de uma pessoa do bloco persons antes do início da simulação.
+ */
+static int test__plug_initial(test_t* t, person_t* p, const char* path) {
+    if (grid_get(&t->sim.grid, p->current_pos, NULL) != GRID_OBJ_EMPTY) {
+        printf("Caso de teste %s insere duas pessoas na posição (%d,%d)!\n",
+               path, p->current_pos.x, p->current_pos.y);
+        return 2;
+    }
+    simulation_plug_unsafe(&t->sim, p);
+    return 0;
 }
 
+/**
+ * Constrói o cenário a partir do texto de um arquivo .test, em
+ * [text, text+text_size), numa única passada. *initialized indica se
+ * simulation_init() já foi chamada.
+ */
+static int test__setup_text(test_t* t, int n_threads, const char* path,
+                            const char* text, size_t text_size,
+                            int* initialized) {
+    const char* text_end = text + text_size;
+    int err = 0, stage = STAGE_SIZE, vals[4];
+    for (const char* s = text, *eol; !err && s < text_end; s = eol+1) {
+        eol = memchr(s, '\n', text_end - s);
+        if (!eol)
+            eol = text_end;
+        int kind = test__scan_line(s, eol, &stage, vals);
+        if (kind == LINE_INSERTIONS_HDR) {
+            t->insertion_interval = vals[0];
+        } else if (kind == LINE_SIZE) {
+            if (!*initialized)
+                simulation_init(&t->sim, n_threads, vals[0], vals[1]);
+            *initialized = 1;
+        } else if ((kind == LINE_OBSTACLE || kind == LINE_PERSON)
+                   && !*initialized) {
+            break; // sem tamanho, não há grid onde colocar
+        } else if (kind == LINE_OBSTACLE) {
+            pos_t from = {vals[0], vals[1]}, to = {vals[2], vals[3]};
+            grid_fill_rect(&t->sim.grid, from, to, GRID_OBJ_OBSTACLE);
+        } else if (kind == LINE_PERSON) {
+            pos_t p0 = {vals[0], vals[1]}, p1 = {vals[2], vals[3]};
+            if (stage == STAGE_PERSONS) {
+                // o armazém não move as pessoas: já podem ser plugadas
+                store_handle_t h = store_add(&t->persons, ++t->pid, p0, p1, 0);
+                err = test__plug_initial(t, store_get(&t->persons, h), path);
+            } else {
+                store_add(&t->insertions, -1, p0, p1, 0);
+            }
+        }
+    }
+    if (!err && !*initialized) {
+        printf("Caso de teste %s não define o tamanho do grid\n", path);
+        err = 2;
+    }
+    return err;
+}
+
+/**
+ * Constrói o cenário a partir do arquivo binário (veja scenario.h) mapeado
+ * em [data, data+size). Um checkpoint retoma a simulação no seu turno.
+ */
+static int test__setup_binary(test_t* t, int n_threads, const char* path,
+                              void* data, size_t size, int* initialized) {
+    scenario_t s;
+    if (scenario_view(&s, data, size)) {
+        printf("Caso de teste %s não é um cenário binário válido\n", path);
+        return EINVAL;
+    }
+    const scenario_header_t* h = s.header;
+    simulation_init(&t->sim, n_threads, h->width, h->height);
+    *initialized = 1;
+    t->sim.time = h->time;
+    scenario_load_obstacles(&s, &t->sim.grid);
+    t->insertion_interval = h->insertion_interval;
 
-int  test_setup(test_t* t, int n_threads, const char* path) {
     int err = 0;
+    for (uint32_t i = 0; !err && i < h->n_persons; ++i) {
+        const scenario_person_t* r = s.persons+i;
+        store_handle_t sh = store_add(&t->persons, r->id, mk_pos(r->x, r->y),
+                                      mk_pos(r->goal_x, r->goal_y), r->time);
+        if (r->id > t->pid)
+            t->pid = r->id;
+        err = test__plug_initial(t, store_get(&t->persons, sh), path);
+    }
+    for (uint32_t i = 0; i < h->n_insertions; ++i) {
+        const scenario_person_t* r = s.insertions+i;
+        store_add(&t->insertions, r->id, mk_pos(r->x, r->y),
+                  mk_pos(r->goal_x, r->goal_y), r->time);
+    }
+    return err;
+}
+
+int  test_setup(test_t* t, int n_threads, const char* path) {
     t->pid = t->shutting_down = 0;
-    t->persons =    (person_t*)malloc(sizeof(person_t)*(t->persons_cap = 100));
-    t->insertions = (person_t*)malloc(sizeof(person_t)*(t->insertions_cap = 10));
-    t->insertions_size = t->persons_size = 0;
     t->insertion_interval = 0;
-    
-    t->file = fopen(path, "r");
-    if (t->file == NULL) {
-        int code = errno;
-	sprintf("Não consegui abrir o arquivo %s: %s", path, strerror(code));
-        return code;
-    }
+    store_init(&t->persons);
+    store_init(&t->insertions);
+    store_pool_init(&t->pool);
 
-    regex_t rx_hdr_obstacles, rx_hdr_persons, rx_hdr_insertions;
-    regex_t rx_size, rx_obstacle, rx_person;
-    test_mk_rx(&rx_hdr_obstacles, "obstacles[ \t]*:");
-    test_mk_rx(&rx_hdr_persons, "persons[ \t]*:");
-    test_mk_rx(&rx_hdr_insertions,
-               "insertions[ \t]*:[ \t]*([0-9]+)");
-    test_mk_rx(&rx_size, "([0-9]+)[ \t]*x[ \t]*([0-9]+)");
-    test_mk_rx(&rx_obstacle,
-               "([0-9]+) *, *([0-9]+) *@ *([0-9]+) *x *([0-9]+)");
-    test_mk_rx(&rx_person,
-               "([0-9]+) *, *([0-9]+) *-> *([0-9]+) *, *([0-9]+)");
-
-    char* buf = NULL;
-    size_t n = 0;
-    int stage = STAGE_SIZE;
-    regmatch_t groups[5]; // max number is 4 groups (rx_person) + whole
-    while (getline(&buf, &n, t->file)>=0) {
-        if (regexec(&rx_hdr_obstacles, buf, 1, groups, 0) == 0) {
-            stage = STAGE_OBSTACLES;
-        } else if (regexec(&rx_hdr_persons, buf, 1, groups, 0) == 0) {
-            stage = STAGE_PERSONS;
-        } else if (regexec(&rx_hdr_insertions, buf, 2, groups, 0) == 0) {
-            stage = STAGE_INSERTIONS;
-        } else if (stage == STAGE_SIZE) {
-            if (regexec(&rx_size, buf, 3, groups, 0) == 0) {
-                int w = test_parse_int(buf, groups+1);
-                int h = test_parse_int(buf, groups+2);
-                simulation_init(&t->sim, n_threads, w, h);
-            }
-        } else if (stage == STAGE_OBSTACLES) {
-            if (regexec(&rx_obstacle, buf, 5, groups, 0) == 0) {
-                int x = test_parse_int(buf, groups+1);
-                int y = test_parse_int(buf, groups+2);
-                int w = test_parse_int(buf, groups+3);
-                int h = test_parse_int(buf, groups+4);
-                for (pos_t p = {x, y}; p.y < h; ++p.y) {
-                    for (p.x = x; p.x < w; ++p.x) 
-                        grid_set(&t->sim.grid, p, GRID_OBJ_OBSTACLE);
-                }
-            }
-        } else if (stage == STAGE_PERSONS || stage == STAGE_INSERTIONS) {
-            if (regexec(&rx_person, buf, 5, groups, 0) == 0) {
-                pos_t p0 = {0, 0}, p1 = {0, 0};
-                p0.x = test_parse_int(buf, groups+1);
-                p0.y = test_parse_int(buf, groups+2);
-                p1.x = test_parse_int(buf, groups+3);
-                p1.y = test_parse_int(buf, groups+4);
-                person_t* p;
-                if (stage == STAGE_PERSONS) {
-                    p = test__emplace_person(&t->persons, &t->persons_cap,
-                                             &t->persons_size);
-                    person_init(p, ++t->pid);
-                } else {
-                    p = test__emplace_person(&t->insertions, &t->insertions_cap,
-                                             &t->insertions_size);
-                    person_init(p, -1);
-                }
-                p->current_pos = p0;
-                p->goal_pos    = p1;
-                if (stage == STAGE_PERSONS) {
-                    if (grid_get(&t->sim.grid, p0, NULL) != GRID_OBJ_EMPTY) {
-                        printf("Caso de teste %s insere duas pessoas na "
-                               "posição (%d,%d)!\n", path, p0.x, p0.y);
-                        err = 2;
-                        break;
-                    }
-                    simulation_plug_unsafe(&t->sim, p);
-                }
-            }
-        }
+    const char* text;
+    size_t text_size;
+    int err = test__map_file(path, &text, &text_size);
+    if (err) {
+        printf("Não consegui abrir o arquivo %s: %s\n", path, strerror(err));
+        return err;
     }
+    int initialized = 0;
+    if (scenario_is_binary(text, text_size))
+        err = test__setup_binary(t, n_threads, path, (void*)text, text_size,
+                                 &initialized);
+    else
+        err = test__setup_text(t, n_threads, path, text, text_size,
+                               &initialized);
 
-    regfree(&rx_hdr_obstacles);
-    regfree(&rx_hdr_persons);
-    regfree(&rx_hdr_insertions);
-    regfree(&rx_size);
-    regfree(&rx_obstacle);
-    regfree(&rx_person);
-    free(buf);
+    if (text)
+        munmap((void*)text, text_size);
     if (err) {
-        simulation_destroy(&t->sim);
-        test__free_persons(t->persons, t->persons_size);
-        test__free_persons(t->insertions, t->insertions_size);
+        if (initialized)
+            simulation_destroy(&t->sim);
+        store_destroy(&t->persons);
+        store_destroy(&t->insertions);
+        store_pool_destroy(&t->pool);
     }
     return err;
 }
 
+int test_save(test_t* t, const char* path) {
+    scenario_t s;
+    scenario_create(&s, &t->sim.grid, t->sim.time, t->persons.size,
+                    t->insertions.size, t->insertion_interval);
+    for (size_t i = 0; i < t->persons.size; ++i)
+        scenario_pack(s.persons+i, store_get(&t->persons, i));
+    for (size_t i = 0; i < t->insertions.size; ++i)
+        scenario_pack(s.insertions+i, store_get(&t->insertions, i));
+    int err = scenario_save(&s, path);
+    scenario_close(&s);
+    return err;
+}
+
 void* test_inserter(void* arg) {
     test_t* t = (test_t*)arg;
+    size_t n = t->insertions.size;
+    // lotes vazios ainda acordam a simulação e fazem o turno avançar
+    if (!n)
+        return NULL;
+    person_t** live = malloc((n ? n : 1)*sizeof(person_t*));
+    store_cache_t cache;
+    store_cache_init(&cache, &t->pool);
+    // Um lote para todas as inserções e outro para todas as remoções: cada
+    // um é aplicado de uma vez, numa única passagem de turno
+    sim_batch_t plugs, unplugs;
+    sim_batch_init(&plugs, NULL, NULL);
+    sim_batch_init(&unplugs, NULL, NULL);
     while (!t->shutting_down) {
+        // cada inserção é uma pessoa nova, tirada do pool
         int ipid = t->pid;
-        for (int i = 0; i < t->insertions_size; ++i) {
-            t->insertions[i].id = ++ipid;
-            simulation_plug(&t->sim, t->insertions+i);
+        person_group_t group;
+        person_group_init(&group);
+        for (size_t i = 0; i < n; ++i) {
+            const person_t* tpl = store_get(&t->insertions, i);
+            person_t* p = live[i] = store_cache_alloc(&cache, ++ipid);
+            p->current_pos = tpl->current_pos;
+            p->goal_pos = tpl->goal_pos;
+            sim_batch_plug(&plugs, p);
+            sim_batch_unplug(&unplugs, p);
         }
+        simulation_submit_batch(&t->sim, &plugs);
         if (t->insertion_interval) {
             struct timespec ts = {0, 1000000l*t->insertion_interval};
             nanosleep(&ts, NULL);
         }
-        for (int i = 0; i < t->insertions_size; ++i) 
-            simulation_unplug(&t->sim, t->insertions+i);
+        // os lotes são aplicados em ordem: quando unplugs termina, plugs
+        // também terminou
+        simulation_submit_batch(&t->sim, &unplugs);
+        sim_batch_wait(&unplugs);
+        // a pessoa só deixa a lista da simulação na passagem de turno
+        // seguinte: o grupo espera até que ninguém mais a use
+        for (size_t i = 0; i < n; ++i)
+            person_group_add(&group, live[i]);
+        person_group_join(&group);
+        for (size_t i = 0; i < n; ++i)
+            store_cache_free(&cache, live[i]);
+        sim_batch_clear(&plugs);
+        sim_batch_clear(&unplugs);
     }
+    store_cache_flush(&cache);
+    sim_batch_destroy(&plugs);
+    sim_batch_destroy(&unplugs);
+    free(live);
     return NULL;
 }
 
 void test_run(test_t* t, int cycles) {
-    pos_t* initials = (pos_t*)malloc(t->persons_size*sizeof(pos_t));
-    for (int i = 0; i < t->persons_size; ++i)
-        initials[i] = t->persons[i].current_pos;
-
+    sim_batch_t replug;
+    sim_batch_init(&replug, NULL, NULL);
     pthread_create(&t->inserter, NULL, test_inserter, t);
     simulation_start(&t->sim);
     double sum_ms = 0;
     struct timeval start, end;
     gettimeofday(&start, NULL);
     for (int i = 0; i < cycles; ++i) {
-        for (int j = 0; j < t->persons_size; ++j)
-            person_join(t->persons+j);
+        store_join_all(&t->persons);
         gettimeofday(&end, NULL);
 
         double s_usec = start.tv_sec*1000.0 + start.tv_usec/1000.0,
@@ -206,24 +329,38 @@ void test_run(test_t* t, int cycles) {
 
         if (i < cycles-1) {
             gettimeofday(&start, NULL);
-            //plug them back in their initial positions
-            for (int j = 0; j < t->persons_size; ++j) {
-                t->persons[j].current_pos = initials[j];
-                simulation_plug(&t->sim, t->persons+j);
+            //plug them back in their initial positions, all in the same
+            //turn boundary
+            for (size_t j = 0; j < t->persons.size; ++j) {
+                store_rewind(&t->persons, j);
+                sim_batch_plug(&replug, store_get(&t->persons, j));
             }
+            simulation_submit_batch(&t->sim, &replug);
+            sim_batch_wait(&replug);
+            sim_batch_clear(&replug);
         }
     }
+    sim_batch_destroy(&replug);
     printf("Avg. per cycle: %.3f\n", sum_ms/cycles);
-
-    free(initials);
+    sim_stats_t st;
+    simulation_get_stats(&t->sim, &st);
+    printf("Scheduler: %zu turns, %zu steps (%zu moves), %zu steals "
+           "(%zu attempts), %.3f ms idle, %zu parked, %zu stalls\n",
+           st.turns, st.steps, st.moves, st.steals, st.steal_attempts,
+           st.idle_ms, st.parked, st.stalls);
+    printf("Gridlock: %zu checks, %zu stuck, %zu cycles (%zu moves), "
+           "%zu reroutes, %zu stranded\n", st.gridlock.checks,
+           st.gridlock.stuck, st.gridlock.cycles, st.gridlock.moves,
+           st.gridlock.reroutes, st.gridlock.stranded);
 }
 
 void test_tear_down(test_t* t) {
     t->shutting_down = 1;
-    pthread_join(t->inserter, NULL);
+    if (t->sim.started) // a thread inserter é criada em test_run()
+        pthread_join(t->inserter, NULL);
     simulation_destroy(&t->sim);
-    for (int i = 0; i < t->persons_size; ++i)
-        person_join(t->persons+i);
-    test__free_persons(t->persons, t->persons_size);
-    test__free_persons(t->insertions, t->insertions_size);
+    store_join_all(&t->persons);
+    store_destroy(&t->persons);
+    store_destroy(&t->insertions);
+    store_pool_destroy(&t->pool);
 }
@@ -1,13 +1,10 @@
 #ifndef INE5410_TEST_H_
 
 #include "simulation.h"
+#include "store.h"
 #include <stdio.h>
 
 typedef struct test_s {
-    /**
-     * Arquivo descrevendo o cenário de teste.
-     */
-    FILE* file;
     simulation_t sim;
     /**
      * Contador usado para atribuir id's aos person_t's inseridos no
@@ -22,12 +19,9 @@ typedef struct test_s {
     int shutting_down;
 
     /**
-     * Arrays de pessoas a serem simulation_plug()adas antes do início
-     * da simulação.
+     * Pessoas a serem simulation_plug()adas antes do início da simulação.
      */
-    person_t* persons;
-    int persons_cap;  ///< capacidade de persons
-    int persons_size; ///< número de person_t's atualmente em persons
+    store_t persons;
     
     /**
      * Thread que repetidamente chama simulation_plug()/simulation_unplug().
@@ -41,17 +35,21 @@ typedef struct test_s {
     int insertion_interval;
 
     /**
-     * Lista de pessoas a serem simulation_plug()adas e
-     * simulation_unplug()adas em cada loop da thread inserter.
+     * Posições e objetivos das pessoas que a thread inserter
+     * simulation_plug()a e simulation_unplug()a em cada loop.
+     */
+    store_t insertions;
+    /**
+     * De onde a thread inserter tira uma pessoa nova para cada inserção, a
+     * cada loop.
      */
-    person_t* insertions;
-    int insertions_cap;  ///< capacidade de insertions
-    int insertions_size; ///<  número de person_t's atualmente em insertions
+    store_pool_t pool;
 } test_t;
 
 /**
  * Configura um cenário de teste, inicializando todos os atributos do test_t*
- * fornecido. path é o caminho do arquivo .test e n_threads é repassado a 
+ * fornecido. path é o caminho do arquivo .test (em texto ou no formato
+ * binário de scenario.h, como um checkpoint) e n_threads é repassado a 
  * simulation_init().
  * 
  * Caso ocorra um erro, essa função destruirá tudo que foi inicializado, de modo
@@ -59,6 +57,13 @@ typedef struct test_s {
  */
 int  test_setup(test_t* test, int n_threads, const char* path);
 
+/**
+ * Grava o cenário (grid, persons e insertions) no formato binário de
+ * scenario.h, que test_setup() também aceita. Deve ser chamada antes de
+ * test_run(). Retorna 0 ou o errno da escrita.
+ */
+int  test_save(test_t* test, const char* path);
+
 /**
  * Chama simulation_start(), executa cycles ciclos de
  * simulation_plug()/simulation_unplug() com test->persons. Essa